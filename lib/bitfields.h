@@ -0,0 +1,72 @@
+/// \file bitfields.h
+/// Holds helpers for reading and writing big-endian integers, as used by all binary DTSC layouts.
+/// This header is internal to the library and is not installed.
+
+#pragma once
+#include <string>
+
+namespace Bit {
+  /// Reads a big-endian 32 bits integer at p, which need not be aligned.
+  inline unsigned int btohl(const char * p){
+    const unsigned char * u = (const unsigned char *)p;
+    return ((unsigned int)u[0] << 24) | ((unsigned int)u[1] << 16) | ((unsigned int)u[2] << 8) | (unsigned int)u[3];
+  }
+
+  /// Reads a big-endian 64 bits integer at p, which need not be aligned.
+  inline long long unsigned int btohll(const char * p){
+    return ((long long unsigned int)btohl(p) << 32) | btohl(p + 4);
+  }
+
+  /// Writes val to p as a 32 bits big-endian integer.
+  /// \returns The position right after the written integer.
+  inline char * htobl(char * p, unsigned int val){
+    p[0] = (val >> 24) & 0xFF;
+    p[1] = (val >> 16) & 0xFF;
+    p[2] = (val >> 8) & 0xFF;
+    p[3] = val & 0xFF;
+    return p + 4;
+  }
+
+  /// Writes val to p as a 64 bits big-endian integer.
+  /// \returns The position right after the written integer.
+  inline char * htobll(char * p, long long unsigned int val){
+    p = htobl(p, (unsigned int)(val >> 32));
+    return htobl(p, (unsigned int)(val & 0xFFFFFFFF));
+  }
+
+  /// Appends a big-endian 32 bits integer to out.
+  inline void appendl(std::string & out, unsigned int val){
+    char tmp[4];
+    htobl(tmp, val);
+    out.append(tmp, 4);
+  }
+
+  /// Appends a big-endian 64 bits integer to out.
+  inline void appendll(std::string & out, long long unsigned int val){
+    char tmp[8];
+    htobll(tmp, val);
+    out.append(tmp, 8);
+  }
+
+  /// Reads a big-endian 32 bits integer at p into val and moves p past it.
+  /// \returns False, without reading, if it does not fit before end.
+  inline bool readl(const char * & p, const char * end, unsigned int & val){
+    if (end - p < 4){
+      return false;
+    }
+    val = btohl(p);
+    p += 4;
+    return true;
+  }
+
+  /// Reads a big-endian 64 bits integer at p into val and moves p past it.
+  /// \returns False, without reading, if it does not fit before end.
+  inline bool readll(const char * & p, const char * end, long long unsigned int & val){
+    if (end - p < 8){
+      return false;
+    }
+    val = btohll(p);
+    p += 8;
+    return true;
+  }
+}
@@ -3,17 +3,39 @@
 
 #include "dtsc.h"
 #include <stdlib.h>
+#include <algorithm> //for the heap functions
+#include <sstream>
 #include <string.h> //for memcmp
 #include <arpa/inet.h> //for htonl/ntohl
+#include <sys/mman.h> //for mmap
+#include <sys/stat.h> //for fstat
+#include <unistd.h> //for access
+#include <time.h>
 char DTSC::Magic_Header[] = "DTSC";
 char DTSC::Magic_Packet[] = "DTPD";
 char DTSC::Magic_Packet2[] = "DTP2";
+char DTSC::Magic_HeaderDelta[] = "DTHD";
+#define RING_FREE 0xFFFFFFFFFFFFFFFFull ///< Value of a DTSC::Stream::ringSeqs entry that has no ring.
+volatile long long unsigned int DTSC::Stream::processBytes = 0;
+long long unsigned int DTSC::Stream::processByteLimit = 0;
 
 /// Initializes a DTSC::Stream with only one packet buffer.
 DTSC::Stream::Stream(){
   datapointertype = DTSC::INVALID;
   buffercount = 1;
   buffertime = 0;
+  bufferedPackets = 0;
+  bufferedBytes = 0;
+  byteLimit = 0;
+  resets = 0;
+  statCount = 0;
+  resyncs = 0;
+  syncing = false;
+  headerCount = 0;
+  keysSinceSnapshot = 0;
+  fragmentDuration = 5000;
+  fragmentMinKeys = 2;
+  shared = 0;
 }
 
 /// Initializes a DTSC::Stream with a minimum of rbuffers packet buffers.
@@ -25,6 +47,18 @@ DTSC::Stream::Stream(unsigned int rbuffers, unsigned int bufferTime){
   }
   buffercount = rbuffers;
   buffertime = bufferTime;
+  bufferedPackets = 0;
+  bufferedBytes = 0;
+  byteLimit = 0;
+  resets = 0;
+  statCount = 0;
+  resyncs = 0;
+  syncing = false;
+  headerCount = 0;
+  keysSinceSnapshot = 0;
+  fragmentDuration = 5000;
+  fragmentMinKeys = 2;
+  shared = 0;
 }
 
 /// This function does nothing, it's supposed to be overridden.
@@ -34,7 +68,11 @@ void DTSC::Stream::deletionCallback(livePos deleting){}
 /// Returns the time in milliseconds of the last received packet.
 /// This is _not_ the time this packet was received, only the stored time.
 unsigned int DTSC::Stream::getTime(){
-  return buffers.rbegin()->second["time"].asInt();
+  liveSlot * newest = newestSlot();
+  if ( !newest){
+    return 0;
+  }
+  return newest->pack["time"].asInt();
 }
 
 /// Attempts to parse a packet from the given std::string buffer.
@@ -43,7 +81,6 @@ unsigned int DTSC::Stream::getTime(){
 /// \arg buffer The std::string buffer to attempt to parse.
 bool DTSC::Stream::parsePacket(std::string & buffer){
   uint32_t len;
-  static bool syncing = false;
   if (buffer.length() > 8){
     if (memcmp(buffer.c_str(), DTSC::Magic_Header, 4) == 0){
       len = ntohl(((uint32_t *)buffer.c_str())[1]);
@@ -52,19 +89,26 @@ bool DTSC::Stream::parsePacket(std::string & buffer){
       }
       unsigned int i = 0;
       metadata = JSON::fromDTMI((unsigned char*)buffer.c_str() + 8, len, i);
-      metadata.removeMember("moreheader");
-      metadata.netPrepare();
-      trackMapping.clear();
-      if (metadata.isMember("tracks")){
-        for (JSON::ObjIter it = metadata["tracks"].ObjBegin(); it != metadata["tracks"].ObjEnd(); it++){
-          trackMapping.insert(std::pair<int,std::string>(it->second["trackid"].asInt(),it->first));
-        }
-      }
+      loadMeta();
+      headerCount++;
       buffer.erase(0, len + 8);
       if (buffer.length() <= 8){
         return false;
       }
     }
+    if (memcmp(buffer.c_str(), DTSC::Magic_HeaderDelta, 4) == 0){
+      len = ntohl(((uint32_t *)buffer.c_str())[1]);
+      if (buffer.length() < len + 8){
+        return false;
+      }
+      unsigned int i = 0;
+      JSON::Value delta = JSON::fromDTMI((unsigned char*)buffer.c_str() + 8, len, i);
+      applyDelta(delta);
+      headerCount++;
+      buffer.erase(0, len + 8);
+      //recursively calls itself until failure or data packet instead of header
+      return parsePacket(buffer);
+    }
     int version = 0;
     if (memcmp(buffer.c_str(), DTSC::Magic_Packet, 4) == 0){
       version = 1;
@@ -77,6 +121,7 @@ bool DTSC::Stream::parsePacket(std::string & buffer){
       if (buffer.length() < len + 8){
         return false;
       }
+      long long unsigned int parseStart = Util::getNS();
       JSON::Value newPack;
       unsigned int i = 0;
       if (version == 1){
@@ -86,16 +131,18 @@ bool DTSC::Stream::parsePacket(std::string & buffer){
         newPack = JSON::fromDTMI2((unsigned char*)buffer.c_str() + 8, len, i);
       }
       buffer.erase(0, len + 8);
+      parseTime.add(Util::getNS() - parseStart);
       addPacket(newPack);
       syncing = false;
       return true;
     }
+    if ( !syncing){
+      resyncs++;
 #if DEBUG >= 2
-    if (!syncing){
       std::cerr << "Error: Invalid DTMI data detected - re-syncing" << std::endl;
+#endif
       syncing = true;
     }
-#endif
     size_t magic_search = buffer.find(Magic_Packet);
     size_t magic_search2 = buffer.find(Magic_Packet2);
     if (magic_search2 == std::string::npos){
@@ -117,7 +164,6 @@ bool DTSC::Stream::parsePacket(std::string & buffer){
 /// \arg buffer The Socket::Buffer to attempt to parse.
 bool DTSC::Stream::parsePacket(Socket::Buffer & buffer){
   uint32_t len;
-  static bool syncing = false;
   if (buffer.available(8)){
     std::string header_bytes = buffer.copy(8);
     if (memcmp(header_bytes.c_str(), DTSC::Magic_Header, 4) == 0){
@@ -128,16 +174,21 @@ bool DTSC::Stream::parsePacket(Socket::Buffer & buffer){
       unsigned int i = 0;
       std::string wholepacket = buffer.remove(len + 8);
       metadata = JSON::fromDTMI((unsigned char*)wholepacket.c_str() + 8, len, i);
-      metadata.removeMember("moreheader");
-      if (buffercount > 1){
-        metadata.netPrepare();
-      }
-      if (metadata.isMember("tracks")){
-        trackMapping.clear();
-        for (JSON::ObjIter it = metadata["tracks"].ObjBegin(); it != metadata["tracks"].ObjEnd(); it++){
-          trackMapping.insert(std::pair<int,std::string>(it->second["trackid"].asInt(),it->first));
-        }
+      loadMeta();
+      headerCount++;
+      //recursively calls itself until failure or data packet instead of header
+      return parsePacket(buffer);
+    }
+    if (memcmp(header_bytes.c_str(), DTSC::Magic_HeaderDelta, 4) == 0){
+      len = ntohl(((uint32_t *)header_bytes.c_str())[1]);
+      if ( !buffer.available(len + 8)){
+        return false;
       }
+      unsigned int i = 0;
+      std::string wholepacket = buffer.remove(len + 8);
+      JSON::Value delta = JSON::fromDTMI((unsigned char*)wholepacket.c_str() + 8, len, i);
+      applyDelta(delta);
+      headerCount++;
       //recursively calls itself until failure or data packet instead of header
       return parsePacket(buffer);
     }
@@ -153,6 +204,7 @@ bool DTSC::Stream::parsePacket(Socket::Buffer & buffer){
       if ( !buffer.available(len + 8)){
         return false;
       }
+      long long unsigned int parseStart = Util::getNS();
       JSON::Value newPack;
       unsigned int i = 0;
       std::string wholepacket = buffer.remove(len + 8);
@@ -162,36 +214,86 @@ bool DTSC::Stream::parsePacket(Socket::Buffer & buffer){
       if (version == 2){
         newPack = JSON::fromDTMI2((unsigned char*)wholepacket.c_str() + 8, len, i);
       }
+      parseTime.add(Util::getNS() - parseStart);
       addPacket(newPack);
       syncing = false;
       return true;
     }
+    if ( !syncing){
+      resyncs++;
 #if DEBUG >= 2
-    if (!syncing){
       std::cerr << "Error: Invalid DTMI data detected - syncing" << std::endl;
+#endif
       syncing = true;
     }
-#endif
     buffer.get().clear();
   }
   return false;
 }
 
+/// Loads meta and the track mapping from a header that was just stored in metadata.
+/// Keys and fragments stay in metadata as well, and are kept up to date from meta by syncMeta().
+void DTSC::Stream::loadMeta(){
+  metadata.removeMember("moreheader");
+  meta.fromJSON(metadata);
+  trackMapping.clear();
+  if (metadata.isMember("tracks")){
+    for (JSON::ObjIter it = metadata["tracks"].ObjBegin(); it != metadata["tracks"].ObjEnd(); it++){
+      trackMapping.insert(std::pair<int,std::string>(it->second["trackid"].asInt(),it->first));
+    }
+  }
+  publishHeader();
+}
+
+/// Writes a header delta for the track at the given position into the shared segment and the ring log, if they are in use.
+/// The delta holds all keys that may have changed since the last full header was published.
+void DTSC::Stream::publishDelta(const livePos & pos){
+  if ( !shared && !ringLog){
+    return;
+  }
+  std::string & delta = outHeaderDelta(pos.trackID, deltaStart[pos.trackID]);
+  if (shared){
+    shared->addPacket(delta, pos, false);
+  }
+  ringLog.addPacket(delta, pos, false);
+}
+
+/// Writes the current header to the shared segment and the ring log, if they are in use.
+/// Later header deltas will hold all keys from the newest key of every track onwards, since that key may still change.
+void DTSC::Stream::publishHeader(){
+  if ( !shared && !ringLog){
+    return;
+  }
+  std::string & header = outHeader();
+  if (shared){
+    shared->setHeader(header);
+  }
+  ringLog.setHeader(header);
+  deltaStart.clear();
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    if (it->second.keys.size()){
+      deltaStart[it->first] = it->second.keys.back().num;
+    }
+  }
+  keysSinceSnapshot = 1;
+}
+
 /// Adds a keyframe packet to all tracks, so the stream can be fully played.
 void DTSC::Stream::endStream(){
-  if (metadata.isMember("tracks") && metadata["tracks"].size() > 0){
-    JSON::Value trackData = metadata["tracks"];
-    for (JSON::ObjIter it = trackData.ObjBegin(); it != trackData.ObjEnd(); it++){
-      if(it->second.isMember("lastms") && it->second.isMember("trackid")){	// TODO
-        JSON::Value newPack;
-        newPack["time"] = it->second["lastms"];
-        newPack["trackid"] = it->second["trackid"];
-        newPack["keyframe"] = 1ll;
-        newPack["data"] = "";
-        addPacket(newPack);
-      }
+  std::map<int,long long int> lastTimes;
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    if (it->second.name.size() && (it->second.lastms || it->second.keys.size())){
+      lastTimes[it->first] = it->second.lastms;
     }
   }
+  for (std::map<int,long long int>::iterator it = lastTimes.begin(); it != lastTimes.end(); it++){
+    JSON::Value newPack;
+    newPack["time"] = it->second;
+    newPack["trackid"] = (long long int)it->first;
+    newPack["keyframe"] = 1ll;
+    newPack["data"] = "";
+    addPacket(newPack);
+  }
 }
 
 /// Blocks until either the stream has metadata available or the sourceSocket errors.
@@ -219,20 +321,59 @@ void DTSC::Stream::waitForMeta(Socket::Connection & sourceSocket){
 
 /// Resets the stream by clearing the buffers and keyframes, making sure to call the deletionCallback first.
 void DTSC::Stream::resetStream(){
-  for (std::map<livePos, JSON::Value >::iterator it = buffers.begin(); it != buffers.end(); it++){
-    deletionCallback(it->first);
+  for (std::map<int,PacketRing>::iterator it = buffers.begin(); it != buffers.end(); it++){
+    for (unsigned int i = 0; i < it->second.size(); i++){
+      deletionCallback(it->second[i].pos);
+    }
   }
   buffers.clear();
   keyframes.clear();
+  bufferedPackets = 0;
+  __sync_fetch_and_sub(&processBytes, bufferedBytes);
+  bufferedBytes = 0;
+  resets++;
+}
+
+/// Returns the slot holding the packet at the given position, or NULL if it is not buffered.
+DTSC::liveSlot * DTSC::Stream::findSlot(livePos & pos){
+  std::map<int,PacketRing>::iterator it = buffers.find(pos.trackID);
+  if (it == buffers.end()){
+    return 0;
+  }
+  int index = it->second.find(pos);
+  if (index < 0){
+    return 0;
+  }
+  return &(it->second[index]);
+}
+
+/// Returns the slot holding the oldest buffered packet over all tracks, or NULL if the buffer is empty.
+DTSC::liveSlot * DTSC::Stream::oldestSlot(){
+  liveSlot * result = 0;
+  for (std::map<int,PacketRing>::iterator it = buffers.begin(); it != buffers.end(); it++){
+    if (it->second.size() && ( !result || it->second.front().pos < result->pos)){
+      result = &(it->second.front());
+    }
+  }
+  return result;
+}
+
+/// Returns the slot holding the most recently added packet, or NULL if the buffer is empty.
+DTSC::liveSlot * DTSC::Stream::newestSlot(){
+  if ( !bufferedPackets){
+    return 0;
+  }
+  return &(buffers[newestPos.trackID].back());
 }
 
 void DTSC::Stream::addPacket(JSON::Value & newPack){
+  long long unsigned int addStart = Util::getNS();
   long long unsigned int now = Util::getMS();
   livePos newPos;
   newPos.trackID = newPack["trackid"].asInt();
   newPos.seekTime = newPack["time"].asInt();
-  if (buffercount > 1 && buffers.size() > 0){
-    livePos lastPos = buffers.rbegin()->first;
+  if (buffercount > 1 && bufferedPackets > 0){
+    livePos lastPos = newestPos;
     if (newPos < lastPos){
       if ((lastPos.seekTime > 1000) && newPos.seekTime < lastPos.seekTime - 1000){
         resetStream();
@@ -243,18 +384,17 @@ void DTSC::Stream::addPacket(JSON::Value & newPack){
   }else{
     resetStream();
   }
-  std::string newTrack = trackMapping[newPos.trackID];
-  while (buffers.count(newPos) > 0){
-    newPos.seekTime++;
-  }
-  buffers[newPos] = newPack;
-  if (buffercount > 1){
-    buffers[newPos].toNetPacked();//make sure package is packed and ready
+  PacketRing & ring = buffers[newPos.trackID];
+  //positions never decrease, so only the newest packet of this track can be in the way
+  if (ring.size() && ring.back().pos.seekTime >= newPos.seekTime){
+    newPos.seekTime = ring.back().pos.seekTime + 1;
   }
+  Track & track = meta.tracks[newPos.trackID];
+  track.trackID = newPos.trackID;
   datapointertype = INVALID;
   std::string tmp = "";
   if (newPack.isMember("trackid")){
-    tmp = getTrackById(newPack["trackid"].asInt())["type"].asStringRef();
+    tmp = track.type;
   }
   if (newPack.isMember("datatype")){
     tmp = newPack["datatype"].asStringRef();
@@ -271,134 +411,204 @@ void DTSC::Stream::addPacket(JSON::Value & newPack){
   if (tmp == "pause_marker"){
     datapointertype = PAUSEMARK;
   }
-  int keySize = metadata["tracks"][newTrack]["keys"].size();
+  long long int packTime = newPack["time"].asInt();
+  bool hasKeyframe = newPack.isMember("keyframe");
+  liveSlot & slot = ring.push();
+  slot.pos = newPos;
+  slot.keyframe = false;
+  slot.dataSize = newPack["data"].asStringRef().size();
+  slot.pack.swap(newPack);
+  slot.bytes = slot.dataSize;
+  if (buffercount > 1 || shared || ringLog){
+    slot.bytes += slot.pack.toNetPacked().size();//make sure package is packed and ready
+  }
+  trackStats * stats = getTrackStats(newPos.trackID);
+  if (stats){
+    if (stats->second != now / 1000){
+      stats->lastPackets = (stats->second + 1 == now / 1000 ? stats->secondPackets : 0);
+      stats->lastBytes = (stats->second + 1 == now / 1000 ? stats->secondBytes : 0);
+      stats->secondPackets = 0;
+      stats->secondBytes = 0;
+      __sync_synchronize();
+      stats->second = now / 1000;
+    }
+    stats->packets++;
+    stats->bytes += slot.dataSize;
+    stats->secondPackets++;
+    stats->secondBytes += slot.dataSize;
+  }
+  ring.bytes += slot.bytes;
+  bufferedBytes += slot.bytes;
+  __sync_fetch_and_add(&processBytes, (long long unsigned int)slot.bytes);
+  bufferedPackets++;
+  newestPos = newPos;
   if (buffercount > 1){
-    #define prevKey metadata["tracks"][newTrack]["keys"][keySize - 1]
-    if (newPack.isMember("keyframe") || !keySize || (datapointertype != VIDEO && newPack["time"].asInt() - 5000 > prevKey["time"].asInt())){
-      metadata["tracks"][newTrack]["lastms"] = newPack["time"];
-      keyframes[newPos.trackID].insert(newPos);
-      JSON::Value key;
-      key["time"] = newPack["time"];
-      if (keySize){
-        key["num"] = prevKey["num"].asInt() + 1;
-        prevKey["len"] = newPack["time"].asInt() - prevKey["time"].asInt();
-        int size = 0;
-        for (JSON::ArrIter it = prevKey["parts"].ArrBegin(); it != prevKey["parts"].ArrEnd(); it++){
-          size += it->asInt();
-        }
-        prevKey["partsize"] = prevKey["parts"].size();
-        std::string tmpParts = JSON::encodeVector(prevKey["parts"].ArrBegin(), prevKey["parts"].ArrEnd());
-        prevKey["parts"] = tmpParts;
-        prevKey["size"] = size;
-        long long int bps = (double)prevKey["size"].asInt() / ((double)prevKey["len"].asInt() / 1000.0);
-        if (bps > metadata["tracks"][newTrack]["maxbps"].asInt()){
-          metadata["tracks"][newTrack]["maxbps"] = (long long int)(bps * 1.2);
+    if (hasKeyframe || !track.keys.size() || (datapointertype != VIDEO && packTime - 5000 > (long long int)track.keys.back().time)){
+      track.lastms = packTime;
+      keyframes[newPos.trackID].push_back(newPos);
+      slot.keyframe = true;
+      Key newKey;
+      newKey.time = packTime;
+      if (track.keys.size()){
+        Key & prevKey = track.keys.back();
+        newKey.num = prevKey.num + 1;
+        prevKey.len = packTime - prevKey.time;
+        long long int bps = (double)prevKey.size / ((double)prevKey.len / 1000.0);
+        if (bps > track.maxbps){
+          track.maxbps = (long long int)(bps * 1.2);
         }
       }else{
-        key["num"] = 1;
+        newKey.num = 1;
       }
-      metadata["tracks"][newTrack]["keys"].append(key);
-      keySize = metadata["tracks"][newTrack]["keys"].size();
-
-      //find the last fragment
-      JSON::Value lastFrag;
-      if (metadata["tracks"][newTrack]["frags"].size() > 0){
-        lastFrag = metadata["tracks"][newTrack]["frags"][metadata["tracks"][newTrack]["frags"].size() - 1];
-      }
-      //find the first keyframe past the last fragment
-      JSON::ArrIter fragIt = metadata["tracks"][newTrack]["keys"].ArrBegin();
-      while (fragIt != metadata["tracks"][newTrack]["keys"].ArrEnd() && fragIt != metadata["tracks"][newTrack]["keys"].ArrEnd() - 1 && (*fragIt)["num"].asInt() < lastFrag["num"].asInt() + lastFrag["len"].asInt()){
-        fragIt++;
-      }
-      //continue only if a keyframe was found
-      if (fragIt != metadata["tracks"][newTrack]["keys"].ArrEnd() && fragIt != metadata["tracks"][newTrack]["keys"].ArrEnd() - 1){
-        //calculate the variables of the new fragment
-        JSON::Value newFrag;
-        newFrag["num"] = (*fragIt)["num"];
-        newFrag["time"] = (*fragIt)["time"];
-        newFrag["len"] = 1ll;
-        newFrag["dur"] = (*fragIt)["len"];
-        fragIt++;
-        //keep calculating until 10+ seconds or no more keyframes
-        while (fragIt != metadata["tracks"][newTrack]["keys"].ArrEnd() && fragIt != metadata["tracks"][newTrack]["keys"].ArrEnd() - 1){
-          newFrag["len"] = newFrag["len"].asInt() + 1;
-          newFrag["dur"] = newFrag["dur"].asInt() + (*fragIt)["len"].asInt();
-          //more than 5 seconds? store the new fragment
-          if (newFrag["dur"].asInt() >= 5000 || (*fragIt)["len"].asInt() < 2){
-            /// \todo Make this variable instead of hardcoded 5 seconds?
-            metadata["tracks"][newTrack]["frags"].append(newFrag);
-            break;
-          }
-          fragIt++;
-        }
+      track.keys.push_back(newKey);
+      updateFragments(track);
+      if (stats){
+        stats->keyframes++;
       }
     }
-    if (keySize){
-      metadata["tracks"][newTrack]["keys"][keySize - 1]["parts"].append((long long int)newPack["data"].asStringRef().size());
+    if (track.keys.size()){
+      track.keys.back().addPart(slot.dataSize);
+    }
+    meta.live = true;
+    if (slot.keyframe){
+      syncMeta(newPos.trackID);
+    }
+  }
+  if (shared || ringLog){
+    if (shared){
+      shared->addPacket(slot.pack.toNetPacked(), newPos, slot.keyframe || hasKeyframe);
+    }
+    ringLog.addPacket(slot.pack.toNetPacked(), newPos, slot.keyframe || hasKeyframe);
+    if (slot.keyframe){
+      publishDelta(newPos);
+      //a full header is published every 16 keys, so the deltas stay small
+      if (keysSinceSnapshot == 0 || keysSinceSnapshot >= 16){
+        publishHeader();
+      }else{
+        keysSinceSnapshot++;
+      }
     }
-    metadata["live"] = 1ll;
   }
-  
+
   //increase buffer size if too little time available
-  unsigned int timeBuffered = buffers.rbegin()->second["time"].asInt() - buffers.begin()->second["time"].asInt();
+  unsigned int timeBuffered = newestPos.seekTime - oldestSlot()->pos.seekTime;
   if (buffercount > 1){
     if (timeBuffered < buffertime){
-      buffercount = buffers.size();
+      buffercount = bufferedPackets;
       if (buffercount < 2){buffercount = 2;}
     }
-    if (metadata["buffer_window"].asInt() < timeBuffered){
-      metadata["buffer_window"] = (long long int)timeBuffered;
+    if (meta.bufferWindow < timeBuffered){
+      meta.bufferWindow = timeBuffered;
     }
   }
 
-  while (buffers.size() > buffercount){
+  while (bufferedPackets > buffercount){
     cutOneBuffer();
   }
+  //byte limits are enforced in whole keys, and never remove the newest key of a track
+  //tracks with a single key (such as sparse metadata or subtitle tracks) are skipped, so they do not stop eviction from the others
+  while (buffercount > 1 && overByteLimit()){
+    int trackID = -1;
+    for (std::map<int,PacketRing>::iterator it = buffers.begin(); it != buffers.end(); it++){
+      if (it->second.empty() || keyframes[it->first].size() < 2){
+        continue;
+      }
+      if (trackID == -1 || it->second.front().pos < buffers[trackID].front().pos){
+        trackID = it->first;
+      }
+    }
+    if (trackID == -1){
+      break;
+    }
+    do{
+      cutFromTrack(trackID);
+    }while (buffers[trackID].size() && !buffers[trackID].front().keyframe);
+  }
+  if (stats){
+    stats->addTime.add(Util::getNS() - addStart);
+  }
+}
+
+/// Returns true if this stream is over its own byte limit, or the process is over its byte limit.
+bool DTSC::Stream::overByteLimit(){
+  return (byteLimit && bufferedBytes > byteLimit) || (processByteLimit && processBytes > processByteLimit);
 }
 
 /// Deletes a the first part of the buffer, updating the keyframes list and metadata as required.
 /// Will print a warning to std::cerr if a track has less than 2 keyframes left because of this.
 void DTSC::Stream::cutOneBuffer(){
-  if (buffercount > 1 && keyframes[buffers.begin()->first.trackID].count(buffers.begin()->first)){
+  liveSlot * oldest = oldestSlot();
+  if ( !oldest){
+    return;
+  }
+  cutFromTrack(oldest->pos.trackID);
+}
+
+/// Deletes the oldest packet of the given track, updating the keyframes list, metadata and byte counts as required.
+/// Will print a warning to std::cerr if the track has less than 2 keyframes left because of this.
+void DTSC::Stream::cutFromTrack(int trackID){
+  PacketRing & ring = buffers[trackID];
+  if (ring.empty()){
+    return;
+  }
+  long long unsigned int cutStart = Util::getNS();
+  liveSlot & oldest = ring.front();
+  if (buffercount > 1 && oldest.keyframe){
     //if there are < 3 keyframes, throwing one away would mean less than 2 left.
-    if (keyframes[buffers.begin()->first.trackID].size() < 3){
-      std::cerr << "Warning - track " << buffers.begin()->first.trackID << " doesn't have enough keyframes to be reliably served." << std::endl;
-    }
-    std::string track = trackMapping[buffers.begin()->first.trackID];
-    keyframes[buffers.begin()->first.trackID].erase(buffers.begin()->first);
-    int keySize = metadata["tracks"][track]["keys"].size();
-    metadata["tracks"][track]["keys"].shrink(keySize - 1);
-    if (metadata["tracks"][track]["frags"].size() > 0){
-      // delete fragments of which the beginning can no longer be reached
-      while (metadata["tracks"][track]["frags"].size() > 0 && metadata["tracks"][track]["frags"][0u]["num"].asInt() < metadata["tracks"][track]["keys"][0u]["num"].asInt()){
-        metadata["tracks"][track]["firstms"] = metadata["tracks"][track]["firstms"].asInt() + metadata["tracks"][track]["frags"][0u]["dur"].asInt();
-        metadata["tracks"][track]["frags"].shrink(metadata["tracks"][track]["frags"].size() - 1);
-        // increase the missed fragments counter
-        metadata["tracks"][track]["missed_frags"] = metadata["tracks"][track]["missed_frags"].asInt() + 1;
-      }
+    if (keyframes[trackID].size() < 3){
+      std::cerr << "Warning - track " << trackID << " doesn't have enough keyframes to be reliably served." << std::endl;
     }
+    keyframes[trackID].pop_front();
+    meta.tracks[trackID].removeFirstKey();
+    syncMeta(trackID);
+    if (shared || ringLog){
+      publishDelta(oldest.pos);
+    }
+  }
+  ring.bytes -= oldest.bytes;
+  bufferedBytes -= oldest.bytes;
+  __sync_fetch_and_sub(&processBytes, (long long unsigned int)oldest.bytes);
+  ring.pop();
+  bufferedPackets--;
+  trackStats * stats = getTrackStats(trackID);
+  if (stats){
+    stats->cutTime.add(Util::getNS() - cutStart);
   }
-  buffers.erase(buffers.begin());
 }
 
 /// Returns a direct pointer to the data attribute of the last received packet, if available.
 /// Returns NULL if no valid pointer or packet is available.
 std::string & DTSC::Stream::lastData(){
-  return buffers.rbegin()->second["data"].strVal;
+  static std::string emptystring;
+  liveSlot * newest = newestSlot();
+  if ( !newest){
+    return emptystring;
+  }
+  JSON::Value & data = newest->pack["data"];
+  if ( !data.isString()){
+    return emptystring;
+  }
+  return *data.strVal;
 }
 
 /// Returns the packet in this buffer number.
 /// \arg num Buffer number.
 JSON::Value & DTSC::Stream::getPacket(livePos num){
   static JSON::Value empty;
-  if (buffers.find(num) == buffers.end()){
+  liveSlot * slot = findSlot(num);
+  if ( !slot){
     return empty;
   }
-  return buffers[num];
+  return slot->pack;
 }
 
 JSON::Value & DTSC::Stream::getPacket(){
-  return buffers.begin()->second;
+  static JSON::Value empty;
+  liveSlot * oldest = oldestSlot();
+  if ( !oldest){
+    return empty;
+  }
+  return oldest->pack;
 }
 
 /// Returns a track element by giving the id.
@@ -429,53 +639,442 @@ void DTSC::Stream::setBufferTime(unsigned int ms){
   buffertime = ms;
 }
 
+/// Limits the memory used by the buffers of this stream to the given amount of bytes, or removes the limit if bytes is 0.
+/// The limit takes precedence over the buffer time, and is only enforced when buffering more than one packet.
+/// Whole keys are removed from the oldest end of the buffer to get below the limit, but the newest key of a track is always kept.
+void DTSC::Stream::setBufferBytes(long long unsigned int bytes){
+  byteLimit = bytes;
+}
+
+/// Limits the memory used by the buffers of all streams in this process together, or removes the limit if bytes is 0.
+/// A stream that adds a packet while the process is over the limit removes keys from its own buffer, as for setBufferBytes().
+void DTSC::Stream::setProcessBufferBytes(long long unsigned int bytes){
+  processByteLimit = bytes;
+}
+
+/// Returns the amount of bytes buffered by all streams in this process together.
+long long unsigned int DTSC::Stream::getProcessBytes(){
+  return processBytes;
+}
+
+/// Returns the current buffer usage of this stream, for placing streams by memory.
+/// Contains the total bytes, packets and buffered time window in ms, the byte limits,
+/// and the same figures plus the amount of keyframes for every track, indexed by track ID.
+JSON::Value DTSC::Stream::getBufferStats(){
+  JSON::Value result;
+  result["bytes"] = (long long int)bufferedBytes;
+  result["packets"] = (long long int)bufferedPackets;
+  result["window"] = 0ll;
+  liveSlot * oldest = oldestSlot();
+  if (oldest){
+    result["window"] = (long long int)(newestPos.seekTime - oldest->pos.seekTime);
+  }
+  result["limit"] = (long long int)byteLimit;
+  result["process_bytes"] = (long long int)processBytes;
+  result["process_limit"] = (long long int)processByteLimit;
+  for (std::map<int,PacketRing>::iterator it = buffers.begin(); it != buffers.end(); it++){
+    std::stringstream trackID;
+    trackID << it->first;
+    JSON::Value & track = result["tracks"][trackID.str()];
+    track["bytes"] = (long long int)it->second.bytes;
+    track["packets"] = (long long int)it->second.size();
+    track["keyframes"] = (long long int)keyframes[it->first].size();
+    track["window"] = 0ll;
+    if (it->second.size()){
+      track["window"] = (long long int)(it->second.back().pos.seekTime - it->second.front().pos.seekTime);
+    }
+  }
+  return result;
+}
+
+/// Sets the default fragment target for all tracks of this stream.
+/// Fragments are completed once they hold at least minKeys keys and last at least ms milliseconds.
+/// Only affects fragments that are completed after this call.
+void DTSC::Stream::setFragmentTarget(unsigned int ms, unsigned int minKeys){
+  fragmentDuration = ms;
+  fragmentMinKeys = minKeys;
+}
+
+/// Sets the fragment target for a single track, overriding the stream default.
+/// Passing zero for ms and minKeys makes the track follow the stream default again.
+/// The target may be set before the track appears, and is kept when a new header arrives.
+void DTSC::Stream::setTrackFragmentTarget(int trackID, unsigned int ms, unsigned int minKeys){
+  if ( !ms && !minKeys){
+    trackFragmentTargets.erase(trackID);
+    return;
+  }
+  trackFragmentTargets[trackID] = std::pair<unsigned int, unsigned int>(ms, minKeys);
+}
+
+/// Registers a function that is called every time a fragment is completed on any track.
+/// The userData pointer is passed to the listener unchanged.
+void DTSC::Stream::addFragmentListener(fragmentListener listener, void * userData){
+  fragmentListeners.push_back(std::pair<fragmentListener, void *>(listener, userData));
+}
+
+/// Removes a listener that was registered with the same userData pointer through addFragmentListener.
+void DTSC::Stream::removeFragmentListener(fragmentListener listener, void * userData){
+  for (std::vector<std::pair<fragmentListener, void *> >::iterator it = fragmentListeners.begin(); it != fragmentListeners.end(); it++){
+    if (it->first == listener && it->second == userData){
+      fragmentListeners.erase(it);
+      return;
+    }
+  }
+}
+
+/// Starts publishing this stream into shared memory, so DTSC::SharedReader objects in other processes can follow it.
+/// Every added packet is copied into a data ring of dataSize bytes, the header is updated whenever a key is added.
+/// Calling this again replaces the previous shared segment.
+/// \returns True if the shared segment could be created, false otherwise.
+bool DTSC::Stream::shareLive(const std::string & streamName, unsigned int dataSize){
+  if (shared){
+    delete shared;
+  }
+  shared = new SharedBuffer(streamName, dataSize);
+  if ( !*shared){
+    delete shared;
+    shared = 0;
+    return false;
+  }
+  if (metadata){
+    shared->setHeader(outHeader());
+  }
+  return true;
+}
+
+/// Lets the track's fragmenter catch up with its finished keys, using its target from setTrackFragmentTarget() if any, and notifies all fragment listeners of completed fragments.
+void DTSC::Stream::updateFragments(Track & track){
+  unsigned int targetDuration = fragmentDuration;
+  unsigned int minKeys = fragmentMinKeys;
+  std::map<int,std::pair<unsigned int, unsigned int> >::iterator target = trackFragmentTargets.find(track.trackID);
+  if (target != trackFragmentTargets.end()){
+    if (target->second.first){
+      targetDuration = target->second.first;
+    }
+    if (target->second.second){
+      minKeys = target->second.second;
+    }
+  }
+  unsigned int completed = track.updateFragments(targetDuration, minKeys);
+  for (unsigned int i = track.fragments.size() - completed; i < track.fragments.size(); i++){
+    for (unsigned int l = 0; l < fragmentListeners.size(); l++){
+      fragmentListeners[l].first(*this, track.trackID, track.fragments[i], fragmentListeners[l].second);
+    }
+  }
+}
+
 std::string & DTSC::Stream::outPacket(){
   static std::string emptystring;
-  if (!buffers.size() || !buffers.rbegin()->second.isObject()){
+  liveSlot * newest = newestSlot();
+  if ( !newest || !newest->pack.isObject()){
     return emptystring;
   }
-  return buffers.rbegin()->second.toNetPacked();
+  return newest->pack.toNetPacked();
 }
 
 /// Returns a packed DTSC packet, ready to sent over the network.
 std::string & DTSC::Stream::outPacket(livePos num){
   static std::string emptystring;
-  if (buffers.find(num) == buffers.end() || !buffers[num].isObject()) return emptystring;
-  return buffers[num].toNetPacked();
+  liveSlot * slot = findSlot(num);
+  if ( !slot || !slot->pack.isObject()) return emptystring;
+  return slot->pack.toNetPacked();
 }
 
 /// Returns a packed DTSC header, ready to sent over the network.
+/// Brings all keys, fragments and timing data in metadata fully up to date with meta first.
 std::string & DTSC::Stream::outHeader(){
+  meta.toJSON(metadata);
+  metadata.netPrepare();
   return metadata.toNetPacked();
 }
 
+/// Copies the keys, fragments and timing data of the given track from meta into metadata, together with the live flag and buffer window.
+/// This keeps metadata complete for code that reads keys and fragments from it, such as the MP4 and FLV converters.
+/// It is called once per key added or removed and once per header delta applied, never per packet,
+/// so the parts of the newest key in metadata may lag behind meta until the next key starts.
+void DTSC::Stream::syncMeta(int trackID){
+  std::map<int,Track>::iterator it = meta.tracks.find(trackID);
+  if (it == meta.tracks.end() || !it->second.name.size() || !metadata.isMember("tracks") || !metadata["tracks"].isMember(it->second.name)){
+    return;
+  }
+  it->second.toJSON(metadata["tracks"][it->second.name]);
+  if (meta.live){
+    metadata["live"] = 1ll;
+  }
+  if (meta.bufferWindow){
+    metadata["buffer_window"] = meta.bufferWindow;
+  }
+}
+
+/// Returns a packed header delta for the given track, ready to be sent over the network.
+/// The delta holds the track's timing data and every key numbered fromKey or higher, see DTSC::Track::toDelta().
+/// A receiving DTSC::Stream applies it in parsePacket(), after which lastType() returns MODIFIEDHEADER.
+/// The cost of this only depends on the amount of keys from fromKey onwards, not on the size of the whole header.
+std::string & DTSC::Stream::outHeaderDelta(int trackID, unsigned int fromKey){
+  JSON::Value delta;
+  if (meta.tracks.count(trackID)){
+    meta.tracks[trackID].toDelta(delta, fromKey);
+  }
+  if (meta.bufferWindow){
+    delta["buffer_window"] = meta.bufferWindow;
+  }
+  std::string packed = delta.toPacked();
+  uint32_t size = htonl(packed.size());
+  deltaBuffer.assign(DTSC::Magic_HeaderDelta, 4);
+  deltaBuffer.append((char *)&size, 4);
+  deltaBuffer.append(packed);
+  return deltaBuffer;
+}
+
+/// Applies a header delta, as made by outHeaderDelta(), to meta.
+/// Deltas for tracks that are not in the header are ignored.
+void DTSC::Stream::applyDelta(JSON::Value & delta){
+  if (delta.isMember("buffer_window")){
+    meta.bufferWindow = delta["buffer_window"].asInt();
+  }
+  int trackID = delta.isMember("trackid") ? delta["trackid"].asInt() : 0;
+  if (meta.tracks.count(trackID)){
+    meta.tracks[trackID].applyDelta(delta);
+    syncMeta(trackID);
+    datapointertype = MODIFIEDHEADER;
+  }
+}
+
 /// Constructs a new Ring, at the given buffer position.
+/// The ring is not attached to any stream, use DTSC::Stream::getRing() to get one that can read packets.
 /// \arg v Position for buffer.
 DTSC::Ring::Ring(livePos v){
   b = v;
-  waiting = false;
-  starved = false;
-  updated = false;
   playCount = 0;
+  owner = 0;
+  index = -1;
+  seqSlot = 0;
+}
+
+/// Copies the next packed packet of the stream into packed, and updates b to its position.
+/// If the stream overwrote packets this ring had not read yet, the ring continues at the newest key and generation is incremented.
+/// \returns True if packed now holds a packet, false if no new packet is available.
+bool DTSC::Ring::next(std::string & packed){
+  bool got = getPacket(packed);
+  if (seqSlot){
+    *seqSlot = seq;
+  }
+  if ( !got){
+    return false;
+  }
+  b = pos;
+  return true;
+}
+
+/// Creates an empty PacketRing with room for at least initialCapacity slots.
+DTSC::PacketRing::PacketRing(unsigned int initialCapacity){
+  unsigned int cap = 1;
+  while (cap < initialCapacity){
+    cap <<= 1;
+  }
+  slots.resize(cap);
+  start = 0;
+  count = 0;
+  dropped = 0;
+  bytes = 0;
+}
+
+/// Returns the amount of slots currently in use.
+unsigned int DTSC::PacketRing::size() const{
+  return count;
+}
+
+/// Returns the amount of slots available before the ring needs to grow.
+unsigned int DTSC::PacketRing::capacity() const{
+  return slots.size();
+}
+
+/// Returns true if no slots are in use.
+bool DTSC::PacketRing::empty() const{
+  return count == 0;
+}
+
+/// Claims a new slot after the newest one and returns it.
+/// If the ring is full, the capacity is doubled first, keeping all slots in order.
+DTSC::liveSlot & DTSC::PacketRing::push(){
+  if (count == slots.size()){
+    std::vector<liveSlot> bigger(slots.size() * 2);
+    for (unsigned int i = 0; i < count; i++){
+      liveSlot & src = slots[(start + i) & (slots.size() - 1)];
+      bigger[i].pos = src.pos;
+      bigger[i].keyframe = src.keyframe;
+      bigger[i].dataSize = src.dataSize;
+      bigger[i].bytes = src.bytes;
+      bigger[i].pack.swap(src.pack);
+    }
+    slots.swap(bigger);
+    start = 0;
+  }
+  count++;
+  return slots[(start + count - 1) & (slots.size() - 1)];
+}
+
+/// Releases the oldest slot. Does nothing if the ring is empty.
+void DTSC::PacketRing::pop(){
+  if ( !count){
+    return;
+  }
+  slots[start].pack.null();
+  start = (start + 1) & (slots.size() - 1);
+  count--;
+  dropped++;
+}
+
+/// Releases all slots, keeping the current capacity.
+void DTSC::PacketRing::clear(){
+  while (count){
+    pop();
+  }
+  start = 0;
+}
+
+/// Returns the oldest slot. Only valid if the ring is not empty.
+DTSC::liveSlot & DTSC::PacketRing::front(){
+  return slots[start];
+}
+
+/// Returns the newest slot. Only valid if the ring is not empty.
+DTSC::liveSlot & DTSC::PacketRing::back(){
+  return slots[(start + count - 1) & (slots.size() - 1)];
+}
+
+/// Returns the slot at the given index, where 0 is the oldest slot.
+DTSC::liveSlot & DTSC::PacketRing::operator[](unsigned int index){
+  return slots[(start + index) & (slots.size() - 1)];
+}
+
+/// Returns the slot at the given index, where 0 is the oldest slot.
+const DTSC::liveSlot & DTSC::PacketRing::operator[](unsigned int index) const{
+  return slots[(start + index) & (slots.size() - 1)];
+}
+
+/// Returns the index of the slot at exactly the given position, or -1 if there is none.
+int DTSC::PacketRing::find(const livePos & pos) const{
+  unsigned int index = upperBound(pos);
+  if (index == 0){
+    return -1;
+  }
+  const livePos & found = (*this)[index - 1].pos;
+  if (found.seekTime != pos.seekTime || found.trackID != pos.trackID){
+    return -1;
+  }
+  return index - 1;
+}
+
+/// Returns the index of the first slot positioned after the given position, or size() if there is none.
+/// Slots are always ordered by position, so this is a binary search.
+unsigned int DTSC::PacketRing::upperBound(const livePos & pos) const{
+  unsigned int low = 0;
+  unsigned int high = count;
+  while (low < high){
+    unsigned int mid = low + (high - low) / 2;
+    if (pos < (*this)[mid].pos){
+      high = mid;
+    }else{
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+/// Returns the index of the first slot with a time of at least seekTime, or size() if there is none.
+/// Slots are always ordered by time, so this is a binary search.
+unsigned int DTSC::PacketRing::lowerBound(long long unsigned int seekTime) const{
+  unsigned int low = 0;
+  unsigned int high = count;
+  while (low < high){
+    unsigned int mid = low + (high - low) / 2;
+    if ((*this)[mid].pos.seekTime < seekTime){
+      low = mid + 1;
+    }else{
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/// Returns the absolute index of the oldest slot: the amount of slots released since this ring was created.
+/// Slot i, counted from the oldest, has absolute index firstIndex() + i, which never changes while it is in the ring.
+long long unsigned int DTSC::PacketRing::firstIndex() const{
+  return dropped;
 }
 
 /// Requests a new Ring, which will be created and added to the internal Ring list.
-/// This Ring will be kept updated so it always points to valid data or has the starved boolean set.
+/// The Ring starts at the newest keyframe in the ring log, and b is set to the position of that keyframe.
+/// Rings are read through Ring::next(). Both this call and reading are safe from any thread, as they only touch the ring log.
 /// Don't forget to call dropRing() for all requested Ring classes that are no longer neccessary!
+/// \returns The new ring, or NULL if enableRings() was not called yet or the maximum amount of rings set there is given out already.
 DTSC::Ring * DTSC::Stream::getRing(){
-  livePos tmp = buffers.begin()->first;
-  std::map<int,std::set<livePos> >::iterator it;
-  for (it = keyframes.begin(); it != keyframes.end(); it++){
-    if ((*it->second.begin()).seekTime > tmp.seekTime){
-      tmp = *it->second.begin();
+  if ( !ringLog){
+    return 0;
+  }
+  DTSC::Ring * result = new DTSC::Ring(livePos());
+  result->attach((const char *)&(ringMemory[0]), ringMemory.size() * sizeof(long long unsigned int));
+  result->peekPos(result->b);
+  for (unsigned int i = 0; i < rings.size(); i++){
+    if (__sync_bool_compare_and_swap(&(rings[i]), (Ring *)0, result)){
+      result->owner = this;
+      result->index = i;
+      result->seqSlot = &(ringSeqs[i]);
+      *(result->seqSlot) = result->seq;
+      return result;
     }
   }
-  return new DTSC::Ring(tmp);
+  delete result;
+  return 0;
 }
 
 /// Deletes a given out Ring class from memory and internal Ring list.
-/// Checks for NULL pointers and invalid pointers, silently discarding them.
+/// Checks for NULL pointers and rings given out by other streams, silently discarding them.
+/// The ring must not be used by any other thread during or after this call.
+/// slowestRing() never touches Ring objects, so this is safe while packets are being added.
 void DTSC::Stream::dropRing(DTSC::Ring * ptr){
+  if ( !ptr || ptr->owner != this){
+    return;
+  }
+  //free the sequence slot before the entry, so a getRing() claiming the entry can not have its slot overwritten
+  ringSeqs[ptr->index] = RING_FREE;
+  __sync_synchronize();
+  __sync_bool_compare_and_swap(&(rings[ptr->index]), ptr, (Ring *)0);
+  delete ptr;
+}
+
+/// Starts keeping a packed copy of every new packet in a lock-free log of dataSize bytes, which all rings read from.
+/// At most maxRings rings can be given out at the same time.
+/// This must be called on the thread adding packets, before any ring is requested. Does nothing if rings were enabled already.
+void DTSC::Stream::enableRings(unsigned int dataSize, unsigned int maxRings){
+  if (ringLog){
+    return;
+  }
+  dataSize = (dataSize + 7) & ~7u;
+  unsigned int metaSize = 1024 * 1024;
+  ringMemory.resize(LiveLog::blockSize(dataSize, metaSize) / sizeof(long long unsigned int) + 1);
+  ringLog.init((char *)&(ringMemory[0]), dataSize, metaSize);
+  rings.resize(maxRings, 0);
+  ringSeqs.resize(maxRings, RING_FREE);
+  if (metadata){
+    ringLog.setHeader(outHeader());
+  }
+}
+
+/// Returns the sequence number of the next packet the slowest ring will read, as last published by its Ring::next().
+/// Packets with a lower sequence number are no longer needed by any ring.
+/// If no rings were given out, the sequence number of the next packet to be added is returned.
+/// Only reads the sequence slots owned by this stream, so rings may be dropped from other threads meanwhile.
+long long unsigned int DTSC::Stream::slowestRing(){
+  long long unsigned int result = ringLog.writeSeq();
+  for (unsigned int i = 0; i < ringSeqs.size(); i++){
+    long long unsigned int seq = *(volatile long long unsigned int *)&(ringSeqs[i]);
+    if (seq < result){
+      result = seq;
+    }
+  }
+  return result;
 }
 
 /// Returns 0 if seeking is possible, -1 if the wanted frame is too old, 1 if the wanted frame is too new.
@@ -483,16 +1082,17 @@ void DTSC::Stream::dropRing(DTSC::Ring * ptr){
 int DTSC::Stream::canSeekms(unsigned int ms){
   bool too_late = false;
   //no tracks? Frame too new by definition.
-  if ( !metadata.isMember("tracks") || metadata["tracks"].size() < 1){
+  if ( !meta.tracks.size()){
     return 1;
   }
   //loop trough all the tracks
-  for (JSON::ObjIter it = metadata["tracks"].ObjBegin(); it != metadata["tracks"].ObjEnd(); it++){
-    if (it->second.isMember("keys") && it->second["keys"].size() > 0){
-      if (it->second["keys"][0u]["time"].asInt() <= ms && it->second["keys"][it->second["keys"].size() - 1]["time"].asInt() >= ms){
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    std::deque<Key> & keys = it->second.keys;
+    if (keys.size() > 0){
+      if (keys.front().time <= ms && keys.back().time >= ms){
         return 0;
       }
-      if (it->second["keys"][0u]["time"].asInt() > ms){too_late = true;}
+      if (keys.front().time > ms){too_late = true;}
     }
   }
   //did we spot a track already past this point? return too late.
@@ -501,26 +1101,46 @@ int DTSC::Stream::canSeekms(unsigned int ms){
   return 1;
 }
 
+/// Returns the position of the first buffered packet at or after ms, within the first video track in allowedTracks,
+/// or within all of allowedTracks if none of them is a video track.
+/// If all packets are older than ms, the newest position is returned instead.
+/// Every track is searched with a binary search over its packet ring, so this is O(log n) per track.
 DTSC::livePos DTSC::Stream::msSeek(unsigned int ms, std::set<int> & allowedTracks){
   std::set<int> seekTracks = allowedTracks;
-  livePos result = buffers.begin()->first;
+  livePos result;
+  liveSlot * oldest = oldestSlot();
+  if (oldest){
+    result = oldest->pos;
+  }
   for (std::set<int>::iterator it = allowedTracks.begin(); it != allowedTracks.end(); it++){
-    if (getTrackById(*it).isMember("type") && getTrackById(*it)["type"].asStringRef() == "video"){
+    if (meta.tracks.count(*it) && meta.tracks[*it].type == "video"){
       int trackNo = *it;
       seekTracks.clear();
       seekTracks.insert(trackNo);
       break;
     }
   }
-  for (std::map<livePos,JSON::Value>::iterator bIt = buffers.begin(); bIt != buffers.end(); bIt++){
-    if (seekTracks.find(bIt->first.trackID) != seekTracks.end()){
-    //  if (bIt->second.isMember("keyframe")){
-        result = bIt->first;
-        if (bIt->first.seekTime >= ms){
-          return result;
-        }
-    //}
+  //the first packet at or after ms over all seekTracks wins, otherwise the newest of them
+  bool found = false;
+  bool seen = false;
+  for (std::set<int>::iterator it = seekTracks.begin(); it != seekTracks.end(); it++){
+    std::map<int,PacketRing>::iterator bIt = buffers.find(*it);
+    if (bIt == buffers.end() || bIt->second.empty()){
+      continue;
+    }
+    PacketRing & ring = bIt->second;
+    unsigned int i = ring.lowerBound(ms);
+    if (i < ring.size()){
+      if ( !found || ring[i].pos < result){
+        result = ring[i].pos;
+      }
+      found = true;
+    }else{
+      if ( !found && ( !seen || result < ring.back().pos)){
+        result = ring.back().pos;
+      }
     }
+    seen = true;
   }
   return result;
 }
@@ -533,29 +1153,165 @@ bool DTSC::Stream::isNewest(DTSC::livePos & pos, std::set<int> & allowedTracks){
 
 /// Returns the next available position within allowedTracks, or the current position if no next is availble.
 DTSC::livePos DTSC::Stream::getNext(DTSC::livePos & pos, std::set<int> & allowedTracks){
-  std::map<livePos,JSON::Value>::iterator iter = buffers.upper_bound(pos);
-  while (iter != buffers.end()){
-    if (allowedTracks.count(iter->first.trackID)){return iter->first;}
-    iter++;
+  livePos result = pos;
+  bool found = false;
+  for (std::set<int>::iterator it = allowedTracks.begin(); it != allowedTracks.end(); it++){
+    std::map<int,PacketRing>::iterator bIt = buffers.find(*it);
+    if (bIt == buffers.end()){
+      continue;
+    }
+    unsigned int i = bIt->second.upperBound(pos);
+    if (i < bIt->second.size() && ( !found || bIt->second[i].pos < result)){
+      result = bIt->second[i].pos;
+      found = true;
+    }
   }
-  return pos;
+  return result;
+}
+
+/// Creates an empty merge cursor, without any tracks selected.
+DTSC::MergeCursor::MergeCursor(){
+  resets = 0;
+}
+
+/// Starts a walk through allowedTracks with the given cursor, right after the given position.
+void DTSC::Stream::seekMerge(MergeCursor & cursor, const livePos & pos, std::set<int> & allowedTracks){
+  cursor.pos = pos;
+  cursor.tracks = allowedTracks;
+  cursor.resets = resets;
+  cursor.heap.clear();
+  cursor.waiting.clear();
+  for (std::set<int>::iterator it = allowedTracks.begin(); it != allowedTracks.end(); it++){
+    mergeEntry entry;
+    entry.pos.trackID = *it;
+    entry.index = 0;
+    std::map<int,PacketRing>::iterator bIt = buffers.find(*it);
+    if (bIt != buffers.end()){
+      PacketRing & ring = bIt->second;
+      unsigned int i = ring.upperBound(pos);
+      entry.index = ring.firstIndex() + i;
+      if (i < ring.size()){
+        entry.pos = ring[i].pos;
+        cursor.heap.push_back(entry);
+        continue;
+      }
+    }
+    cursor.waiting.push_back(entry);
+  }
+  std::make_heap(cursor.heap.begin(), cursor.heap.end());
+}
+
+/// Moves the cursor to the next available position within its selected tracks.
+/// Only the selected tracks are looked at: tracks that were caught up are checked for new packets,
+/// then the oldest next packet is taken from the heap. Packets that were cut from the buffer in the meantime are skipped.
+/// \returns True if the cursor moved to a new position, false if no next position is available yet.
+bool DTSC::Stream::getNext(MergeCursor & cursor){
+  if (cursor.resets != resets){
+    livePos current = cursor.pos;
+    std::set<int> tracks = cursor.tracks;
+    seekMerge(cursor, current, tracks);
+  }
+  //caught up tracks may have received new packets
+  for (unsigned int w = 0; w < cursor.waiting.size();){
+    std::map<int,PacketRing>::iterator bIt = buffers.find(cursor.waiting[w].pos.trackID);
+    if (bIt == buffers.end() || bIt->second.firstIndex() + bIt->second.size() <= cursor.waiting[w].index){
+      w++;
+      continue;
+    }
+    cursor.heap.push_back(cursor.waiting[w]);
+    std::push_heap(cursor.heap.begin(), cursor.heap.end());
+    cursor.waiting[w] = cursor.waiting.back();
+    cursor.waiting.pop_back();
+  }
+  while (cursor.heap.size()){
+    std::pop_heap(cursor.heap.begin(), cursor.heap.end());
+    mergeEntry & entry = cursor.heap.back();
+    PacketRing & ring = buffers[entry.pos.trackID];
+    long long unsigned int first = ring.firstIndex();
+    if (entry.index < first || entry.pos != ring[entry.index - first].pos){
+      //packets were cut since this entry was made, continue at the oldest remaining packet of this track
+      if (entry.index < first){
+        entry.index = first;
+      }
+      if (entry.index >= first + ring.size()){
+        cursor.waiting.push_back(entry);
+        cursor.heap.pop_back();
+        continue;
+      }
+      entry.pos = ring[entry.index - first].pos;
+      std::push_heap(cursor.heap.begin(), cursor.heap.end());
+      continue;
+    }
+    cursor.pos = entry.pos;
+    entry.index++;
+    if (entry.index < first + ring.size()){
+      entry.pos = ring[entry.index - first].pos;
+      std::push_heap(cursor.heap.begin(), cursor.heap.end());
+    }else{
+      cursor.waiting.push_back(entry);
+      cursor.heap.pop_back();
+    }
+    return true;
+  }
+  return false;
 }
 
 /// Properly cleans up the object for erasing.
-/// Drops all Ring classes that have been given out.
+/// Every ring that was given out is listed in rings, so all of them stay valid objects, but report the stream as closed and can no longer read packets.
 DTSC::Stream::~Stream(){
+  __sync_fetch_and_sub(&processBytes, bufferedBytes);
+  for (unsigned int i = 0; i < statCount; i++){
+    delete statSlots[i];
+  }
+  if (shared){
+    delete shared;
+  }
+  ringLog.close();
+  for (unsigned int i = 0; i < rings.size(); i++){
+    Ring * ring = rings[i];
+    if (ring){
+      ring->owner = 0;
+      ring->index = -1;
+      ring->seqSlot = 0;
+      ring->detach();
+    }
+  }
 }
 
 DTSC::File::File(){
   F = 0;
+  writer = 0;
+  prefetch = 0;
+  prefetchCheck = 0;
   endPos = 0;
+  mapping = 0;
+  mapLen = 0;
+  readPos = 0;
+  atEOF = false;
+  metadataValid = true;
+  cacheHeader = false;
+  clearPacket();
 }
 
 DTSC::File::File(const File & rhs){
+  F = 0;
+  writer = 0;
+  prefetch = 0;
+  mapping = 0;
+  mapLen = 0;
   *this = rhs;
 }
 
 DTSC::File & DTSC::File::operator =(const File & rhs){
+  setPrefetch(0);
+  setWriteBuffer(0);
+  setMapped(false);
+  if (rhs.writer){
+    rhs.writer->flush();
+  }
+  if (F){
+    fclose(F);
+  }
   created = rhs.created;
   if (rhs.F){
     int tmpFd = fileno(rhs.F);
@@ -565,23 +1321,91 @@ DTSC::File & DTSC::File::operator =(const File & rhs){
     F = 0;
   }
   endPos = rhs.endPos;
+  if (rhs.mapping){
+    setMapped(true);
+  }
+  rawbuffer = rhs.rawbuffer;
+  //point the copied packet into our own mapping or buffer
+  const char * rhsData = rhs.currentPacket.getData();
+  if (rhsData && rhs.mapping && rhsData >= rhs.mapping && rhsData < rhs.mapping + rhs.mapLen && mapping && rhsData - rhs.mapping < mapLen){
+    currentPacket.reInit(mapping + (rhsData - rhs.mapping), rhs.currentPacket.getDataLen());
+  }else if (rhsData){
+    rawbuffer.assign(rhsData, rhs.currentPacket.getDataLen());
+    currentPacket.reInit(rawbuffer.data(), rawbuffer.size());
+  }else{
+    currentPacket.null();
+  }
   strbuffer = rhs.strbuffer;
+  strValid = rhs.strValid;
   jsonbuffer = rhs.jsonbuffer;
+  jsonValid = rhs.jsonValid;
+  readPos = rhs.readPos;
+  atEOF = rhs.atEOF;
   metadata = rhs.metadata;
+  metadataValid = rhs.metadataValid;
+  headerCache = rhs.headerCache;
+  index = rhs.index;
+  pendingTracks = rhs.pendingTracks;
+  headerData = rhs.headerData;
+  cacheHeader = false;
+  meta = rhs.meta;
   currtime = rhs.currtime;
   lastreadpos = rhs.lastreadpos;
   headerSize = rhs.headerSize;
   trackMapping = rhs.trackMapping;
+  cursors = rhs.cursors;
+  selectedTracks = rhs.selectedTracks;
   memcpy(buffer, rhs.buffer, 4);
+  return *this;
 }
 
 DTSC::File::operator bool() const{
   return F;
 }
 
+/// Files modified less than this many seconds ago are assumed to still be growing, and get no sidecar index built.
+static const long long int indexQuietTime = 10;
+
+/// Decides whether DTSC::File may build the sidecar index at path for the file with the given stamp.
+/// Building reads the whole file, so it is skipped for files that are still being written to, and when the sidecar
+/// can not be saved for other opens to reuse. It is also done at most once per version of a file per process.
+/// Seeking in files without an index falls back to scanning from the nearest key.
+static bool mayBuildIndex(const std::string & path, const DTSC::fileStamp & st){
+  if ((long long int)st.mtime + indexQuietTime > (long long int)time(0)){
+    return false;
+  }
+  size_t slash = path.rfind('/');
+  std::string dir = (slash == std::string::npos ? "." : path.substr(0, slash + 1));
+  if (access(dir.c_str(), W_OK) != 0){
+    return false;
+  }
+  static pthread_mutex_t attemptLock = PTHREAD_MUTEX_INITIALIZER;
+  static std::set<std::string> attempted;
+  std::stringstream key;
+  key << st.dev << "_" << st.ino << "_" << st.size << "_" << st.mtimeNs();
+  pthread_mutex_lock(&attemptLock);
+  bool first = attempted.insert(key.str()).second;
+  pthread_mutex_unlock(&attemptLock);
+  return first;
+}
+
 /// Open a filename for DTSC reading/writing.
 /// If create is true and file does not exist, attempt to create.
-DTSC::File::File(std::string filename, bool create){
+/// Files that are not created are memory mapped for reading if possible, see setMapped().
+/// Their header is taken from the DTSC::HeaderCache if it holds this version of the file, and added to it otherwise.
+/// Unless useIndex is false, the sidecar .dtsh index is loaded, or built and saved next to the file if it is missing (see mayBuildIndex()).
+/// Files opened without it can still be read from start to end and seeked, but seeking scans from the nearest key.
+DTSC::File::File(std::string filename, bool create, bool useIndex){
+  writer = 0;
+  prefetch = 0;
+  prefetchCheck = 0;
+  mapping = 0;
+  mapLen = 0;
+  readPos = 0;
+  atEOF = false;
+  metadataValid = true;
+  cacheHeader = false;
+  clearPacket();
   if (create){
     F = fopen(filename.c_str(), "w+b");
     if(!F){
@@ -589,7 +1413,7 @@ DTSC::File::File(std::string filename, bool create){
       return;
     }
     //write an empty header
-    fseek(F, 0, SEEK_SET);
+    fseeko(F, 0, SEEK_SET);
     fwrite(DTSC::Magic_Header, 4, 1, F);
     memset(buffer, 0, 4);
     fwrite(buffer, 4, 1, F); //write 4 zero-bytes
@@ -602,32 +1426,135 @@ DTSC::File::File(std::string filename, bool create){
     fprintf(stderr, "Could not open file %s\n", filename.c_str());
     return;
   }
-  fseek(F, 0, SEEK_END);
-  endPos = ftell(F);
+  fseeko(F, 0, SEEK_END);
+  endPos = ftello(F);
 
   //we now know the first 4 bytes are DTSC::Magic_Header and we have a valid file
-  fseek(F, 4, SEEK_SET);
+  fseeko(F, 4, SEEK_SET);
   if (fread(buffer, 4, 1, F) != 1){
-    fseek(F, 4, SEEK_SET);
+    fseeko(F, 4, SEEK_SET);
     memset(buffer, 0, 4);
     fwrite(buffer, 4, 1, F); //write 4 zero-bytes
   }else{
     uint32_t * ubuffer = (uint32_t *)buffer;
     headerSize = ntohl(ubuffer[0]);
   }
-  readHeader(0);
+  if ( !create){
+    setMapped(true);
+  }
+  struct stat realSt;
+  bool haveStat = !create && fstat(fileno(F), &realSt) == 0;
+  fileStamp st;
+  if (haveStat){
+    st.dev = realSt.st_dev;
+    st.ino = realSt.st_ino;
+    st.size = realSt.st_size;
+    st.mtime = realSt.st_mtime;
+    st.mtimeNsec = realSt.st_mtim.tv_nsec;
+  }
+  if (haveStat && headerCache.load(st) && headerCache.getMeta(meta)){
+    //metadata is only parsed from the cache once getMeta() is called
+    readAt(0);
+    metadataValid = false;
+  }else{
+    //the header is added to the cache once all of it is parsed, see finishHeader()
+    if (haveStat){
+      headerStat = st;
+      cacheHeader = true;
+    }
+    readHeader(0);
+  }
+  if (useIndex && haveStat && !index.load(filename + ".dtsh", endPos, st.mtimeNs()) && mayBuildIndex(filename + ".dtsh", st)){
+    buildIndex(filename + ".dtsh", st.mtimeNs());
+  }
   trackMapping.clear();
-  if (metadata.isMember("tracks")){
-    for (JSON::ObjIter it = metadata["tracks"].ObjBegin(); it != metadata["tracks"].ObjEnd(); it++){
-      trackMapping.insert(std::pair<int,std::string>(it->second["trackid"].asInt(),it->first));
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    if (it->second.name.size()){
+      trackMapping.insert(std::pair<int,std::string>(it->first, it->second.name));
     }
   }
-  fseek(F, 8 + headerSize, SEEK_SET);
+  readPos = 8 + headerSize;
   currframe = 0;
 }
 
+/// Creates the sidecar index by reading all packets in the file, and saves it to path for other processes to reuse.
+/// If it could not be saved, the index is only used by this File.
+void DTSC::File::buildIndex(const std::string & path, long long unsigned int srcTime){
+  std::map<int, std::vector<indexEntry> > tracks;
+  long long int pos = 0;
+  while (pos < endPos && readAt(pos)){
+    if ( !currentPacket.isHeader()){
+      indexEntry entry;
+      entry.time = currentPacket.getTime();
+      entry.bpos = pos;
+      entry.size = currentPacket.getDataLen();
+      tracks[currentPacket.getTrackId()].push_back(entry);
+    }
+    pos = readPos;
+  }
+  clearPacket();
+  if (pos != endPos){
+    //the file could not be read completely, so any index would be incomplete
+    return;
+  }
+  index.create(tracks, endPos, srcTime);
+  index.save(path);
+}
+
+/// Maps the file read-only into memory, or removes the mapping.
+/// While mapped, packets within the mapping are read without any copying or system calls,
+/// and processes reading the same file share its pages through the page cache.
+/// Only the file size at the time of mapping is mapped; anything written after that is read through the FILE.
+/// \returns True if the file is mapped afterwards, false otherwise.
+bool DTSC::File::setMapped(bool enable){
+  if (mapping){
+    //keep the current packet valid by moving it out of the mapping
+    const char * curData = currentPacket.getData();
+    if (curData && curData >= mapping && curData < mapping + mapLen){
+      rawbuffer.assign(curData, currentPacket.getDataLen());
+      currentPacket.reInit(rawbuffer.data(), rawbuffer.size());
+    }
+    munmap(mapping, mapLen);
+    mapping = 0;
+    mapLen = 0;
+  }
+  if ( !enable || !F || endPos <= 0){
+    return false;
+  }
+  if ((long long unsigned int)(size_t)endPos != (long long unsigned int)endPos){
+    //too large for the address space, as on 32 bits systems with files over 4GB
+    return false;
+  }
+  void * result = mmap(0, endPos, PROT_READ, MAP_SHARED, fileno(F), 0);
+  if (result == MAP_FAILED){
+#if DEBUG >= 3
+    fprintf(stderr, "Could not map file, reading through stdio: %s\n", strerror(errno));
+#endif
+    return false;
+  }
+  mapping = (char *)result;
+  mapLen = endPos;
+  return true;
+}
+
 /// Returns the header metadata for this file as JSON::Value.
+/// If the file was opened from the header cache, the metadata is parsed from it on the first call.
+/// Otherwise, the keys and fragments of all tracks that were not needed yet are parsed on the first call.
 JSON::Value & DTSC::File::getMeta(){
+  if ( !metadataValid){
+    {
+      JSON::Arena arena;
+      unsigned int i = 0;
+      JSON::Value parsed = JSON::fromDTMI((const unsigned char *)headerCache.getHeader() + 8, headerCache.getHeaderLen() - 8, i);
+      metadata.swap(parsed);
+    }
+    metadata.netPrepare();
+    metadataValid = true;
+    headerCache.clear();
+  }
+  while (pendingTracks.size()){
+    loadTrack(pendingTracks.begin()->first);
+  }
   return metadata;
 }
 
@@ -640,22 +1567,32 @@ bool DTSC::File::writeHeader(std::string & header, bool force){
   }
   headerSize = header.size();
   int pSize = htonl(header.size());
-  fseek(F, 4, SEEK_SET);
+  fseeko(F, 4, SEEK_SET);
   int tmpret = fwrite((void*)( &pSize), 4, 1, F);
   if (tmpret != 1){
     return false;
   }
-  fseek(F, 8, SEEK_SET);
+  fseeko(F, 8, SEEK_SET);
   int ret = fwrite(header.c_str(), headerSize, 1, F);
-  fseek(F, 8 + headerSize, SEEK_SET);
+  fseeko(F, 8 + headerSize, SEEK_SET);
+  if ((long long int)(8 + headerSize) > endPos){
+    endPos = 8 + headerSize;
+  }
   return (ret == 1);
 }
 
 /// Adds the given string as a new header to the end of the file.
 /// \returns The positon the header was written at, or 0 on failure.
 long long int DTSC::File::addHeader(std::string & header){
-  fseek(F, 0, SEEK_END);
-  long long int writePos = ftell(F);
+  if (writer){
+    long long int writePos = endPos;
+    int hSize = htonl(header.size());
+    bool ret = writer->append(DTSC::Magic_Header, 4) && writer->append((char *)&hSize, 4) && writer->append(header.data(), header.size());
+    endPos = writer->getEndPos();
+    return ret ? writePos : 0;
+  }
+  fseeko(F, 0, SEEK_END);
+  long long int writePos = ftello(F);
   int hSize = htonl(header.size());
   int ret = fwrite(DTSC::Magic_Header, 4, 1, F); //write header
   if (ret != 1){
@@ -669,259 +1606,332 @@ long long int DTSC::File::addHeader(std::string & header){
   if (ret != 1){
     return 0;
   }
-  fseek(F, 0, SEEK_END);
-  endPos = ftell(F);
+  fseeko(F, 0, SEEK_END);
+  endPos = ftello(F);
   return writePos; //return position written at
 }
 
 /// Reads the header at the given file position.
 /// If the packet could not be read for any reason, the reason is printed to stderr.
 /// Reading the header means the file position is moved to after the header.
-void DTSC::File::readHeader(int pos){
-  fseek(F, pos, SEEK_SET);
-  if (fread(buffer, 4, 1, F) != 1){
-    if (feof(F)){
-#if DEBUG >= 4
-      fprintf(stderr, "End of file reached (H%i)\n", pos);
-#endif
-    }else{
-      fprintf(stderr, "Could not read header (H%i)\n", pos);
-    }
-    strbuffer = "";
+void DTSC::File::readHeader(long long int pos){
+  metadataValid = true;
+  headerCache.clear();
+  pendingTracks.clear();
+  headerData.clear();
+  if ( !readAt(pos)){
     metadata.null();
     return;
   }
-  if (memcmp(buffer, DTSC::Magic_Header, 4) != 0){
-    fprintf(stderr, "Invalid header - %.4s != %.4s  (H%i)\n", buffer, DTSC::Magic_Header, pos);
-    strbuffer = "";
+  if ( !currentPacket.isHeader()){
+    fprintf(stderr, "Invalid header - %.4s != %.4s  (H%lli)\n", currentPacket.getData(), DTSC::Magic_Header, pos);
+    clearPacket();
     metadata.null();
     return;
   }
-  if (fread(buffer, 4, 1, F) != 1){
-    fprintf(stderr, "Could not read size (H%i)\n", pos);
-    strbuffer = "";
-    metadata.null();
+  //if there is another header, read it instead of this one.
+  long long int moreHeader = 0;
+  if (currentPacket.getInt("moreheader", moreHeader) && moreHeader > 0 && moreHeader < getBytePosEOF()){
+    readHeader(moreHeader);
     return;
   }
-  uint32_t * ubuffer = (uint32_t *)buffer;
-  long packSize = ntohl(ubuffer[0]);
-  strbuffer.resize(packSize);
-  if (packSize){
-    if (fread((void*)strbuffer.c_str(), packSize, 1, F) != 1){
-      fprintf(stderr, "Could not read packet (H%i)\n", pos);
-      strbuffer = "";
-      metadata.null();
-      return;
-    }
-    metadata = JSON::fromDTMI(strbuffer);
-  }
-  //if there is another header, read it and replace metadata with that one.
-  if (metadata.isMember("moreheader") && metadata["moreheader"].asInt() > 0){
-    if (metadata["moreheader"].asInt() < getBytePosEOF()){
-      readHeader(metadata["moreheader"].asInt());
-      return;
-    }
+  if (currentPacket.getPayloadLen()){
+    headerData.assign(currentPacket.getPayload(), currentPacket.getPayloadLen());
+    parseHeader();
   }
   metadata["vod"] = true;
-  metadata.netPrepare();
-}
-
-long int DTSC::File::getBytePosEOF(){
-  return endPos;
+  meta.fromJSON(metadata);
+  if ( !pendingTracks.size()){
+    finishHeader();
+  }
 }
 
-long int DTSC::File::getBytePos(){
-  return ftell(F);
+/// Reads the DTMI object member at p, before end: sets name to its name and value to the start of its value.
+/// \returns The start of the next member, or NULL if there is no complete member at p.
+static const char * readMember(const char * p, const char * end, std::string & name, const char * & value){
+  if (p + 2 > end || !(p[0] || p[1])){
+    return 0;
+  }
+  unsigned int nameLen = ((unsigned char)p[0] << 8) | (unsigned char)p[1];
+  if ((unsigned int)(end - p - 2) < nameLen){
+    return 0;
+  }
+  name.assign(p + 2, nameLen);
+  value = p + 2 + nameLen;
+  return DTSC::skipDTMI(value, end);
 }
 
-bool DTSC::File::reachedEOF(){
-  return feof(F);
+/// Returns true if the DTMI value at p is an object with at least one member.
+static bool hasMembers(const char * p, const char * end){
+  return end - p > 3 && ((unsigned char)p[0] == 0xE0 || (unsigned char)p[0] == 0xFF) && (p[1] || p[2]);
 }
 
-/// Reads the packet available at the current file position.
-/// If the packet could not be read for any reason, the reason is printed to stderr.
-/// Reading the packet means the file position is increased to the next packet.
-void DTSC::File::seekNext(){
-  if ( !currentPositions.size()){
-    strbuffer = "";
-    jsonbuffer.null();
+/// Parses headerData into metadata, except for the keys and fragments of tracks.
+/// Those are only located, in pendingTracks, and parsed by loadTrack() once the track is needed.
+void DTSC::File::parseHeader(){
+  metadata.null();
+  const unsigned char * data = (const unsigned char *)headerData.data();
+  unsigned int len = headerData.size();
+  const char * end = headerData.data() + len;
+  unsigned int i = 0;
+  if ( !hasMembers(headerData.data(), end)){
+    metadata = JSON::fromDTMI(data, len, i);
     return;
   }
-  fseek(F,currentPositions.begin()->bytePos, SEEK_SET);
-  if ( reachedEOF()){
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
+  std::string name;
+  const char * value = 0;
+  const char * next = 0;
+  for (const char * p = headerData.data() + 1; (next = readMember(p, end, name, value)); p = next){
+    i = value - headerData.data();
+    if (name != "tracks" || !hasMembers(value, next)){
+      metadata[name] = JSON::fromDTMI(data, len, i);
+      continue;
+    }
+    std::string trackName;
+    const char * trackValue = 0;
+    const char * trackNext = 0;
+    for (const char * t = value + 1; (trackNext = readMember(t, next, trackName, trackValue)); t = trackNext){
+      i = trackValue - headerData.data();
+      if ( !hasMembers(trackValue, trackNext)){
+        metadata["tracks"][trackName] = JSON::fromDTMI(data, len, i);
+        continue;
+      }
+      JSON::Value & track = metadata["tracks"][trackName];
+      pendingTrack pending = {0, 0, 0, 0};
+      std::string member;
+      const char * memberValue = 0;
+      const char * memberNext = 0;
+      for (const char * m = trackValue + 1; (memberNext = readMember(m, trackNext, member, memberValue)); m = memberNext){
+        i = memberValue - headerData.data();
+        if (member == "keys"){
+          pending.keysStart = i;
+          pending.keysLen = memberNext - memberValue;
+        }else if (member == "frags"){
+          pending.fragsStart = i;
+          pending.fragsLen = memberNext - memberValue;
+        }else{
+          track[member] = JSON::fromDTMI(data, len, i);
+        }
+      }
+      if (pending.keysLen || pending.fragsLen){
+        pendingTracks[track.isMember("trackid") ? track["trackid"].asInt() : 0] = pending;
+      }
+    }
   }
-  clearerr(F);
-  if ( !metadata.isMember("merged") || !metadata["merged"]){
-    seek_time(currentPositions.begin()->seekTime + 1, currentPositions.begin()->trackID);
+}
+
+/// Parses the keys and fragments of the given track into metadata and meta, if that was not done yet.
+void DTSC::File::loadTrack(int trackNo){
+  std::map<int, pendingTrack>::iterator it = pendingTracks.find(trackNo);
+  if (it == pendingTracks.end()){
+    return;
   }
-  fseek(F,currentPositions.begin()->bytePos, SEEK_SET);
-  currentPositions.erase(currentPositions.begin());
-  lastreadpos = ftell(F);
-  if (fread(buffer, 4, 1, F) != 1){
-    if (feof(F)){
-#if DEBUG >= 4
-      fprintf(stderr, "End of file reached.\n");
-#endif
-    }else{
-      fprintf(stderr, "Could not read header\n");
+  Track & track = meta.tracks[trackNo];
+  JSON::Value & trackRef = metadata["tracks"][track.name];
+  const unsigned char * data = (const unsigned char *)headerData.data();
+  {
+    //the keys and fragments are most of the header, so they are parsed into an arena
+    JSON::Arena arena;
+    unsigned int i = it->second.keysStart;
+    if (it->second.keysLen){
+      JSON::Value keys = JSON::fromDTMI(data, headerData.size(), i);
+      trackRef["keys"].swap(keys);
+    }
+    i = it->second.fragsStart;
+    if (it->second.fragsLen){
+      JSON::Value frags = JSON::fromDTMI(data, headerData.size(), i);
+      trackRef["frags"].swap(frags);
     }
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
   }
-  if (memcmp(buffer, DTSC::Magic_Header, 4) == 0){
-    readHeader(lastreadpos);
-    jsonbuffer = metadata;
-    return;
+  track.fromJSON(track.name, trackRef);
+  pendingTracks.erase(it);
+  if ( !pendingTracks.size()){
+    finishHeader();
+  }
+}
+
+/// Completes the metadata once all of the header was parsed, and adds it to the header cache if wanted.
+void DTSC::File::finishHeader(){
+  headerData.clear();
+  metadata.netPrepare();
+  if (cacheHeader && metadata.isObject()){
+    cacheHeader = false;
+    headerCache.create(headerStat, metadata.toNetPacked(), meta);
+    headerCache.save(headerStat);
+    headerCache.clear();
   }
-  long long unsigned int version = 0;
-  if (memcmp(buffer, DTSC::Magic_Packet, 4) == 0){
-    version = 1;
+}
+
+/// Returns a pointer to len bytes (at most 20) at the given file position, or NULL if they could not be read.
+/// The bytes are valid until the next read.
+const char * DTSC::File::peekAt(long long int pos, unsigned int len){
+  if (mapping && pos >= 0 && pos + len <= mapLen){
+    return mapping + pos;
   }
-  if (memcmp(buffer, DTSC::Magic_Packet2, 4) == 0){
-    version = 2;
+  if (writer && pos + len > writer->getDiskPos()){
+    writer->flush();
   }
-  if (version == 0){
-    fprintf(stderr, "Invalid packet header @ %#x - %.4s != %.4s\n", lastreadpos, buffer, DTSC::Magic_Packet2);
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
+  if (fseeko(F, pos, SEEK_SET) != 0 || fread(buffer, len, 1, F) != 1){
+    atEOF = feof(F);
+    return 0;
   }
-  if (fread(buffer, 4, 1, F) != 1){
-    fprintf(stderr, "Could not read size\n");
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
+  return buffer;
+}
+
+/// Reads the packet or header at the given file position into currentPacket.
+/// Packets that lie within the mapping are not copied; others are read through the FILE into rawbuffer.
+/// If the packet could not be read for any reason, the reason is printed to stderr and the packet is emptied.
+/// Reading the packet means the read position is moved to after it.
+/// \returns True on success, false otherwise.
+bool DTSC::File::readAt(long long int pos){
+  clearPacket();
+  atEOF = false;
+  const char * head = peekAt(pos, 8);
+  if ( !head){
+    if (atEOF){
+#if DEBUG >= 4
+      fprintf(stderr, "End of file reached (%lli)\n", pos);
+#endif
+    }else{
+      fprintf(stderr, "Could not read header (%lli)\n", pos);
+    }
+    return false;
   }
-  uint32_t * ubuffer = (uint32_t *)buffer;
-  long packSize = ntohl(ubuffer[0]);
-  strbuffer.resize(packSize);
-  if (fread((void*)strbuffer.c_str(), packSize, 1, F) != 1){
-    fprintf(stderr, "Could not read packet\n");
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
+  if (memcmp(head, DTSC::Magic_Packet2, 4) != 0 && memcmp(head, DTSC::Magic_Packet, 4) != 0 && memcmp(head, DTSC::Magic_Header, 4) != 0){
+    fprintf(stderr, "Invalid packet header @ %#llx - %.4s != %.4s\n", pos, head, DTSC::Magic_Packet2);
+    return false;
   }
-  if (version == 2){
-    jsonbuffer = JSON::fromDTMI2(strbuffer);
+  long long int packLen = 8 + (long long int)ntohl(((const uint32_t *)head)[1]);
+  if (mapping && pos + packLen <= mapLen){
+    currentPacket.reInit(mapping + pos, packLen);
   }else{
-    jsonbuffer = JSON::fromDTMI(strbuffer);
-  }
-  if (metadata.isMember("merged") && metadata["merged"]){
-    int tempLoc = getBytePos();
-    char newHeader[20];
-    if (fread((void*)newHeader, 20, 1, F) == 1){
-      if (memcmp(newHeader, DTSC::Magic_Packet2, 4) == 0){
-        seekPos tmpPos;
-        tmpPos.bytePos = tempLoc;
-        tmpPos.trackID = ntohl(((int*)newHeader)[2]);
-        if (selectedTracks.find(tmpPos.trackID) != selectedTracks.end()){
-          tmpPos.seekTime = ((long long unsigned int)ntohl(((int*)newHeader)[3])) << 32;
-          tmpPos.seekTime += ntohl(((int*)newHeader)[4]);
-        }else{
-          tmpPos.seekTime = -1;
-          for (JSON::ArrIter it = getTrackById(jsonbuffer["trackid"].asInt())["keys"].ArrBegin(); it != getTrackById(jsonbuffer["trackid"].asInt())["keys"].ArrEnd(); it++){
-            if ((*it)["time"].asInt() > jsonbuffer["time"].asInt()){
-              tmpPos.seekTime = (*it)["time"].asInt();
-              tmpPos.bytePos = (*it)["bpos"].asInt();
-              tmpPos.trackID = jsonbuffer["trackid"].asInt();
-              break;
-            }
-          }
-        }
-        if (tmpPos.seekTime != -1){
-          bool insert = true;
-          for (std::set<seekPos>::iterator curPosIter = currentPositions.begin(); curPosIter != currentPositions.end(); curPosIter++){
-            if ((*curPosIter).trackID == tmpPos.trackID && (*curPosIter).seekTime >= tmpPos.seekTime){
-              insert = false;
-              break;
-            }
-          }
-          if (insert){
-            currentPositions.insert(tmpPos);
-          }else{
-            seek_time(jsonbuffer["time"].asInt() + 1, jsonbuffer["trackid"].asInt(), true);
-          }
-        }
-      }
+    if (writer && pos + packLen > writer->getDiskPos()){
+      writer->flush();
+    }
+    //the FILE is positioned right after the 8 bytes just peeked at when they did not come from the mapping
+    if (head != buffer && fseeko(F, pos + 8, SEEK_SET) != 0){
+      fprintf(stderr, "Could not read packet (%lli)\n", pos);
+      return false;
     }
+    rawbuffer.resize(packLen);
+    memcpy((char *)rawbuffer.data(), head, 8);
+    if (packLen > 8 && fread((char *)rawbuffer.data() + 8, packLen - 8, 1, F) != 1){
+      atEOF = feof(F);
+      fprintf(stderr, "Could not read packet (%lli)\n", pos);
+      return false;
+    }
+    currentPacket.reInit(rawbuffer.data(), packLen);
   }
+  strValid = false;
+  jsonValid = false;
+  readPos = pos + packLen;
+  return true;
 }
 
+/// Empties the current packet and its string and JSON buffers.
+void DTSC::File::clearPacket(){
+  currentPacket.null();
+  strbuffer = "";
+  strValid = true;
+  jsonbuffer.null();
+  jsonValid = true;
+}
 
-void DTSC::File::parseNext(){
-  lastreadpos = ftell(F);
-  if (fread(buffer, 4, 1, F) != 1){
-    if (feof(F)){
-#if DEBUG >= 4
-      fprintf(stderr, "End of file reached.\n");
-#endif
-    }else{
-      fprintf(stderr, "Could not read header\n");
+long long int DTSC::File::getBytePosEOF(){
+  return endPos;
+}
+
+long long int DTSC::File::getBytePos(){
+  return readPos;
+}
+
+bool DTSC::File::reachedEOF(){
+  return atEOF;
+}
+
+/// Orders cursors so the heap functions keep the earliest packet, by time and then track, on top.
+static bool cursorAfter(const DTSC::seekPos & a, const DTSC::seekPos & b){
+  if (a.seekTime != b.seekTime){
+    return a.seekTime > b.seekTime;
+  }
+  return a.trackID > b.trackID;
+}
+
+/// Makes the given position the read cursor for its track, replacing any existing cursor for that track.
+void DTSC::File::addCursor(const seekPos & pos){
+  for (std::vector<seekPos>::iterator it = cursors.begin(); it != cursors.end(); it++){
+    if (it->trackID == pos.trackID){
+      cursors.erase(it);
+      std::make_heap(cursors.begin(), cursors.end(), cursorAfter);
+      break;
     }
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
   }
-  if (memcmp(buffer, DTSC::Magic_Header, 4) == 0){
-    if (lastreadpos != 0){
-      readHeader(lastreadpos);
-      jsonbuffer = metadata;
-    }else{
-      if (fread(buffer, 4, 1, F) != 1){
-        fprintf(stderr, "Could not read size\n");
-        strbuffer = "";
-        jsonbuffer.null();
-        return;
-      }
-      uint32_t * ubuffer = (uint32_t *)buffer;
-      long packSize = ntohl(ubuffer[0]);
-      strbuffer.resize(packSize);
-      if (fread((void*)strbuffer.c_str(), packSize, 1, F) != 1){
-        fprintf(stderr, "Could not read packet\n");
-        strbuffer = "";
-        jsonbuffer.null();
-        return;
+  cursors.push_back(pos);
+  std::push_heap(cursors.begin(), cursors.end(), cursorAfter);
+}
+
+/// Moves the cursor to the first packet of its track at or after byte position from.
+/// Follows the packet lengths from there, only looking at packet headers.
+/// \returns True if a packet was found, false if the end of the file was reached first.
+bool DTSC::File::advanceCursor(seekPos & cursor, long long int from){
+  while (true){
+    const char * header = peekAt(from, 20);
+    if ( !header){
+      return false;
+    }
+    if (memcmp(header, DTSC::Magic_Packet2, 4) == 0){
+      if (ntohl(((const uint32_t *)header)[2]) == cursor.trackID){
+        cursor.seekTime = ((long long unsigned int)ntohl(((const uint32_t *)header)[3])) << 32;
+        cursor.seekTime += ntohl(((const uint32_t *)header)[4]);
+        cursor.bytePos = from;
+        return true;
       }
-      jsonbuffer = JSON::fromDTMI(strbuffer);
+    }else if (memcmp(header, DTSC::Magic_Packet, 4) != 0 && memcmp(header, DTSC::Magic_Header, 4) != 0){
+      fprintf(stderr, "Invalid packet header @ %#llx - %.4s != %.4s\n", from, header, DTSC::Magic_Packet2);
+      return false;
     }
+    from += 8 + ntohl(((const uint32_t *)header)[1]);
+  }
+}
+
+/// Reads the next packet of the selected tracks, in order of time and then track ID.
+/// Every selected track has its own cursor, which moves forward through the file to the next packet of that track after each read.
+/// If the packet could not be read for any reason, the reason is printed to stderr.
+void DTSC::File::seekNext(){
+  if ( !cursors.size()){
+    clearPacket();
     return;
   }
-  long long unsigned int version = 0;
-  if (memcmp(buffer, DTSC::Magic_Packet, 4) == 0){
-    version = 1;
+  std::pop_heap(cursors.begin(), cursors.end(), cursorAfter);
+  lastreadpos = cursors.back().bytePos;
+  if ( !readAt(lastreadpos)){
+    cursors.pop_back();
+    return;
   }
-  if (memcmp(buffer, DTSC::Magic_Packet2, 4) == 0){
-    version = 2;
+  if (advanceCursor(cursors.back(), readPos)){
+    std::push_heap(cursors.begin(), cursors.end(), cursorAfter);
+  }else{
+    cursors.pop_back();
   }
-  if (version == 0){
-    fprintf(stderr, "Invalid packet header @ %#x - %.4s != %.4s\n", lastreadpos, buffer, DTSC::Magic_Packet2);
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
+  if (prefetch && currentPacket.getTime() >= prefetchCheck){
+    updatePrefetch();
   }
-  if (fread(buffer, 4, 1, F) != 1){
-    fprintf(stderr, "Could not read size\n");
-    strbuffer = "";
-    jsonbuffer.null();
+}
+
+
+void DTSC::File::parseNext(){
+  lastreadpos = readPos;
+  if ( !readAt(lastreadpos)){
     return;
   }
-  uint32_t * ubuffer = (uint32_t *)buffer;
-  long packSize = ntohl(ubuffer[0]);
-  strbuffer.resize(packSize);
-  if (fread((void*)strbuffer.c_str(), packSize, 1, F) != 1){
-    fprintf(stderr, "Could not read packet\n");
-    strbuffer = "";
-    jsonbuffer.null();
-    return;
+  if (prefetch && !currentPacket.isHeader()){
+    prefetch->progress(readPos, currentPacket.getTime());
   }
-  if (version == 2){
-    jsonbuffer = JSON::fromDTMI2(strbuffer);
-  }else{
-    jsonbuffer = JSON::fromDTMI(strbuffer);
+  if (currentPacket.isHeader() && lastreadpos != 0){
+    cacheHeader = false;
+    readHeader(lastreadpos);
+    jsonbuffer = getMeta();
+    jsonValid = true;
   }
 }
 
@@ -931,12 +1941,28 @@ long long int DTSC::File::getLastReadPos(){
 }
 
 /// Returns the internal buffer of the last read packet in raw binary format.
+/// The packet is only copied into the buffer the first time this is called for it; see getPacketView() to avoid the copy.
 std::string & DTSC::File::getPacket(){
+  if ( !strValid){
+    strbuffer.assign(currentPacket.getPayload(), currentPacket.getPayloadLen());
+    strValid = true;
+  }
   return strbuffer;
 }
 
+/// Returns a view of the last read packet, including its magic and length.
+/// The view points into the file mapping or read buffer, and is valid until the next packet is read.
+const DTSC::Packet & DTSC::File::getPacketView(){
+  return currentPacket;
+}
+
 /// Returns the internal buffer of the last read packet in JSON format.
+/// The packet is only decoded the first time this is called for it.
 JSON::Value & DTSC::File::getJSON(){
+  if ( !jsonValid){
+    jsonbuffer = currentPacket.toJSON();
+    jsonValid = true;
+  }
   return jsonbuffer;
 }
 
@@ -944,52 +1970,71 @@ JSON::Value & DTSC::File::getJSON(){
 JSON::Value & DTSC::File::getTrackById(int trackNo){
   static JSON::Value empty;
   if (trackMapping.find(trackNo) != trackMapping.end()){
+    if ( !metadataValid){
+      return getMeta()["tracks"][trackMapping[trackNo]];
+    }
+    loadTrack(trackNo);
     return metadata["tracks"][trackMapping[trackNo]];
   }
   return empty;
 }
 
+/// Finds the first packet of the given track with a time of at least ms, and adds it to the positions to read.
+/// Uses the sidecar index when it matches the file, needing only one read to check the packet it points to.
+/// Otherwise, scans forward packet by packet from the last keyframe before ms.
+/// \returns True if such a packet was found, false otherwise.
 bool DTSC::File::seek_time(int ms, int trackNo, bool forceSeek){
+  loadTrack(trackNo);
   seekPos tmpPos;
   tmpPos.trackID = trackNo;
-  if (!forceSeek && jsonbuffer && ms > jsonbuffer["time"].asInt() && trackNo >= jsonbuffer["trackid"].asInt()){
-    tmpPos.seekTime = jsonbuffer["time"].asInt();
+  if (index && index.getSrcSize() == (long long unsigned int)endPos){
+    indexEntry found;
+    if ( !index.find(trackNo, ms, found)){
+      return false;
+    }
+    const char * header = peekAt(found.bpos, 20);
+    if (header && memcmp(header, Magic_Packet2, 4) == 0 && (int)ntohl(((const uint32_t *)header)[2]) == trackNo){
+      tmpPos.seekTime = found.time;
+      tmpPos.bytePos = found.bpos;
+      addCursor(tmpPos);
+      return true;
+    }
+    //the index does not match the file, so fall back to scanning it
+  }
+  if (!forceSeek && currentPacket && ms > (long long int)currentPacket.getTime() && trackNo >= currentPacket.getTrackId()){
+    tmpPos.seekTime = currentPacket.getTime();
     tmpPos.bytePos = getBytePos();
   }else{
     tmpPos.seekTime = 0;
     tmpPos.bytePos = 0;
   }
-  JSON::Value & keys = metadata["tracks"][trackMapping[trackNo]]["keys"];
-  for (JSON::ArrIter keyIt = keys.ArrBegin(); keyIt != keys.ArrEnd(); keyIt++){
-    if ((*keyIt)["time"].asInt() > ms){
+  std::deque<Key> & keys = meta.tracks[trackNo].keys;
+  for (std::deque<Key>::iterator keyIt = keys.begin(); keyIt != keys.end(); keyIt++){
+    if ((long long int)keyIt->time > ms){
       break;
     }
-    if ((*keyIt)["time"].asInt() > tmpPos.seekTime){
-      tmpPos.seekTime = (*keyIt)["time"].asInt();
-      tmpPos.bytePos = (*keyIt)["bpos"].asInt();
+    if (keyIt->time > tmpPos.seekTime){
+      tmpPos.seekTime = keyIt->time;
+      tmpPos.bytePos = keyIt->bpos;
     }
   }
   bool foundPacket = false;
   while ( !foundPacket){
-    lastreadpos = ftell(F);
-    if (reachedEOF()){
+    //read the header
+    const char * header = peekAt(tmpPos.bytePos, 20);
+    if ( !header){
       return false;
     }
-    //Seek to first packet after ms.
-    seek_bpos(tmpPos.bytePos);
-    //read the header
-    char header[20];
-    fread((void*)header, 20, 1, F);
     //check if packetID matches, if not, skip size + 8 bytes.
-    int packSize = ntohl(((int*)header)[1]);
-    int packID = ntohl(((int*)header)[2]);
+    unsigned int packSize = ntohl(((const uint32_t *)header)[1]);
+    int packID = ntohl(((const uint32_t *)header)[2]);
     if (memcmp(header,Magic_Packet2,4) != 0 || packID != trackNo){
       tmpPos.bytePos += 8 + packSize;
       continue;
     }
     //get timestamp of packet, if too large, break, if not, skip size bytes.
-    long long unsigned int myTime = ((long long unsigned int)ntohl(((int*)header)[3]) << 32);
-    myTime += ntohl(((int*)header)[4]);
+    long long unsigned int myTime = ((long long unsigned int)ntohl(((const uint32_t *)header)[3]) << 32);
+    myTime += ntohl(((const uint32_t *)header)[4]);
     tmpPos.seekTime = myTime;
     if (myTime >= ms){
       foundPacket = true;
@@ -998,15 +2043,15 @@ bool DTSC::File::seek_time(int ms, int trackNo, bool forceSeek){
       continue;
     }
   }
-  currentPositions.insert(tmpPos);
-  //fprintf(stderr,"Seek_time to %d on track %d, time %d on track %d found\n", ms, trackNo, tmpPos.seekTime,tmpPos.trackID);
+  addCursor(tmpPos);
+  return true;
 }
 
 /// Attempts to seek to the given time in ms within the file.
 /// Returns true if successful, false otherwise.
 bool DTSC::File::seek_time(int ms){
-  currentPositions.clear();
-  seekPos tmpPos;
+  cursors.clear();
+  prefetchCheck = 0;
   for (std::set<int>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
     seek_bpos(0);
     seek_time(ms,(*it));
@@ -1014,49 +2059,164 @@ bool DTSC::File::seek_time(int ms){
   return true;
 }
 
-bool DTSC::File::seek_bpos(int bpos){
-  if (fseek(F, bpos, SEEK_SET) == 0){
-    return true;
+bool DTSC::File::seek_bpos(long long int bpos){
+  if (bpos < 0){
+    return false;
   }
-  return false;
+  readPos = bpos;
+  atEOF = false;
+  return true;
 }
 
-void DTSC::File::writePacket(std::string & newPacket){
-  fseek(F, 0, SEEK_END);
-  fwrite(newPacket.c_str(), newPacket.size(), 1, F); //write contents
-  fseek(F, 0, SEEK_END);
-  endPos = ftell(F);
+/// Appends the given packed packet to the end of the file.
+/// \returns False if it could not be written. With a write buffer, this includes any earlier buffered write that failed.
+bool DTSC::File::writePacket(std::string & newPacket){
+  if (writer){
+    bool ret = writer->append(newPacket.data(), newPacket.size());
+    endPos = writer->getEndPos();
+    return ret;
+  }
+  fseeko(F, 0, SEEK_END);
+  int ret = fwrite(newPacket.c_str(), newPacket.size(), 1, F); //write contents
+  fseeko(F, 0, SEEK_END);
+  endPos = ftello(F);
+  return (ret == 1);
 }
 
-void DTSC::File::writePacket(JSON::Value & newPacket){
-  writePacket(newPacket.toNetPacked());
+/// Appends the given packet to the end of the file, see writePacket(std::string &).
+bool DTSC::File::writePacket(JSON::Value & newPacket){
+  return writePacket(newPacket.toNetPacked());
 }
 
 bool DTSC::File::atKeyframe(){
-  if (getJSON().isMember("keyframe")){
+  if (currentPacket.isKeyframe()){
     return true;
   }
-  long long int bTime = jsonbuffer["time"].asInt();
-  JSON::Value & keys = getTrackById(jsonbuffer["trackid"].asInt())["keys"];
-  for (JSON::ArrIter aIt = keys.ArrBegin(); aIt != keys.ArrEnd(); ++aIt){
-    if ((*aIt)["time"].asInt() >= bTime){
-      return ((*aIt)["time"].asInt() == bTime);
+  long long int bTime = currentPacket.getTime();
+  loadTrack(currentPacket.getTrackId());
+  std::deque<Key> & keys = meta.tracks[currentPacket.getTrackId()].keys;
+  for (std::deque<Key>::iterator aIt = keys.begin(); aIt != keys.end(); ++aIt){
+    if ((long long int)aIt->time >= bTime){
+      return ((long long int)aIt->time == bTime);
     }
   }
   return false;
 }
 
+/// Selects the tracks to read packets of, parsing their keys and fragments from the header if that was not done yet.
 void DTSC::File::selectTracks(std::set<int> & tracks){
   selectedTracks = tracks;
-  if ( !currentPositions.size()){
+  for (std::set<int>::iterator it = tracks.begin(); it != tracks.end(); it++){
+    loadTrack(*it);
+  }
+  if ( !cursors.size()){
     seek_time(0);
   }else{
-    currentPositions.clear();
+    cursors.clear();
+  }
+}
+
+/// Buffers all appended packets and headers in memory, writing them to disk on a background thread.
+/// Appends then only copy the data, and the file size is kept in memory. Headers are still rewritten in place directly.
+/// Packets being appended can be read back at any time: reading data that was not written yet waits for it.
+/// \param bufferSize Size of each of the write buffers. Zero writes everything buffered and stops buffering.
+/// \param sync Whether to fdatasync or fsync the file after every buffer written.
+/// \returns True if writes are buffered afterwards, false otherwise.
+bool DTSC::File::setWriteBuffer(unsigned int bufferSize, syncPolicy sync){
+  if (writer){
+    delete writer;
+    writer = 0;
+  }
+  if ( !bufferSize || !F){
+    return false;
+  }
+  fflush(F);
+  int newFd = dup(fileno(F));
+  if (newFd == -1){
+    return false;
+  }
+  writer = new FileWriter(newFd, endPos, bufferSize, sync);
+  if ( !*writer){
+    delete writer;
+    writer = 0;
+    return false;
+  }
+  return true;
+}
+
+/// Blocks until everything written to this file is passed to the operating system.
+/// \returns False if any of it could not be written, including earlier buffered writes that failed.
+bool DTSC::File::flush(){
+  bool ret = true;
+  if (writer){
+    ret = writer->flush();
+  }
+  if (F && fflush(F) != 0){
+    ret = false;
+  }
+  return ret;
+}
+
+/// Compares keys by time, for searching in the keys of a track.
+static bool keyTimeBefore(long long unsigned int time, const DTSC::Key & key){
+  return time < key.time;
+}
+
+/// Starts reading ahead of playback on a background thread, leadMs milliseconds of media ahead.
+/// seekNext() tells the prefetcher which byte ranges each selected track needs for that long, based on the key positions.
+/// If the keys have no byte positions, and for parseNext(), the lead is estimated from the bitrate read so far instead.
+/// \param leadMs The lead in milliseconds, or zero to stop reading ahead.
+/// \returns True if reading ahead afterwards, false otherwise.
+bool DTSC::File::setPrefetch(unsigned int leadMs){
+  if (prefetch){
+    delete prefetch;
+    prefetch = 0;
+  }
+  if ( !leadMs || !F){
+    return false;
+  }
+  prefetch = new Util::Prefetcher();
+  if ( !prefetch->start(fileno(F), leadMs)){
+    delete prefetch;
+    prefetch = 0;
+    return false;
+  }
+  prefetchCheck = 0;
+  return true;
+}
+
+/// Tells the prefetcher which byte ranges the cursors need for the next lead time, earliest cursor first.
+/// Every range runs from a cursor to the first key of its track that starts after the lead time.
+void DTSC::File::updatePrefetch(){
+  long long unsigned int now = currentPacket.getTime();
+  long long unsigned int until = now + prefetch->getLead();
+  prefetchCheck = now + prefetch->getLead() / 4;
+  std::vector<seekPos> ordered = cursors;
+  std::sort(ordered.begin(), ordered.end(), cursorAfter);
+  std::vector<Util::byteRange> ranges;
+  for (std::vector<seekPos>::reverse_iterator it = ordered.rbegin(); it != ordered.rend(); it++){
+    std::deque<Key> & keys = meta.tracks[it->trackID].keys;
+    if (keys.size() && !keys.front().bpos){
+      prefetch->progress(readPos, now);
+      return;
+    }
+    Util::byteRange range;
+    range.start = it->bytePos;
+    range.end = endPos;
+    std::deque<Key>::iterator next = std::upper_bound(keys.begin(), keys.end(), until, keyTimeBefore);
+    if (next != keys.end() && (long long int)next->bpos > range.start){
+      range.end = next->bpos;
+    }
+    ranges.push_back(range);
   }
+  prefetch->want(ranges);
 }
 
 /// Close the file if open
 DTSC::File::~File(){
+  setPrefetch(0);
+  setWriteBuffer(0);
+  setMapped(false);
   if (F){
     fclose(F);
     F = 0;
@@ -8,13 +8,18 @@
 #include <string>
 #include <deque>
 #include <set>
+#include <map>
 #include <stdio.h> //for FILE
+#include <pthread.h>
 #include "json.h"
 #include "socket.h"
 #include "timing.h"
+#include "shared_memory.h"
+#include "prefetch.h"
 
 namespace DTSC {
   bool isFixed(JSON::Value & metadata);
+  const char * skipDTMI(const char * p, const char * end);
 
   /// This enum holds all possible datatypes for DTSC packets.
   enum datatype{
@@ -26,9 +31,78 @@ namespace DTSC {
     INVALID ///< Anything else or no data available.
   };
 
+  /// A single key of a DTSC::Track. Every key starts with a keyframe.
+  struct Key{
+    Key();
+    void addPart(unsigned int partSize);
+    long long unsigned int time; ///< Timestamp of the first packet in this key, in ms.
+    long long unsigned int bpos; ///< Byte position of the first packet in the file, or 0 if not known.
+    unsigned int len; ///< Duration of this key in ms, or 0 while it is still being filled.
+    unsigned int num; ///< Sequence number of this key, starting at 1.
+    unsigned int size; ///< Total size of all packets in this key, in bytes.
+    unsigned int partCount; ///< Amount of packets in this key.
+    std::string parts; ///< Sizes of all packets in this key, encoded with JSON::encodeVector.
+  };
+
+  /// A single fragment of a DTSC::Track: a run of consecutive keys.
+  struct Fragment{
+    Fragment();
+    long long unsigned int time; ///< Timestamp of the first key in this fragment, in ms.
+    unsigned int num; ///< Number of the first key in this fragment.
+    unsigned int len; ///< Amount of keys in this fragment.
+    unsigned int dur; ///< Duration of this fragment in ms.
+  };
+
+  /// Typed version of the per-track header data that changes while a stream is running.
+  /// Track descriptors such as codec and init data are not kept here, they stay in the JSON metadata.
+  class Track{
+    public:
+      Track();
+      void fromJSON(const std::string & trackName, JSON::Value & trackRef);
+      void toJSON(JSON::Value & trackRef) const;
+      void toDelta(JSON::Value & delta, unsigned int fromKey) const;
+      void applyDelta(JSON::Value & delta);
+      void toBinary(std::string & target) const;
+      bool fromBinary(const char * & data, const char * end);
+      unsigned int updateFragments(unsigned int defaultDuration, unsigned int defaultMinKeys, bool finished = false);
+      void removeFirstKey();
+      std::string name; ///< Name of this track in the metadata, such as "video0".
+      int trackID;
+      std::string type; ///< Track type, such as "video" or "audio".
+      long long int firstms;
+      long long int lastms;
+      long long int maxbps;
+      long long int missedFrags;
+      std::deque<Key> keys;
+      std::deque<Fragment> fragments;
+      unsigned int fragmentDuration; ///< Target fragment duration in ms for this track, or 0 for the stream default.
+      unsigned int fragmentMinKeys; ///< Minimum amount of keys per fragment for this track, or 0 for the stream default.
+      void resetFragmenter();
+    private:
+      Fragment pendingFrag; ///< The fragment currently being built, empty if len is 0.
+      unsigned int fragCursor; ///< Number of the next finished key that has not been fragmented yet.
+  };
+
+  /// Typed version of the DTSC metadata parts that change while a stream is running, indexed by track ID.
+  /// Converts from and to the DTMI header layout only when asked to.
+  class Meta{
+    public:
+      Meta();
+      Meta(JSON::Value & source);
+      void fromJSON(JSON::Value & source);
+      void toJSON(JSON::Value & target) const;
+      void toBinary(std::string & target) const;
+      bool fromBinary(const char * data, unsigned int len);
+      void reset();
+      std::map<int,Track> tracks;
+      bool live;
+      long long int bufferWindow;
+  };
+
   extern char Magic_Header[]; ///< The magic bytes for a DTSC header
   extern char Magic_Packet[]; ///< The magic bytes for a DTSC packet
   extern char Magic_Packet2[]; ///< The magic bytes for a DTSC packet version 2
+  extern char Magic_HeaderDelta[]; ///< The magic bytes for a DTSC header delta
 
   /// A simple structure used for ordering byte seek positions.
   struct seekPos {
@@ -53,12 +127,133 @@ namespace DTSC {
     unsigned int trackID;
   };
 
+  /// A read-only view of a single DTSC packet or header in memory, such as a file mapping or a read buffer.
+  /// Nothing is copied and fields are only decoded when they are asked for.
+  class Packet{
+    public:
+      Packet();
+      Packet(const char * data, unsigned int len);
+      void reInit(const char * data, unsigned int len);
+      void null();
+      operator bool() const;
+      int getVersion() const;
+      bool isHeader() const;
+      bool isValid() const;
+      const char * getData() const;
+      unsigned int getDataLen() const;
+      const char * getPayload() const;
+      unsigned int getPayloadLen() const;
+      int getTrackId() const;
+      long long unsigned int getTime() const;
+      bool isKeyframe() const;
+      bool getPayloadData(const char * & dataPtr, unsigned int & len) const;
+      bool getInt(const char * name, long long int & result) const;
+      bool getString(const char * name, const char * & str, unsigned int & len) const;
+      JSON::View getObject() const;
+      JSON::Value toJSON() const;
+    private:
+      const char * data; ///< Start of the packet, at its magic, or NULL if empty.
+      unsigned int dataLen; ///< Length of the packet including magic and length.
+  };
+
+  /// The time, byte position and total size of a single packet in a DTSC file.
+  struct indexEntry {
+    bool operator < (const indexEntry & rhs) const {
+      if (time != rhs.time){
+        return time < rhs.time;
+      }
+      return bpos < rhs.bpos;
+    }
+    long long unsigned int time;
+    long long unsigned int bpos;
+    unsigned int size;
+  };
+
+  /// A sidecar index of a DTSC file, stored next to it with a .dtsh extension added.
+  /// Holds the time, byte position and size of every packet, sorted by time per track, in a fixed big-endian layout:
+  /// "DTSH", version (4 bytes), indexed file size (8 bytes), indexed file mtime in nanoseconds (8 bytes), track count (4 bytes),
+  /// per track its ID (4 bytes), entry count (4 bytes) and entry offset (8 bytes),
+  /// followed by the entries as time (8 bytes), byte position (8 bytes) and size (4 bytes).
+  /// Loaded indexes are memory mapped, so all processes serving the same file share one copy.
+  class FileIndex{
+    public:
+      FileIndex();
+      FileIndex(const FileIndex & rhs);
+      FileIndex & operator = (const FileIndex & rhs);
+      ~FileIndex();
+      bool load(const std::string & path, long long unsigned int srcSize, long long unsigned int srcTime);
+      void create(std::map<int, std::vector<indexEntry> > & tracks, long long unsigned int srcSize, long long unsigned int srcTime);
+      bool save(const std::string & path);
+      void clear();
+      operator bool() const;
+      long long unsigned int getSrcSize() const;
+      bool find(int trackID, long long unsigned int ms, indexEntry & result) const;
+    private:
+      bool findTrack(int trackID, long long unsigned int & offset, unsigned int & count) const;
+      void getEntry(long long unsigned int offset, unsigned int num, indexEntry & result) const;
+      const char * data; ///< Start of the index, in mapped or in built, or NULL if there is none.
+      long long unsigned int dataLen; ///< Length of the index.
+      char * mapped; ///< Mapping of the index file, or NULL.
+      std::string built; ///< Holds the index if it was created or copied instead of loaded.
+  };
+
+  /// Identifies a version of a file: the device and inode it is stored at, and its size and mtime.
+  /// Used instead of struct stat, whose layout depends on _FILE_OFFSET_BITS, so this header is the same for every user of the library.
+  struct fileStamp{
+    fileStamp();
+    long long unsigned int dev;
+    long long unsigned int ino;
+    long long unsigned int size;
+    long long unsigned int mtime; ///< Modification time, in seconds.
+    long long unsigned int mtimeNsec; ///< Nanoseconds part of the modification time, so files rewritten within the same second differ.
+    long long unsigned int mtimeNs() const;
+  };
+
+  /// A cache of the resolved header of a DTSC file, shared between processes through a file in the Mist temporary folder.
+  /// Holds the header exactly as DTSC::File keeps it after reading, with any moreheader chain followed, plus the typed
+  /// metadata in the binary layout of Meta::toBinary(), so opening a cached file needs neither JSON::fromDTMI nor Meta::fromJSON.
+  /// There is one cache file per device and inode; an entry for an older size or mtime of the same file is replaced.
+  /// The layout is big-endian: "DTHC", version (4 bytes), device, inode, file size and file mtime in nanoseconds (8 bytes each),
+  /// header length and metadata length (4 bytes each), followed by the header and the metadata.
+  /// Loaded caches are memory mapped, so all processes serving the same file share one copy.
+  class HeaderCache{
+    public:
+      HeaderCache();
+      HeaderCache(const HeaderCache & rhs);
+      HeaderCache & operator = (const HeaderCache & rhs);
+      ~HeaderCache();
+      bool load(const fileStamp & st);
+      void create(const fileStamp & st, const std::string & header, const Meta & meta);
+      bool save(const fileStamp & st);
+      void clear();
+      operator bool() const;
+      const char * getHeader() const;
+      unsigned int getHeaderLen() const;
+      bool getMeta(Meta & result) const;
+    private:
+      static std::string getPath(const fileStamp & st);
+      const char * data; ///< Start of the cache, in mapped or in built, or NULL if there is none.
+      long long unsigned int dataLen; ///< Length of the cache.
+      char * mapped; ///< Mapping of the cache file, or NULL.
+      std::string built; ///< Holds the cache if it was created or copied instead of loaded.
+  };
+
+  /// Policies for syncing data to disk after the FileWriter wrote a buffer.
+  enum syncPolicy{
+    SYNC_NONE = 0, ///< Leave writing back to disk to the operating system.
+    SYNC_DATA = 1, ///< Call fdatasync after every buffer.
+    SYNC_FULL = 2 ///< Call fsync after every buffer.
+  };
+
+  class FileWriter;
+
   /// A simple wrapper class that will open a file and allow easy reading/writing of DTSC data from/to it.
+  /// Files opened for reading are memory mapped when possible, so packets are read without copying.
   class File{
     public:
       File();
       File(const File & rhs);
-      File(std::string filename, bool create = false);
+      File(std::string filename, bool create = false, bool useIndex = true);
       File & operator = (const File & rhs);
       operator bool() const;
       ~File();
@@ -66,39 +261,185 @@ namespace DTSC {
       long long int getLastReadPos();
       bool writeHeader(std::string & header, bool force = false);
       long long int addHeader(std::string & header);
-      long int getBytePosEOF();
-      long int getBytePos();
+      long long int getBytePosEOF();
+      long long int getBytePos();
       bool reachedEOF();
       void seekNext();
       void parseNext();
       std::string & getPacket();
+      const Packet & getPacketView();
       JSON::Value & getJSON();
       JSON::Value & getTrackById(int trackNo);
       bool seek_time(int seconds);
       bool seek_time(int seconds, int trackNo, bool forceSeek = false);
-      bool seek_bpos(int bpos);
-      void writePacket(std::string & newPacket);
-      void writePacket(JSON::Value & newPacket);
+      bool seek_bpos(long long int bpos);
+      bool writePacket(std::string & newPacket);
+      bool writePacket(JSON::Value & newPacket);
       bool atKeyframe();
       void selectTracks(std::set<int> & tracks);
+      bool setMapped(bool enable);
+      bool setWriteBuffer(unsigned int bufferSize, syncPolicy sync = SYNC_NONE);
+      bool flush();
+      bool setPrefetch(unsigned int leadMs);
     private:
-      long int endPos;
-      void readHeader(int pos);
+      void updatePrefetch();
+      Util::Prefetcher * prefetch; ///< Reads ahead of the cursors, if enabled.
+      long long unsigned int prefetchCheck; ///< Media time at which the prefetched ranges are updated next.
+      FileWriter * writer; ///< Writes appended data in the background, if enabled.
+      long long int endPos;
+      void readHeader(long long int pos);
+      void parseHeader();
+      void loadTrack(int trackNo);
+      void finishHeader();
+      bool readAt(long long int pos);
+      const char * peekAt(long long int pos, unsigned int len);
+      void clearPacket();
+      void buildIndex(const std::string & path, long long unsigned int srcTime);
+      void addCursor(const seekPos & pos);
+      bool advanceCursor(seekPos & cursor, long long int from);
+      FileIndex index; ///< Sidecar index used by seek_time, if it matches this file.
+      Packet currentPacket; ///< The last read packet, in the mapping or in rawbuffer.
+      std::string rawbuffer; ///< Holds the last read packet when it was not read from the mapping.
       std::string strbuffer;
+      bool strValid; ///< True if strbuffer holds the contents of currentPacket.
       JSON::Value jsonbuffer;
+      bool jsonValid; ///< True if jsonbuffer holds the decoded currentPacket.
+      char * mapping; ///< Read-only mapping of the file, or NULL.
+      long long int mapLen; ///< Length of the mapping.
+      long long int readPos; ///< Byte position the next parseNext() reads from.
+      bool atEOF; ///< True if the last read failed because the end of the file was reached.
       JSON::Value metadata;
+      bool metadataValid; ///< False while metadata was not parsed from headerCache yet.
+      HeaderCache headerCache; ///< Cached header this file was opened from, until it is parsed into metadata.
+      /// Location in headerData of the keys and fragments of a track that were not parsed yet.
+      struct pendingTrack{
+        unsigned int keysStart;
+        unsigned int keysLen; ///< Length of the keys, or 0 if the track has none.
+        unsigned int fragsStart;
+        unsigned int fragsLen; ///< Length of the fragments, or 0 if the track has none.
+      };
+      std::map<int, pendingTrack> pendingTracks; ///< Tracks whose keys and fragments are not parsed yet, by track ID.
+      std::string headerData; ///< Copy of the header contents while any tracks are pending.
+      fileStamp headerStat; ///< Version of the file, for adding its header to the header cache once it is complete.
+      bool cacheHeader; ///< True if the header is to be added to the header cache once it is complete.
+      Meta meta; ///< Typed copy of the keys and fragments in metadata.
       std::map<int,std::string> trackMapping;
       long long int currtime;
       long long int lastreadpos;
       int currframe;
       FILE * F;
       unsigned long headerSize;
-      char buffer[4];
+      char buffer[20]; ///< Scratch space for reading packet headers through the FILE.
       bool created;
-      std::set<seekPos> currentPositions;
+      std::vector<seekPos> cursors; ///< Heap of read positions, one per selected track, earliest first.
       std::set<int> selectedTracks;
   };
-  //FileWriter
+
+  /// Appends data to a file through a few large, page aligned buffers.
+  /// Full buffers are written by a background thread with positioned writes, so appending costs a memory copy
+  /// and only blocks when all buffers are waiting for the disk.
+  class FileWriter{
+    public:
+      FileWriter(int fd, long long int startPos, unsigned int bufferSize = 4 * 1024 * 1024, syncPolicy sync = SYNC_NONE);
+      ~FileWriter();
+      operator bool() const;
+      bool append(const char * data, unsigned int len);
+      bool flush();
+      long long int getEndPos() const;
+      long long int getDiskPos();
+    private:
+      FileWriter(const FileWriter & rhs);
+      FileWriter & operator=(const FileWriter & rhs);
+      /// A buffer and the file position it is to be written at.
+      struct block{
+        char * data;
+        unsigned int len;
+        long long int pos;
+      };
+      static void * flushThread(void * arg);
+      void flushLoop();
+      void submit();
+      int fd; ///< The file written to, owned by this writer.
+      unsigned int bufferSize;
+      syncPolicy sync;
+      block current; ///< The buffer being filled, data is NULL if none.
+      std::deque<block> pending; ///< Full buffers waiting to be written, oldest first.
+      std::vector<char *> spare; ///< Buffers not in use.
+      std::vector<char *> allBuffers;
+      long long int endPos; ///< Position after the last appended byte.
+      long long int diskPos; ///< Position up to which everything was written.
+      bool stopping;
+      volatile int failed; ///< Set once, atomically, when the writer could not start or a write failed. Read from any thread.
+      pthread_mutex_t lock;
+      pthread_cond_t workCond; ///< Signalled when a buffer is pending or the writer stops.
+      pthread_cond_t doneCond; ///< Signalled when a buffer was written.
+      pthread_t thread;
+  };
+
+  /// Rewrites DTSC files into the merged layout: all packets interleaved by time and then track,
+  /// behind a single header holding bpos, size and parts for every key and the fragments of every track.
+  /// Packets are copied one at a time, so apart from the header itself memory use does not depend on the file size.
+  class Fixer{
+    public:
+      Fixer();
+      bool fix(const std::string & source, const std::string & target);
+      unsigned int fragmentDuration; ///< Target fragment duration in ms, 5000 by default.
+      unsigned int fragmentMinKeys; ///< Minimum amount of keys per fragment, 2 by default.
+      unsigned int bufferSize; ///< Size of each write buffer for the target, 4MiB by default.
+    private:
+      bool scan(File & in, Meta & meta);
+      std::string makeHeader(JSON::Value & metadata, Meta & meta);
+  };
+
+  /// A single packet or header found by DTSC::Scanner.
+  struct scanEntry{
+    long long unsigned int bpos; ///< Byte position of the packet in the file.
+    unsigned int size; ///< Size of the whole packet, including magic and length.
+    long long unsigned int time;
+    int trackID;
+    bool keyframe;
+    bool header; ///< True if this is a header instead of a packet.
+  };
+
+  /// Reads every packet of a DTSC file on multiple threads, without relying on the file being intact.
+  /// The file is memory mapped and split into byte ranges, one per thread. Every thread except the first starts by
+  /// searching its range for a DTP2, DTPD or DTSC magic followed by a complete packet that is itself followed by another
+  /// complete packet, and then follows the packet lengths from there. Whenever the lengths lead to something that is not a
+  /// complete packet, the bytes up to the next such packet are reported as corrupt.
+  /// Afterwards the ranges are joined in order: where a thread started inside a packet of the range before it,
+  /// the packets are followed from the end of that range until they meet the ones that thread found.
+  /// The result is the same as reading the whole file on a single thread.
+  class Scanner{
+    public:
+      Scanner();
+      bool scan(const std::string & path);
+      bool saveIndex();
+      unsigned int threads; ///< Amount of threads to use, or 0 for one per online processor.
+      std::map<int, std::vector<indexEntry> > packets; ///< Every packet per track, in file order.
+      std::map<int, std::vector<indexEntry> > keyframes; ///< Every keyframe per track, in file order.
+      std::vector<long long unsigned int> headers; ///< Byte positions of all headers, in file order.
+      std::vector<Util::byteRange> corrupt; ///< Byte ranges that hold no complete packets, in file order.
+    private:
+      /// The part of the file scanned by a single thread.
+      struct scanPart{
+        const Scanner * scanner;
+        long long int start; ///< First byte of the range of this part.
+        long long int end; ///< Byte after the range of this part.
+        std::vector<scanEntry> entries; ///< Packets found, in file order.
+        std::vector<Util::byteRange> corrupt; ///< Corrupt ranges found, in file order.
+        long long int exitPos; ///< Position the packets continue at after this part.
+        bool exitSynced; ///< False if exitPos is not a packet, but the end of a corrupt range that may continue.
+      };
+      static void * scanThread(void * arg);
+      unsigned int packetAt(long long int pos, Packet & pack) const;
+      long long int resync(long long int from, long long int to) const;
+      void scanChain(scanPart & part, long long int pos, const scanPart * joinWith) const;
+      void addPart(const scanPart & part, long long int from);
+      std::string path; ///< Path of the scanned file.
+      long long unsigned int srcTime; ///< Modification time of the scanned file, in nanoseconds.
+      const char * mapping; ///< Mapping of the file while it is being scanned.
+      long long int mapLen; ///< Size of the scanned file.
+  };
 
   /// A simple structure used for ordering byte seek positions.
   struct livePos {
@@ -136,19 +477,200 @@ namespace DTSC {
     volatile unsigned int trackID;
   };
 
-  /// A part from the DTSC::Stream ringbuffer.
-  /// Holds information about a buffer that will stay consistent
-  class Ring{
+  /// A single packet slot in a DTSC::PacketRing.
+  /// Holds a small typed header next to the packet itself, so the buffer logic never has to look inside the packet.
+  struct liveSlot {
+    livePos pos; ///< Buffer position of this packet (the time may be adjusted to keep positions unique).
+    bool keyframe; ///< True if this packet starts a new key in the metadata.
+    unsigned int dataSize; ///< Size of the data member of this packet, in bytes.
+    unsigned int bytes; ///< Memory this packet is accounted for in the buffer byte limits: its data plus its packed form.
+    JSON::Value pack; ///< The packet itself. Keeps its packed form cached internally when buffering.
+  };
+
+  /// A circular array of packet slots for a single track.
+  /// Appending and removing the oldest slot are O(1); slots are reused instead of reallocated.
+  /// The capacity only grows (by doubling) when a push is done while the ring is full.
+  class PacketRing{
+    public:
+      PacketRing(unsigned int initialCapacity = 16);
+      unsigned int size() const;
+      unsigned int capacity() const;
+      bool empty() const;
+      liveSlot & push();
+      void pop();
+      void clear();
+      liveSlot & front();
+      liveSlot & back();
+      liveSlot & operator[](unsigned int index);
+      const liveSlot & operator[](unsigned int index) const;
+      int find(const livePos & pos) const;
+      unsigned int upperBound(const livePos & pos) const;
+      unsigned int lowerBound(long long unsigned int seekTime) const;
+      long long unsigned int firstIndex() const;
+      long long unsigned int bytes; ///< Sum of the bytes of all slots in use, kept up to date by the owner.
+    private:
+      long long unsigned int dropped; ///< Amount of slots released since this ring was created, the absolute index of the oldest slot.
+      std::vector<liveSlot> slots; ///< Slot storage, always a power of two in size.
+      unsigned int start; ///< Index in slots of the oldest slot.
+      unsigned int count; ///< Amount of slots currently in use.
+  };
+
+  /// Writes packed packets into a block of memory laid out as a lock-free single producer, multiple consumer log.
+  /// The block starts with a small header, followed by a byte ring for the packets and an area for the packed stream header.
+  /// Every packet gets a sequence number. The writer never waits for readers: readers that fall too far behind are
+  /// lapped, and notice so themselves. The block may be plain memory or shared memory, it holds no pointers.
+  class LiveLog{
+    public:
+      LiveLog();
+      static unsigned int blockSize(unsigned int dataSize, unsigned int metaSize);
+      void init(char * block, unsigned int dataSize, unsigned int metaSize);
+      void close();
+      operator bool() const;
+      bool addPacket(const std::string & packed, const livePos & pos, bool keyframe);
+      bool setHeader(const std::string & packed);
+      long long unsigned int writeSeq() const;
+    private:
+      char * block; ///< Start of the log block, or NULL if not initialized.
+      std::deque<long long unsigned int> records; ///< Start offsets of all records still in the ring, oldest first.
+  };
+
+  /// A reader of a block written by a DTSC::LiveLog. Any amount of cursors may read the same block at the same time.
+  /// Reading never writes to the block, so it may be mapped read-only.
+  class LogCursor{
+    public:
+      LogCursor();
+      bool attach(const char * block, unsigned int len);
+      void detach();
+      bool getPacket(std::string & packed);
+      bool getHeader(std::string & packed);
+      void seekNewestKey();
+      void seekOldest();
+      bool peekPos(livePos & result) const;
+      bool closed() const;
+      volatile long long unsigned int seq; ///< Sequence number of the next packet to read.
+      volatile unsigned int generation; ///< Incremented every time the writer laps this cursor.
+      livePos pos; ///< Position of the packet last returned by getPacket().
+      bool keyframe; ///< True if the packet last returned by getPacket() was a keyframe.
+    private:
+      const char * block; ///< Start of the log block, or NULL if not attached.
+      long long unsigned int offset; ///< Byte offset of the next record to read.
+      unsigned int metaGeneration; ///< Generation of the last header returned by getHeader().
+  };
+
+  class Stream;
+
+  /// A reader of the packets of a DTSC::Stream, as given out by DTSC::Stream::getRing().
+  /// Reading through next() is lock-free and safe from any thread while the stream keeps receiving packets.
+  /// The stream knows all rings it gave out, until they are returned with DTSC::Stream::dropRing().
+  /// Every call to next() publishes the ring's sequence number in a slot owned by the stream, which is all DTSC::Stream::slowestRing() reads.
+  class Ring : public LogCursor{
     public:
       Ring(livePos v);
-      livePos b;
-      //volatile unsigned int b; ///< Holds current number of buffer. May and is intended to change unexpectedly!
-      volatile bool waiting; ///< If true, this Ring is currently waiting for a buffer fill.
-      volatile bool starved; ///< If true, this Ring can no longer receive valid data.
-      volatile bool updated; ///< If true, this Ring should write a new header.
-      volatile int playCount;
+      bool next(std::string & packed);
+      livePos b; ///< Position of the packet last returned by next(), or the starting position.
+      int playCount;
+    private:
+      friend class Stream;
+      Stream * owner; ///< The stream this ring was given out by, or NULL.
+      int index; ///< Index of this ring in the stream's reader list, or -1 if not listed.
+      volatile long long unsigned int * seqSlot; ///< The stream's slot this ring publishes seq in, or NULL.
   };
 
+  /// Writes live DTSC packets and the stream header into a shared memory segment named "live_<streamname>".
+  /// The segment holds a DTSC::LiveLog block, so any amount of DTSC::SharedReader objects in any process can follow it without locking.
+  class SharedBuffer{
+    public:
+      SharedBuffer(const std::string & streamName, unsigned int dataSize = 32 * 1024 * 1024, unsigned int metaSize = 4 * 1024 * 1024);
+      ~SharedBuffer();
+      operator bool() const;
+      bool addPacket(const std::string & packed, const livePos & pos, bool keyframe);
+      bool setHeader(const std::string & packed);
+    private:
+      IPC::sharedPage page;
+      LiveLog log;
+  };
+
+  /// Follows a segment written by a DTSC::SharedBuffer with its own cursor.
+  /// If the writer overwrites data this reader has not read yet, the reader skips ahead to the newest key and counts a lap.
+  class SharedReader{
+    public:
+      SharedReader();
+      SharedReader(const std::string & streamName);
+      bool open(const std::string & streamName);
+      operator bool() const;
+      bool connected() const;
+      bool getHeader(std::string & packed);
+      bool getPacket(std::string & packed);
+      void seekNewestKey();
+      void seekOldest();
+      const livePos & lastPos() const;
+      bool lastKeyframe() const;
+      unsigned int laps() const;
+    private:
+      IPC::sharedPage page;
+      LogCursor cursor;
+  };
+
+  /// A histogram of durations, with a bucket per power of two nanoseconds.
+  /// Bucket i counts durations of at least 2^i and less than 2^(i+1) ns, bucket 0 also counts zero.
+  /// Written by a single thread, may be read from any thread without locking (reads may be slightly inconsistent).
+  struct latencyHistogram{
+    latencyHistogram();
+    void add(long long unsigned int ns);
+    void toJSON(JSON::Value & target) const;
+    volatile long long unsigned int count; ///< Amount of durations added.
+    volatile long long unsigned int total; ///< Sum of all durations added, in ns.
+    volatile long long unsigned int max; ///< Longest duration added, in ns.
+    volatile unsigned int buckets[40];
+  };
+
+  /// Ingest counters for a single track of a DTSC::Stream.
+  /// Written only by the thread adding packets, may be read from any thread without locking.
+  struct trackStats{
+    trackStats(int trackID);
+    void toJSON(JSON::Value & target, long long unsigned int nowSecond) const;
+    int trackID;
+    volatile long long unsigned int packets; ///< Total amount of packets added.
+    volatile long long unsigned int bytes; ///< Total amount of data bytes added.
+    volatile long long unsigned int keyframes; ///< Total amount of keys started.
+    volatile long long unsigned int second; ///< The second (in wall clock time) secondPackets and secondBytes are counted in.
+    volatile unsigned int secondPackets; ///< Packets added during second.
+    volatile unsigned int secondBytes; ///< Data bytes added during second.
+    volatile unsigned int lastPackets; ///< Packets added during the second before second.
+    volatile unsigned int lastBytes; ///< Data bytes added during the second before second.
+    latencyHistogram addTime; ///< Time spent in DTSC::Stream::addPacket for packets of this track.
+    latencyHistogram cutTime; ///< Time spent removing packets of this track from the buffer.
+  };
+
+  /// A single track in a DTSC::MergeCursor: the next packet of that track to deliver.
+  struct mergeEntry{
+    bool operator < (const mergeEntry & rhs) const{
+      return rhs.pos < pos;//inverted, so the standard heap functions keep the oldest position on top
+    }
+    livePos pos; ///< Position of the packet at index, only valid while in the heap.
+    long long unsigned int index; ///< Absolute index of the next packet in the track's DTSC::PacketRing.
+  };
+
+  /// Keeps the state of a walk through a selection of tracks of a DTSC::Stream, in position order.
+  /// Holds a small heap with the next packet of every selected track that has one,
+  /// so every step only costs O(log k) for k selected tracks, no matter how many other tracks the stream has.
+  /// Use DTSC::Stream::seekMerge() to start it and DTSC::Stream::getNext() to step through it.
+  class MergeCursor{
+    public:
+      MergeCursor();
+      livePos pos; ///< Position of the packet last returned, or the position seeked to.
+    private:
+      friend class Stream;
+      std::set<int> tracks; ///< The selected tracks.
+      std::vector<mergeEntry> heap; ///< Selected tracks with a next packet available, oldest on top.
+      std::vector<mergeEntry> waiting; ///< Selected tracks that were caught up, with the index of the next packet they will get.
+      unsigned int resets; ///< Value of the stream's reset counter when this cursor was last seeked.
+  };
+
+  /// Function type for listeners that want to know when a DTSC::Stream completes a fragment.
+  /// The fragment is passed right after it was added to the track's fragment list.
+  typedef void (*fragmentListener)(Stream & stream, int trackID, const Fragment & fragment, void * userData);
+
   /// Holds temporary data for a DTSC stream and provides functions to utilize it.
   /// Optionally also acts as a ring buffer of a certain requested size.
   /// If ring buffering mode is enabled, it will automatically grow in size to always contain at least one keyframe.
@@ -157,7 +679,8 @@ namespace DTSC {
       Stream();
       ~Stream();
       Stream(unsigned int buffers, unsigned int bufferTime = 0);
-      JSON::Value metadata;
+      JSON::Value metadata; ///< The stream header. Keys and fragments are updated from meta once per key, see syncMeta().
+      Meta meta; ///< Keys, fragments and other header data that changes while streaming.
       JSON::Value & getPacket();
       JSON::Value & getPacket(livePos num);
       JSON::Value & getTrackById(int trackNo);
@@ -170,26 +693,81 @@ namespace DTSC {
       std::string & outPacket();
       std::string & outPacket(livePos num);
       std::string & outHeader();
+      std::string & outHeaderDelta(int trackID, unsigned int fromKey);
       Ring * getRing();
       unsigned int getTime();
       void dropRing(Ring * ptr);
+      void enableRings(unsigned int dataSize = 4 * 1024 * 1024, unsigned int maxRings = 256);
+      long long unsigned int slowestRing();
       int canSeekms(unsigned int ms);
       livePos msSeek(unsigned int ms, std::set<int> & allowedTracks);
       void setBufferTime(unsigned int ms);
+      void setBufferBytes(long long unsigned int bytes);
+      static void setProcessBufferBytes(long long unsigned int bytes);
+      static long long unsigned int getProcessBytes();
+      JSON::Value getBufferStats();
+      JSON::Value getStats();
+      void setFragmentTarget(unsigned int ms, unsigned int minKeys = 2);
+      void setTrackFragmentTarget(int trackID, unsigned int ms, unsigned int minKeys = 2);
+      void addFragmentListener(fragmentListener listener, void * userData = 0);
+      void removeFragmentListener(fragmentListener listener, void * userData = 0);
+      bool shareLive(const std::string & streamName, unsigned int dataSize = 32 * 1024 * 1024);
       bool isNewest(DTSC::livePos & pos, std::set<int> & allowedTracks);
       DTSC::livePos getNext(DTSC::livePos & pos, std::set<int> & allowedTracks);
+      void seekMerge(MergeCursor & cursor, const livePos & pos, std::set<int> & allowedTracks);
+      bool getNext(MergeCursor & cursor);
       void endStream();
       void waitForMeta(Socket::Connection & sourceSocket);
     protected:
       void cutOneBuffer();
+      void cutFromTrack(int trackID);
+      trackStats * getTrackStats(int trackID);
+      trackStats * statSlots[64]; ///< Counters of the first 64 tracks seen, in order of appearance. Entries are never removed.
+      volatile unsigned int statCount; ///< Amount of entries in statSlots in use.
+      volatile long long unsigned int resyncs; ///< Amount of times parsePacket lost sync and had to search for the next packet.
+      bool syncing; ///< True while parsePacket is searching for the next packet after losing sync, so every loss is counted once.
+      volatile long long unsigned int headerCount; ///< Amount of full headers and header deltas parsed.
+      latencyHistogram parseTime; ///< Time spent in parsePacket for every packet parsed.
+      bool overByteLimit();
       void resetStream();
-      std::map<livePos,JSON::Value> buffers;
-      std::map<int,std::set<livePos> > keyframes;
+      void loadMeta();
+      void syncMeta(int trackID);
+      std::string deltaBuffer; ///< Packed header delta, as returned by outHeaderDelta().
+      void applyDelta(JSON::Value & delta);
+      liveSlot * findSlot(livePos & pos);
+      liveSlot * oldestSlot();
+      liveSlot * newestSlot();
+      std::map<int,PacketRing> buffers; ///< Per-track packet storage, indexed by track ID.
+      std::map<int,std::deque<livePos> > keyframes; ///< Per-track keyframe positions, oldest first.
+      unsigned int bufferedPackets; ///< Total amount of packets in all buffers.
+      long long unsigned int bufferedBytes; ///< Total bytes of all packets in all buffers, see liveSlot::bytes.
+      long long unsigned int byteLimit; ///< Maximum for bufferedBytes, or 0 for no limit.
+      static volatile long long unsigned int processBytes; ///< Total bytes buffered by all streams in this process.
+      static long long unsigned int processByteLimit; ///< Maximum for processBytes, or 0 for no limit.
+      unsigned int resets; ///< Amount of times resetStream() was called, so merge cursors know when their indices became invalid.
+      livePos newestPos; ///< Position of the most recently added packet.
       void addPacket(JSON::Value & newPack);
       datatype datapointertype;
       unsigned int buffercount;
       unsigned int buffertime;
+      unsigned int fragmentDuration; ///< Default target fragment duration in ms.
+      unsigned int fragmentMinKeys; ///< Default minimum amount of keys per fragment.
+      std::map<int,std::pair<unsigned int, unsigned int> > trackFragmentTargets; ///< Per track target duration and minimum keys, set by setTrackFragmentTarget(). Kept outside meta so new headers do not reset them.
+      std::vector<std::pair<fragmentListener, void *> > fragmentListeners;
+      void updateFragments(Track & track);
       std::map<int,std::string> trackMapping;
       void deletionCallback(livePos deleting);
+      SharedBuffer * shared; ///< Shared memory copy of this stream for other processes, or NULL if not shared.
+      void publishHeader();
+      void publishDelta(const livePos & pos);
+      std::vector<long long unsigned int> ringMemory; ///< Block for ringLog, 8-byte aligned. Empty until enableRings() is called.
+      LiveLog ringLog; ///< Packed copy of all packets for the rings that were given out.
+      std::vector<Ring *> rings; ///< All rings that were given out, NULL for free entries. Never resized once allocated.
+      std::vector<long long unsigned int> ringSeqs; ///< Per entry in rings, the sequence number its ring published, or RING_FREE. Never resized once allocated.
+      std::map<int,unsigned int> deltaStart; ///< Per track, the first key number the next published header delta holds.
+      unsigned int keysSinceSnapshot; ///< Keys added since the last published full header, 0 if none was published yet.
+    private:
+      Stream(const Stream & rhs);
+      Stream & operator=(const Stream & rhs);
   };
 }
@@ -0,0 +1,160 @@
+/// \file dtsc_fixer.cpp
+/// Holds all code for DTSC::Fixer, which rewrites DTSC files into the merged layout.
+
+#include "dtsc.h"
+
+/// Sets the duration of key to end at endTime, raising the maximum bitrate of track if needed.
+static void finishKey(DTSC::Track & track, DTSC::Key & key, long long unsigned int endTime){
+  key.len = endTime - key.time;
+  if ( !key.len){
+    return;
+  }
+  long long int bps = (double)key.size / ((double)key.len / 1000.0);
+  if (bps > track.maxbps){
+    track.maxbps = (long long int)(bps * 1.2);
+  }
+}
+
+/// Creates a fixer with the default fragment and buffer settings.
+DTSC::Fixer::Fixer(){
+  fragmentDuration = 5000;
+  fragmentMinKeys = 2;
+  bufferSize = 4 * 1024 * 1024;
+}
+
+/// Reads all packets of in, in merged order, and rebuilds the keys and fragments of every track in meta from them.
+/// Key byte positions are stored relative to the first packet, plus one so they are never zero.
+/// A new key starts at every keyframe, and for tracks other than video also after 5 seconds without one.
+/// \returns True if any packets were read, false otherwise.
+bool DTSC::Fixer::scan(File & in, Meta & meta){
+  std::set<int> selected;
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    selected.insert(it->first);
+    it->second.keys.clear();
+    it->second.fragments.clear();
+    it->second.resetFragmenter();
+    it->second.firstms = 0;
+    it->second.lastms = 0;
+    it->second.maxbps = 0;
+    it->second.missedFrags = 0;
+    it->second.fragmentDuration = fragmentDuration;
+    it->second.fragmentMinKeys = fragmentMinKeys;
+  }
+  in.selectTracks(selected);
+  in.seek_time(0);
+  long long unsigned int pos = 0;
+  while (true){
+    in.seekNext();
+    const Packet & pack = in.getPacketView();
+    if ( !pack){
+      break;
+    }
+    Track & track = meta.tracks[pack.getTrackId()];
+    long long int time = pack.getTime();
+    if ( !track.keys.size()){
+      track.firstms = time;
+    }
+    if (pack.isKeyframe() || !track.keys.size() || (track.type != "video" && time - 5000 > (long long int)track.keys.back().time)){
+      Key newKey;
+      newKey.time = time;
+      newKey.bpos = pos + 1;
+      newKey.num = 1;
+      if (track.keys.size()){
+        finishKey(track, track.keys.back(), time);
+        newKey.num = track.keys.back().num + 1;
+      }
+      track.keys.push_back(newKey);
+      track.updateFragments(fragmentDuration, fragmentMinKeys);
+    }
+    const char * data = 0;
+    unsigned int dataLen = 0;
+    pack.getPayloadData(data, dataLen);
+    track.keys.back().addPart(dataLen);
+    track.lastms = time;
+    pos += pack.getDataLen();
+  }
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    if (it->second.keys.size()){
+      finishKey(it->second, it->second.keys.back(), it->second.lastms);
+      it->second.updateFragments(fragmentDuration, fragmentMinKeys, true);
+    }
+  }
+  return pos > 0;
+}
+
+/// Returns the packed header for the tracks in meta, with all other members taken from metadata.
+std::string DTSC::Fixer::makeHeader(JSON::Value & metadata, Meta & meta){
+  JSON::Value header = metadata;
+  //added when the header was read, or only valid for the original layout
+  header.removeMember("time");
+  header.removeMember("vod");
+  header.removeMember("moreheader");
+  header.removeMember("is_fixed");
+  header["merged"] = 1ll;
+  meta.toJSON(header);
+  return header.toPacked();
+}
+
+/// Writes a merged copy of the DTSC file source to target.
+/// The source is read twice: once to build the new header, and once to copy all packets behind it in merged order.
+/// If the copy could not be made for any reason, the reason is printed to stderr.
+/// \returns True on success, false otherwise.
+bool DTSC::Fixer::fix(const std::string & source, const std::string & target){
+  if (source == target){
+    fprintf(stderr, "Cannot fix %s into itself\n", source.c_str());
+    return false;
+  }
+  //the source is only read from start to end, so it needs no index
+  File in(source, false, false);
+  if ( !in){
+    return false;
+  }
+  JSON::Value metadata = in.getMeta();
+  if ( !metadata.isMember("tracks")){
+    fprintf(stderr, "No tracks in %s\n", source.c_str());
+    return false;
+  }
+  Meta meta(metadata);
+  if ( !scan(in, meta)){
+    fprintf(stderr, "No packets in %s\n", source.c_str());
+    return false;
+  }
+  //integers are always 8 bytes in DTMI, so the header size does not depend on the byte positions in it
+  std::string header = makeHeader(metadata, meta);
+  long long unsigned int offset = 8 + header.size();
+  for (std::map<int,Track>::iterator it = meta.tracks.begin(); it != meta.tracks.end(); it++){
+    for (std::deque<Key>::iterator keyIt = it->second.keys.begin(); keyIt != it->second.keys.end(); keyIt++){
+      keyIt->bpos += offset - 1;
+    }
+  }
+  header = makeHeader(metadata, meta);
+  if (8 + header.size() != offset){
+    fprintf(stderr, "Header size changed while fixing %s\n", source.c_str());
+    return false;
+  }
+  File out(target, true);
+  if ( !out){
+    return false;
+  }
+  out.writeHeader(header, true);
+  out.setWriteBuffer(bufferSize);
+  std::string packet;
+  in.seek_time(0);
+  while (true){
+    in.seekNext();
+    const Packet & pack = in.getPacketView();
+    if ( !pack){
+      break;
+    }
+    packet.assign(pack.getData(), pack.getDataLen());
+    if ( !out.writePacket(packet)){
+      fprintf(stderr, "Could not write %s\n", target.c_str());
+      return false;
+    }
+  }
+  if ( !out.flush()){
+    fprintf(stderr, "Could not write %s\n", target.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,211 @@
+/// \file dtsc_headercache.cpp
+/// Holds all code for DTSC::HeaderCache, the cross-process cache of resolved DTSC file headers.
+
+#include "dtsc.h"
+#include "bitfields.h"
+#include "stream.h" //for Util::getTmpFolder
+#include <sstream>
+#include <sys/mman.h> //for mmap
+#include <sys/stat.h> //for fstat
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h> //for mkstemp
+#include <errno.h>
+#include <string.h> //for memcmp
+
+static const unsigned int cacheVersion = 2;
+static const unsigned int cacheHeaderSize = 48; ///< Magic, version, device, inode, file size, file mtime in nanoseconds and both lengths.
+
+/// Creates an empty file stamp.
+DTSC::fileStamp::fileStamp(){
+  dev = 0;
+  ino = 0;
+  size = 0;
+  mtime = 0;
+  mtimeNsec = 0;
+}
+
+/// Returns the modification time in nanoseconds.
+long long unsigned int DTSC::fileStamp::mtimeNs() const{
+  return mtime * 1000000000ull + mtimeNsec;
+}
+
+/// Creates an empty cache.
+DTSC::HeaderCache::HeaderCache(){
+  data = 0;
+  dataLen = 0;
+  mapped = 0;
+}
+
+/// Creates a copy of the given cache.
+DTSC::HeaderCache::HeaderCache(const HeaderCache & rhs){
+  data = 0;
+  dataLen = 0;
+  mapped = 0;
+  *this = rhs;
+}
+
+/// Makes this cache a copy of the given cache. The copy holds the cache in memory, even if rhs was mapped.
+DTSC::HeaderCache & DTSC::HeaderCache::operator =(const HeaderCache & rhs){
+  if (this == &rhs){
+    return *this;
+  }
+  clear();
+  if (rhs.data){
+    built.assign(rhs.data, rhs.dataLen);
+    data = built.data();
+    dataLen = built.size();
+  }
+  return *this;
+}
+
+/// Unmaps the cache, if mapped.
+DTSC::HeaderCache::~HeaderCache(){
+  clear();
+}
+
+/// Empties the cache.
+void DTSC::HeaderCache::clear(){
+  if (mapped){
+    munmap(mapped, dataLen);
+    mapped = 0;
+  }
+  built.clear();
+  data = 0;
+  dataLen = 0;
+}
+
+/// Returns true if this cache holds anything.
+DTSC::HeaderCache::operator bool() const{
+  return data != 0;
+}
+
+/// Returns the path of the cache file for the file with the given status.
+std::string DTSC::HeaderCache::getPath(const fileStamp & st){
+  std::stringstream path;
+  path << Util::getTmpFolder() << "dtsc_" << st.dev << "_" << st.ino << ".hdr";
+  return path.str();
+}
+
+/// Maps the cache file for the file with the given status.
+/// The tmp folder is shared, so the cache is only trusted if it is a regular file owned by this user and not writable by others.
+/// It is only used if it is valid and was created for the same size and mtime.
+/// \returns True if the cache is usable, false otherwise.
+bool DTSC::HeaderCache::load(const fileStamp & st){
+  clear();
+  int handle = open(getPath(st).c_str(), O_RDONLY | O_NOFOLLOW);
+  if (handle == -1){
+    return false;
+  }
+  struct stat cacheSt;
+  if (fstat(handle, &cacheSt) != 0 || cacheSt.st_size < cacheHeaderSize){
+    ::close(handle);
+    return false;
+  }
+  if ( !S_ISREG(cacheSt.st_mode) || cacheSt.st_uid != geteuid() || (cacheSt.st_mode & (S_IWGRP | S_IWOTH))){
+#if DEBUG >= 3
+    fprintf(stderr, "Ignoring header cache %s: not owned by this user\n", getPath(st).c_str());
+#endif
+    ::close(handle);
+    return false;
+  }
+  void * result = mmap(0, cacheSt.st_size, PROT_READ, MAP_SHARED, handle, 0);
+  ::close(handle);
+  if (result == MAP_FAILED){
+    return false;
+  }
+  mapped = (char *)result;
+  data = mapped;
+  dataLen = cacheSt.st_size;
+  bool valid = (memcmp(data, "DTHC", 4) == 0 && Bit::btohl(data + 4) == cacheVersion);
+  valid = valid && Bit::btohll(data + 8) == st.dev && Bit::btohll(data + 16) == st.ino;
+  valid = valid && Bit::btohll(data + 24) == st.size && Bit::btohll(data + 32) == st.mtimeNs();
+  valid = valid && cacheHeaderSize + (long long unsigned int)Bit::btohl(data + 40) + Bit::btohl(data + 44) == dataLen;
+  //the header must be a complete DTSC header packet
+  valid = valid && Bit::btohl(data + 40) >= 8 && memcmp(data + cacheHeaderSize, DTSC::Magic_Header, 4) == 0;
+  valid = valid && Bit::btohl(data + cacheHeaderSize + 4) + 8 == Bit::btohl(data + 40);
+  if ( !valid){
+#if DEBUG >= 4
+    fprintf(stderr, "Ignoring outdated or invalid header cache %s\n", getPath(st).c_str());
+#endif
+    clear();
+    return false;
+  }
+  return true;
+}
+
+/// Creates the cache in memory for the file with the given status, from the header packet and typed metadata of that file.
+void DTSC::HeaderCache::create(const fileStamp & st, const std::string & header, const Meta & meta){
+  clear();
+  std::string metaData;
+  meta.toBinary(metaData);
+  built.reserve(cacheHeaderSize + header.size() + metaData.size());
+  built.append("DTHC", 4);
+  Bit::appendl(built, cacheVersion);
+  Bit::appendll(built, st.dev);
+  Bit::appendll(built, st.ino);
+  Bit::appendll(built, st.size);
+  Bit::appendll(built, st.mtimeNs());
+  Bit::appendl(built, header.size());
+  Bit::appendl(built, metaData.size());
+  built += header;
+  built += metaData;
+  data = built.data();
+  dataLen = built.size();
+}
+
+/// Writes the cache to the cache file for the file with the given status.
+/// The cache is written to a temporary file first and then renamed, so other processes never see a partial cache.
+/// The temporary file is created with mkstemp, so it can not be a file or link prepared by another user of the tmp folder.
+/// \returns True on success, false otherwise.
+bool DTSC::HeaderCache::save(const fileStamp & st){
+  if ( !data){
+    return false;
+  }
+  std::string path = getPath(st);
+  std::string tmpPath = path + ".XXXXXX";
+  int handle = mkstemp(&(tmpPath[0]));
+  if (handle == -1){
+#if DEBUG >= 3
+    fprintf(stderr, "Could not write header cache %s\n", path.c_str());
+#endif
+    return false;
+  }
+  bool ret = true;
+  unsigned int done = 0;
+  while (ret && done < dataLen){
+    ssize_t written = write(handle, data + done, dataLen - done);
+    if (written < 0 && errno == EINTR){
+      continue;
+    }
+    ret = (written > 0);
+    if (ret){
+      done += written;
+    }
+  }
+  ret = (::close(handle) == 0) && ret;
+  if ( !ret || rename(tmpPath.c_str(), path.c_str()) != 0){
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+/// Returns the cached header packet, including its magic and length, or NULL if there is none.
+const char * DTSC::HeaderCache::getHeader() const{
+  return data ? data + cacheHeaderSize : 0;
+}
+
+/// Returns the length of the cached header packet.
+unsigned int DTSC::HeaderCache::getHeaderLen() const{
+  return data ? Bit::btohl(data + 40) : 0;
+}
+
+/// Loads the cached typed metadata into result.
+/// \returns True on success, false if there is no cache or its metadata is invalid.
+bool DTSC::HeaderCache::getMeta(Meta & result) const{
+  if ( !data){
+    return false;
+  }
+  return result.fromBinary(data + cacheHeaderSize + Bit::btohl(data + 40), Bit::btohl(data + 44));
+}
@@ -0,0 +1,218 @@
+/// \file dtsc_index.cpp
+/// Holds all code for DTSC::FileIndex, the sidecar packet index of DTSC files.
+
+#include "dtsc.h"
+#include "bitfields.h"
+#include <algorithm> //for std::sort
+#include <sstream>
+#include <sys/mman.h> //for mmap
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h> //for memcmp
+
+static const unsigned int indexVersion = 2;
+static const unsigned int indexHeaderSize = 28; ///< Magic, version, file size, file mtime in nanoseconds and track count.
+static const unsigned int indexTrackSize = 16; ///< Track ID, entry count and entry offset.
+static const unsigned int indexEntrySize = 20; ///< Time, byte position and size.
+
+/// Creates an empty index.
+DTSC::FileIndex::FileIndex(){
+  data = 0;
+  dataLen = 0;
+  mapped = 0;
+}
+
+/// Creates a copy of the given index.
+DTSC::FileIndex::FileIndex(const FileIndex & rhs){
+  data = 0;
+  dataLen = 0;
+  mapped = 0;
+  *this = rhs;
+}
+
+/// Makes this index a copy of the given index. The copy holds the index in memory, even if rhs was mapped.
+DTSC::FileIndex & DTSC::FileIndex::operator =(const FileIndex & rhs){
+  if (this == &rhs){
+    return *this;
+  }
+  clear();
+  if (rhs.data){
+    built.assign(rhs.data, rhs.dataLen);
+    data = built.data();
+    dataLen = built.size();
+  }
+  return *this;
+}
+
+/// Unmaps the index, if mapped.
+DTSC::FileIndex::~FileIndex(){
+  clear();
+}
+
+/// Empties the index.
+void DTSC::FileIndex::clear(){
+  if (mapped){
+    munmap(mapped, dataLen);
+    mapped = 0;
+  }
+  built.clear();
+  data = 0;
+  dataLen = 0;
+}
+
+/// Returns true if this index holds anything.
+DTSC::FileIndex::operator bool() const{
+  return data != 0;
+}
+
+/// Returns the size of the file this index was created for.
+long long unsigned int DTSC::FileIndex::getSrcSize() const{
+  return data ? Bit::btohll(data + 8) : 0;
+}
+
+/// Maps the index file at the given path.
+/// The index is only used if it is valid and was created for a file of srcSize bytes, last modified at srcTime (in nanoseconds).
+/// \returns True if the index is usable, false otherwise.
+bool DTSC::FileIndex::load(const std::string & path, long long unsigned int srcSize, long long unsigned int srcTime){
+  clear();
+  int handle = open(path.c_str(), O_RDONLY);
+  if (handle == -1){
+    return false;
+  }
+  struct stat st;
+  if (fstat(handle, &st) != 0 || st.st_size < indexHeaderSize){
+    ::close(handle);
+    return false;
+  }
+  void * result = mmap(0, st.st_size, PROT_READ, MAP_SHARED, handle, 0);
+  ::close(handle);
+  if (result == MAP_FAILED){
+    return false;
+  }
+  mapped = (char *)result;
+  data = mapped;
+  dataLen = st.st_size;
+  bool valid = (memcmp(data, "DTSH", 4) == 0 && Bit::btohl(data + 4) == indexVersion);
+  valid = valid && Bit::btohll(data + 8) == srcSize && Bit::btohll(data + 16) == srcTime;
+  unsigned int trackCount = valid ? Bit::btohl(data + 24) : 0;
+  valid = valid && indexHeaderSize + (long long unsigned int)trackCount * indexTrackSize <= dataLen;
+  for (unsigned int i = 0; valid && i < trackCount; i++){
+    const char * track = data + indexHeaderSize + i * indexTrackSize;
+    valid = Bit::btohll(track + 8) + (long long unsigned int)Bit::btohl(track + 4) * indexEntrySize <= dataLen;
+  }
+  if ( !valid){
+#if DEBUG >= 4
+    fprintf(stderr, "Ignoring outdated or invalid index %s\n", path.c_str());
+#endif
+    clear();
+    return false;
+  }
+  return true;
+}
+
+/// Creates the index in memory from the given packets per track, for a file of srcSize bytes last modified at srcTime.
+/// The entries are sorted in place.
+void DTSC::FileIndex::create(std::map<int, std::vector<indexEntry> > & tracks, long long unsigned int srcSize, long long unsigned int srcTime){
+  clear();
+  built.reserve(indexHeaderSize + tracks.size() * indexTrackSize);
+  built.append("DTSH", 4);
+  Bit::appendl(built, indexVersion);
+  Bit::appendll(built, srcSize);
+  Bit::appendll(built, srcTime);
+  Bit::appendl(built, tracks.size());
+  long long unsigned int offset = indexHeaderSize + tracks.size() * indexTrackSize;
+  for (std::map<int, std::vector<indexEntry> >::iterator it = tracks.begin(); it != tracks.end(); it++){
+    std::sort(it->second.begin(), it->second.end());
+    Bit::appendl(built, it->first);
+    Bit::appendl(built, it->second.size());
+    Bit::appendll(built, offset);
+    offset += it->second.size() * indexEntrySize;
+  }
+  built.reserve(offset);
+  for (std::map<int, std::vector<indexEntry> >::iterator it = tracks.begin(); it != tracks.end(); it++){
+    for (std::vector<indexEntry>::iterator entry = it->second.begin(); entry != it->second.end(); entry++){
+      Bit::appendll(built, entry->time);
+      Bit::appendll(built, entry->bpos);
+      Bit::appendl(built, entry->size);
+    }
+  }
+  data = built.data();
+  dataLen = built.size();
+}
+
+/// Writes the index to the given path.
+/// The index is written to a temporary file first and then renamed, so other processes never see a partial index.
+/// \returns True on success, false otherwise.
+bool DTSC::FileIndex::save(const std::string & path){
+  if ( !data){
+    return false;
+  }
+  std::stringstream tmpPath;
+  tmpPath << path << "." << getpid() << ".tmp";
+  FILE * out = fopen(tmpPath.str().c_str(), "wb");
+  if ( !out){
+#if DEBUG >= 3
+    fprintf(stderr, "Could not write index %s\n", path.c_str());
+#endif
+    return false;
+  }
+  bool ret = (fwrite(data, dataLen, 1, out) == 1);
+  ret = (fclose(out) == 0) && ret;
+  if ( !ret || rename(tmpPath.str().c_str(), path.c_str()) != 0){
+    unlink(tmpPath.str().c_str());
+    return false;
+  }
+  return true;
+}
+
+/// Looks up the entries of the given track.
+/// \returns True if the track is in the index, false otherwise.
+bool DTSC::FileIndex::findTrack(int trackID, long long unsigned int & offset, unsigned int & count) const{
+  if ( !data){
+    return false;
+  }
+  unsigned int trackCount = Bit::btohl(data + 24);
+  for (unsigned int i = 0; i < trackCount; i++){
+    const char * track = data + indexHeaderSize + i * indexTrackSize;
+    if ((int)Bit::btohl(track) == trackID){
+      count = Bit::btohl(track + 4);
+      offset = Bit::btohll(track + 8);
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Reads entry number num of the entries starting at offset.
+void DTSC::FileIndex::getEntry(long long unsigned int offset, unsigned int num, indexEntry & result) const{
+  const char * entry = data + offset + (long long unsigned int)num * indexEntrySize;
+  result.time = Bit::btohll(entry);
+  result.bpos = Bit::btohll(entry + 8);
+  result.size = Bit::btohl(entry + 16);
+}
+
+/// Finds the first packet of the given track with a time of at least ms, using a binary search.
+/// \returns True if there is such a packet, false otherwise.
+bool DTSC::FileIndex::find(int trackID, long long unsigned int ms, indexEntry & result) const{
+  long long unsigned int offset = 0;
+  unsigned int count = 0;
+  if ( !findTrack(trackID, offset, count)){
+    return false;
+  }
+  unsigned int low = 0;
+  unsigned int high = count;
+  while (low < high){
+    unsigned int mid = low + (high - low) / 2;
+    if (Bit::btohll(data + offset + (long long unsigned int)mid * indexEntrySize) < ms){
+      low = mid + 1;
+    }else{
+      high = mid;
+    }
+  }
+  if (low == count){
+    return false;
+  }
+  getEntry(offset, low, result);
+  return true;
+}
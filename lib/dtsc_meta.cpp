@@ -0,0 +1,492 @@
+/// \file dtsc_meta.cpp
+/// Holds all code for the typed DTSC metadata structures.
+
+#include "dtsc.h"
+#include "bitfields.h"
+
+/// Returns the integer value of the given member, or 0 if it does not exist.
+/// Unlike operator[], this never adds members to the object.
+static long long int intMember(JSON::Value & obj, const char * name){
+  if ( !obj.isMember(name)){
+    return 0;
+  }
+  return obj[name].asInt();
+}
+
+/// Reads a key from a key object in the DTMI header layout.
+/// Parts may be given either as an encoded string or as an array of sizes.
+static DTSC::Key keyFromJSON(JSON::Value & keyRef){
+  DTSC::Key newKey;
+  newKey.time = intMember(keyRef, "time");
+  newKey.bpos = intMember(keyRef, "bpos");
+  newKey.len = intMember(keyRef, "len");
+  newKey.num = intMember(keyRef, "num");
+  if ( !keyRef.isMember("parts")){
+    newKey.size = intMember(keyRef, "size");
+  }else if (keyRef["parts"].isArray()){
+    for (JSON::ArrIter pIt = keyRef["parts"].ArrBegin(); pIt != keyRef["parts"].ArrEnd(); pIt++){
+      newKey.addPart(pIt->asInt());
+    }
+  }else{
+    newKey.parts = keyRef["parts"].asString();
+    newKey.partCount = intMember(keyRef, "partsize");
+    newKey.size = intMember(keyRef, "size");
+  }
+  return newKey;
+}
+
+/// Converts a key to a key object in the DTMI header layout.
+static JSON::Value keyToJSON(const DTSC::Key & key){
+  JSON::Value result;
+  result["time"] = (long long int)key.time;
+  result["num"] = (long long int)key.num;
+  if (key.bpos){
+    result["bpos"] = (long long int)key.bpos;
+  }
+  if (key.len){
+    result["len"] = (long long int)key.len;
+  }
+  if (key.size){
+    result["size"] = (long long int)key.size;
+  }
+  if (key.partCount){
+    result["partsize"] = (long long int)key.partCount;
+    result["parts"] = key.parts;
+  }
+  return result;
+}
+
+/// Reads a fragment from a fragment object in the DTMI header layout.
+static DTSC::Fragment fragFromJSON(JSON::Value & fragRef){
+  DTSC::Fragment newFrag;
+  newFrag.time = intMember(fragRef, "time");
+  newFrag.num = intMember(fragRef, "num");
+  newFrag.len = intMember(fragRef, "len");
+  newFrag.dur = intMember(fragRef, "dur");
+  return newFrag;
+}
+
+/// Converts a fragment to a fragment object in the DTMI header layout.
+static JSON::Value fragToJSON(const DTSC::Fragment & frag){
+  JSON::Value result;
+  result["time"] = (long long int)frag.time;
+  result["num"] = (long long int)frag.num;
+  result["len"] = (long long int)frag.len;
+  result["dur"] = (long long int)frag.dur;
+  return result;
+}
+
+/// Appends a string, preceded by its length as a big-endian 32 bits integer.
+static void writeString(std::string & out, const std::string & val){
+  Bit::appendl(out, val.size());
+  out += val;
+}
+
+/// Reads a string written by writeString at data into val and moves data past it.
+/// \returns False if it does not fit before end.
+static bool readString(const char * & data, const char * end, std::string & val){
+  unsigned int len = 0;
+  if ( !Bit::readl(data, end, len) || (unsigned int)(end - data) < len){
+    return false;
+  }
+  val.assign(data, len);
+  data += len;
+  return true;
+}
+
+/// Creates an empty key.
+DTSC::Key::Key(){
+  time = 0;
+  bpos = 0;
+  len = 0;
+  num = 0;
+  size = 0;
+  partCount = 0;
+}
+
+/// Appends a packet of the given size to this key.
+void DTSC::Key::addPart(unsigned int partSize){
+  long long int tmp = partSize;
+  parts += JSON::encodeVector(&tmp, &tmp + 1);
+  size += partSize;
+  partCount++;
+}
+
+/// Creates an empty fragment.
+DTSC::Fragment::Fragment(){
+  time = 0;
+  num = 0;
+  len = 0;
+  dur = 0;
+}
+
+/// Creates an empty track.
+DTSC::Track::Track(){
+  trackID = 0;
+  firstms = 0;
+  lastms = 0;
+  maxbps = 0;
+  missedFrags = 0;
+  fragmentDuration = 0;
+  fragmentMinKeys = 0;
+  fragCursor = 0;
+}
+
+/// Loads this track from a track object in the DTMI header layout.
+void DTSC::Track::fromJSON(const std::string & trackName, JSON::Value & trackRef){
+  name = trackName;
+  trackID = intMember(trackRef, "trackid");
+  if (trackRef.isMember("type")){
+    type = trackRef["type"].asString();
+  }
+  firstms = intMember(trackRef, "firstms");
+  lastms = intMember(trackRef, "lastms");
+  maxbps = intMember(trackRef, "maxbps");
+  missedFrags = intMember(trackRef, "missed_frags");
+  keys.clear();
+  fragments.clear();
+  if (trackRef.isMember("keys")){
+    for (JSON::ArrIter it = trackRef["keys"].ArrBegin(); it != trackRef["keys"].ArrEnd(); it++){
+      keys.push_back(keyFromJSON(*it));
+    }
+  }
+  if (trackRef.isMember("frags")){
+    for (JSON::ArrIter it = trackRef["frags"].ArrBegin(); it != trackRef["frags"].ArrEnd(); it++){
+      fragments.push_back(fragFromJSON(*it));
+    }
+  }
+  resetFragmenter();
+}
+
+/// Writes the keys, fragments and timing data of this track into a track object in the DTMI header layout.
+/// Replaces any existing keys and fragments, leaves all other members alone.
+void DTSC::Track::toJSON(JSON::Value & trackRef) const{
+  if (firstms || keys.size()){
+    trackRef["firstms"] = firstms;
+  }
+  if (lastms || keys.size()){
+    trackRef["lastms"] = lastms;
+  }
+  if (maxbps){
+    trackRef["maxbps"] = maxbps;
+  }
+  if (missedFrags){
+    trackRef["missed_frags"] = missedFrags;
+  }
+  trackRef.removeMember("keys");
+  for (std::deque<Key>::const_iterator it = keys.begin(); it != keys.end(); it++){
+    trackRef["keys"].append(keyToJSON(*it));
+  }
+  trackRef.removeMember("frags");
+  for (std::deque<Fragment>::const_iterator it = fragments.begin(); it != fragments.end(); it++){
+    trackRef["frags"].append(fragToJSON(*it));
+  }
+}
+
+/// Writes a header delta for this track into delta: all timing data, the number of the oldest key,
+/// every key numbered fromKey or higher, and every fragment that holds such a key or the key right before it.
+/// Applying the delta to a copy of this track that already had all keys below fromKey brings it fully up to date.
+/// Applying it more than once, or after a newer delta, does no harm to the keys and fragments.
+void DTSC::Track::toDelta(JSON::Value & delta, unsigned int fromKey) const{
+  delta["trackid"] = (long long int)trackID;
+  delta["firstms"] = firstms;
+  delta["lastms"] = lastms;
+  delta["maxbps"] = maxbps;
+  delta["missed_frags"] = missedFrags;
+  delta["firstkey"] = (long long int)(keys.size() ? keys.front().num : 0);
+  for (std::deque<Key>::const_iterator it = keys.begin(); it != keys.end(); it++){
+    if (it->num >= fromKey){
+      delta["keys"].append(keyToJSON(*it));
+    }
+  }
+  for (std::deque<Fragment>::const_iterator it = fragments.begin(); it != fragments.end(); it++){
+    if (it->num + it->len >= fromKey){
+      delta["frags"].append(fragToJSON(*it));
+    }
+  }
+}
+
+/// Applies a header delta as written by toDelta() to this track.
+/// Keys older than the delta's oldest key are removed, together with the fragments that start before the oldest remaining key.
+/// Keys and fragments in the delta replace existing ones with the same number, and are appended otherwise.
+void DTSC::Track::applyDelta(JSON::Value & delta){
+  firstms = intMember(delta, "firstms");
+  lastms = intMember(delta, "lastms");
+  maxbps = intMember(delta, "maxbps");
+  missedFrags = intMember(delta, "missed_frags");
+  unsigned int firstKey = intMember(delta, "firstkey");
+  while (keys.size() && keys.front().num < firstKey){
+    keys.pop_front();
+  }
+  if (delta.isMember("keys")){
+    for (JSON::ArrIter it = delta["keys"].ArrBegin(); it != delta["keys"].ArrEnd(); it++){
+      Key newKey = keyFromJSON(*it);
+      if (keys.size() && newKey.num >= keys.front().num && newKey.num <= keys.back().num){
+        keys[newKey.num - keys.front().num] = newKey;
+      }else if ( !keys.size() || newKey.num > keys.back().num){
+        keys.push_back(newKey);
+      }
+    }
+  }
+  if (delta.isMember("frags")){
+    for (JSON::ArrIter it = delta["frags"].ArrBegin(); it != delta["frags"].ArrEnd(); it++){
+      Fragment newFrag = fragFromJSON(*it);
+      if ( !fragments.size() || newFrag.num > fragments.back().num){
+        fragments.push_back(newFrag);
+      }
+    }
+  }
+  while (fragments.size() && keys.size() && fragments.front().num < keys.front().num){
+    fragments.pop_front();
+  }
+  resetFragmenter();
+}
+
+/// Forgets the fragment being built, so the next call to updateFragments() continues right after the last fragment.
+void DTSC::Track::resetFragmenter(){
+  pendingFrag = Fragment();
+  fragCursor = 0;
+  if (fragments.size()){
+    fragCursor = fragments.back().num + fragments.back().len;
+  }
+}
+
+/// Adds all finished keys that are not part of a fragment yet to the fragment being built.
+/// A fragment is completed once it holds at least the minimum amount of keys and either reaches
+/// the target duration, or ends with a key shorter than 2ms (such as the key added by DTSC::Stream::endStream).
+/// The track's own fragmentDuration and fragmentMinKeys override the given defaults when set.
+/// Every key is only visited once, so this costs O(1) per key.
+/// If finished is set, the newest key is treated as finished as well and the last fragment is completed regardless of its size.
+/// \returns The amount of fragments that were completed and appended to fragments.
+unsigned int DTSC::Track::updateFragments(unsigned int defaultDuration, unsigned int defaultMinKeys, bool finished){
+  if ( !keys.size()){
+    return 0;
+  }
+  unsigned int targetDuration = (fragmentDuration ? fragmentDuration : defaultDuration);
+  unsigned int minKeys = (fragmentMinKeys ? fragmentMinKeys : defaultMinKeys);
+  if (fragCursor < keys.front().num){
+    fragCursor = keys.front().num;
+  }
+  unsigned int completed = 0;
+  //the newest key is still being filled, so it can not be part of a fragment yet
+  unsigned int lastKey = keys.back().num + (finished ? 1 : 0);
+  while (fragCursor < lastKey && fragCursor - keys.front().num < keys.size() - (finished ? 0 : 1)){
+    Key & key = keys[fragCursor - keys.front().num];
+    fragCursor++;
+    if ( !pendingFrag.len){
+      pendingFrag.num = key.num;
+      pendingFrag.time = key.time;
+      pendingFrag.len = 1;
+      pendingFrag.dur = key.len;
+    }else{
+      pendingFrag.len++;
+      pendingFrag.dur += key.len;
+    }
+    if (pendingFrag.len >= minKeys && (pendingFrag.dur >= targetDuration || (pendingFrag.len > 1 && key.len < 2))){
+      fragments.push_back(pendingFrag);
+      pendingFrag = Fragment();
+      completed++;
+    }
+  }
+  if (finished && pendingFrag.len){
+    fragments.push_back(pendingFrag);
+    pendingFrag = Fragment();
+    completed++;
+  }
+  return completed;
+}
+
+/// Removes the oldest key, together with all fragments that can no longer be reached without it.
+/// The duration of removed fragments is added to firstms, and they are counted in missedFrags.
+void DTSC::Track::removeFirstKey(){
+  if ( !keys.size()){
+    return;
+  }
+  keys.pop_front();
+  if ( !keys.size()){
+    return;
+  }
+  while (fragments.size() && fragments.front().num < keys.front().num){
+    firstms += fragments.front().dur;
+    fragments.pop_front();
+    missedFrags++;
+  }
+  //the fragment being built lost its first key, so start it over from the oldest remaining key
+  if (pendingFrag.len && pendingFrag.num < keys.front().num){
+    pendingFrag = Fragment();
+    fragCursor = keys.front().num;
+  }
+}
+
+/// Appends this track to target in a compact binary layout, which fromBinary() reads back much faster than the DTMI header layout.
+/// All integers are big-endian; strings are preceded by their length.
+void DTSC::Track::toBinary(std::string & target) const{
+  Bit::appendl(target, trackID);
+  writeString(target, name);
+  writeString(target, type);
+  Bit::appendll(target, firstms);
+  Bit::appendll(target, lastms);
+  Bit::appendll(target, maxbps);
+  Bit::appendll(target, missedFrags);
+  Bit::appendl(target, fragmentDuration);
+  Bit::appendl(target, fragmentMinKeys);
+  Bit::appendl(target, keys.size());
+  for (std::deque<Key>::const_iterator it = keys.begin(); it != keys.end(); it++){
+    Bit::appendll(target, it->time);
+    Bit::appendll(target, it->bpos);
+    Bit::appendl(target, it->len);
+    Bit::appendl(target, it->num);
+    Bit::appendl(target, it->size);
+    Bit::appendl(target, it->partCount);
+    writeString(target, it->parts);
+  }
+  Bit::appendl(target, fragments.size());
+  for (std::deque<Fragment>::const_iterator it = fragments.begin(); it != fragments.end(); it++){
+    Bit::appendll(target, it->time);
+    Bit::appendl(target, it->num);
+    Bit::appendl(target, it->len);
+    Bit::appendl(target, it->dur);
+  }
+}
+
+/// Loads this track from the binary layout written by toBinary(), starting at data and moving data past it.
+/// \returns True on success, false if the data before end is not a complete track.
+bool DTSC::Track::fromBinary(const char * & data, const char * end){
+  unsigned int tmpInt = 0;
+  long long unsigned int tmpLong = 0;
+  keys.clear();
+  fragments.clear();
+  if ( !Bit::readl(data, end, tmpInt)){
+    return false;
+  }
+  trackID = tmpInt;
+  if ( !readString(data, end, name) || !readString(data, end, type)){
+    return false;
+  }
+  if ( !Bit::readll(data, end, tmpLong)){
+    return false;
+  }
+  firstms = tmpLong;
+  if ( !Bit::readll(data, end, tmpLong)){
+    return false;
+  }
+  lastms = tmpLong;
+  if ( !Bit::readll(data, end, tmpLong)){
+    return false;
+  }
+  maxbps = tmpLong;
+  if ( !Bit::readll(data, end, tmpLong)){
+    return false;
+  }
+  missedFrags = tmpLong;
+  if ( !Bit::readl(data, end, fragmentDuration) || !Bit::readl(data, end, fragmentMinKeys)){
+    return false;
+  }
+  unsigned int count = 0;
+  if ( !Bit::readl(data, end, count)){
+    return false;
+  }
+  for (unsigned int i = 0; i < count; i++){
+    Key newKey;
+    if ( !Bit::readll(data, end, newKey.time) || !Bit::readll(data, end, newKey.bpos) || !Bit::readl(data, end, newKey.len)
+        || !Bit::readl(data, end, newKey.num) || !Bit::readl(data, end, newKey.size) || !Bit::readl(data, end, newKey.partCount)
+        || !readString(data, end, newKey.parts)){
+      return false;
+    }
+    keys.push_back(newKey);
+  }
+  if ( !Bit::readl(data, end, count)){
+    return false;
+  }
+  for (unsigned int i = 0; i < count; i++){
+    Fragment newFrag;
+    if ( !Bit::readll(data, end, newFrag.time) || !Bit::readl(data, end, newFrag.num) || !Bit::readl(data, end, newFrag.len)
+        || !Bit::readl(data, end, newFrag.dur)){
+      return false;
+    }
+    fragments.push_back(newFrag);
+  }
+  resetFragmenter();
+  return true;
+}
+
+/// Creates an empty metadata object.
+DTSC::Meta::Meta(){
+  reset();
+}
+
+/// Creates a metadata object from the given header in the DTMI header layout.
+DTSC::Meta::Meta(JSON::Value & source){
+  fromJSON(source);
+}
+
+/// Removes all tracks and resets all other data.
+void DTSC::Meta::reset(){
+  tracks.clear();
+  live = false;
+  bufferWindow = 0;
+}
+
+/// Loads all tracks from the given header in the DTMI header layout.
+void DTSC::Meta::fromJSON(JSON::Value & source){
+  reset();
+  live = intMember(source, "live");
+  bufferWindow = intMember(source, "buffer_window");
+  if ( !source.isMember("tracks")){
+    return;
+  }
+  for (JSON::ObjIter it = source["tracks"].ObjBegin(); it != source["tracks"].ObjEnd(); it++){
+    int trackID = intMember(it->second, "trackid");
+    tracks[trackID].fromJSON(it->first, it->second);
+  }
+}
+
+/// Writes all tracks into the given header in the DTMI header layout.
+/// Tracks that have no name, and thus no descriptor in the header, are not written.
+void DTSC::Meta::toJSON(JSON::Value & target) const{
+  if (live){
+    target["live"] = 1ll;
+  }
+  if (bufferWindow){
+    target["buffer_window"] = bufferWindow;
+  }
+  for (std::map<int,Track>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+    if (it->second.name.size()){
+      it->second.toJSON(target["tracks"][it->second.name]);
+    }
+  }
+}
+
+/// Writes all tracks to target in the binary layout of Track::toBinary(), after the live flag, buffer window and track count.
+void DTSC::Meta::toBinary(std::string & target) const{
+  Bit::appendl(target, live ? 1 : 0);
+  Bit::appendll(target, bufferWindow);
+  Bit::appendl(target, tracks.size());
+  for (std::map<int,Track>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+    it->second.toBinary(target);
+  }
+}
+
+/// Loads all tracks from the len bytes at data, in the layout written by toBinary().
+/// \returns True on success, false if the data is incomplete or has trailing bytes, in which case this object is reset.
+bool DTSC::Meta::fromBinary(const char * data, unsigned int len){
+  reset();
+  const char * end = data + len;
+  unsigned int tmpInt = 0;
+  long long unsigned int tmpLong = 0;
+  unsigned int count = 0;
+  bool valid = Bit::readl(data, end, tmpInt) && Bit::readll(data, end, tmpLong) && Bit::readl(data, end, count);
+  live = tmpInt;
+  bufferWindow = tmpLong;
+  for (unsigned int i = 0; valid && i < count; i++){
+    //peek at the track ID first, so the track is read in place instead of copied
+    const char * idPos = data;
+    unsigned int trackID = 0;
+    valid = Bit::readl(idPos, end, trackID) && tracks[trackID].fromBinary(data, end);
+  }
+  if ( !valid || data != end){
+    reset();
+    return false;
+  }
+  return true;
+}
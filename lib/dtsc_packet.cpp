@@ -0,0 +1,180 @@
+/// \file dtsc_packet.cpp
+/// Holds all code for DTSC::Packet, a read-only view of a DTSC packet in memory.
+
+#include "dtsc.h"
+#include <string.h> //for memcmp
+#include <arpa/inet.h> //for ntohl
+
+/// Returns a pointer to the byte after the DTMI value starting at p, or NULL if the value does not fit before end.
+const char * DTSC::skipDTMI(const char * p, const char * end){
+  if (p >= end){
+    return 0;
+  }
+  unsigned int size = JSON::View(p, end - p).getSize();
+  return size ? p + size : 0;
+}
+
+/// Creates an empty packet view.
+DTSC::Packet::Packet(){
+  data = 0;
+  dataLen = 0;
+}
+
+/// Creates a view of the packet of len bytes at data, including the magic and length. See reInit().
+DTSC::Packet::Packet(const char * data, unsigned int len){
+  reInit(data, len);
+}
+
+/// Makes this view point to the packet of len bytes at data, including the magic and length.
+/// Nothing is copied: the memory must stay valid for as long as this view is used.
+/// If the data does not start with a known magic or is shorter than its length field says, the view is emptied.
+void DTSC::Packet::reInit(const char * newData, unsigned int len){
+  data = 0;
+  dataLen = 0;
+  if ( !newData || len < 8){
+    return;
+  }
+  if (memcmp(newData, Magic_Packet2, 4) && memcmp(newData, Magic_Packet, 4) && memcmp(newData, Magic_Header, 4)){
+    return;
+  }
+  if (ntohl(((const uint32_t *)newData)[1]) + 8 > len){
+    return;
+  }
+  data = newData;
+  dataLen = ntohl(((const uint32_t *)newData)[1]) + 8;
+}
+
+/// Empties this view.
+void DTSC::Packet::null(){
+  data = 0;
+  dataLen = 0;
+}
+
+/// Returns true if this view holds a packet or header.
+DTSC::Packet::operator bool() const{
+  return data != 0;
+}
+
+/// Returns the packet version: 2 for DTP2, 1 for DTPD, 0 for headers and empty views.
+int DTSC::Packet::getVersion() const{
+  if ( !data){
+    return 0;
+  }
+  if ( !memcmp(data, Magic_Packet2, 4)){
+    return 2;
+  }
+  if ( !memcmp(data, Magic_Packet, 4)){
+    return 1;
+  }
+  return 0;
+}
+
+/// Returns true if this view holds a DTSC header instead of a packet.
+bool DTSC::Packet::isHeader() const{
+  return data && !memcmp(data, Magic_Header, 4);
+}
+
+/// Returns true if this packet holds exactly one complete DTMI object after its headers, or is an empty header.
+/// Unlike the accessors, which only check bounds, this walks the whole object.
+bool DTSC::Packet::isValid() const{
+  if ( !data || dataLen < 8){
+    return false;
+  }
+  if (isHeader() && dataLen == 8){
+    return true;
+  }
+  JSON::View object = getObject();
+  return object.isObject() && object.getData() + object.getSize() == data + dataLen;
+}
+
+/// Returns a pointer to the whole packet, including the magic and length.
+const char * DTSC::Packet::getData() const{
+  return data;
+}
+
+/// Returns the length of the whole packet, including the magic and length.
+unsigned int DTSC::Packet::getDataLen() const{
+  return dataLen;
+}
+
+/// Returns a pointer to the packet contents after the magic and length, as DTSC::File::getPacket() holds them.
+const char * DTSC::Packet::getPayload() const{
+  return data ? data + 8 : 0;
+}
+
+/// Returns the length of the packet contents after the magic and length.
+unsigned int DTSC::Packet::getPayloadLen() const{
+  return data ? dataLen - 8 : 0;
+}
+
+/// Returns a view of the DTMI object in this packet, or a null view if there is none.
+JSON::View DTSC::Packet::getObject() const{
+  if ( !data){
+    return JSON::View();
+  }
+  if (getVersion() == 2){
+    return (dataLen > 20) ? JSON::View(data + 20, dataLen - 20) : JSON::View();
+  }
+  return JSON::View(data + 8, dataLen - 8);
+}
+
+/// Reads the integer member with the given name into result.
+/// \returns True if the member exists and is an integer, false otherwise.
+bool DTSC::Packet::getInt(const char * name, long long int & result) const{
+  JSON::View value = getObject().getMember(name);
+  if ( !value.isInt()){
+    return false;
+  }
+  result = value.asInt();
+  return true;
+}
+
+/// Points str to the string member with the given name and sets len to its length, without copying.
+/// \returns True if the member exists and is a string, false otherwise.
+bool DTSC::Packet::getString(const char * name, const char * & str, unsigned int & len) const{
+  return getObject().getMember(name).getString(str, len);
+}
+
+/// Returns the track ID of this packet, from the packet header for DTP2 and from the trackid member otherwise.
+/// Returns 0 if it is not known.
+int DTSC::Packet::getTrackId() const{
+  if (getVersion() == 2){
+    return ntohl(((const uint32_t *)data)[2]);
+  }
+  long long int result = 0;
+  getInt("trackid", result);
+  return result;
+}
+
+/// Returns the time of this packet in ms, from the packet header for DTP2 and from the time member otherwise.
+long long unsigned int DTSC::Packet::getTime() const{
+  if (getVersion() == 2){
+    return ((long long unsigned int)ntohl(((const uint32_t *)data)[3]) << 32) | ntohl(((const uint32_t *)data)[4]);
+  }
+  long long int result = 0;
+  getInt("time", result);
+  return result;
+}
+
+/// Returns true if this packet has a keyframe member.
+bool DTSC::Packet::isKeyframe() const{
+  return getObject().isMember("keyframe");
+}
+
+/// Points dataPtr to the data member of this packet and sets len to its length, without copying.
+/// \returns True if the packet has a data member, false otherwise.
+bool DTSC::Packet::getPayloadData(const char * & dataPtr, unsigned int & len) const{
+  return getString("data", dataPtr, len);
+}
+
+/// Decodes this packet into a JSON::Value, the same way DTSC::File::getJSON() does.
+JSON::Value DTSC::Packet::toJSON() const{
+  if ( !data){
+    return JSON::Value();
+  }
+  unsigned int i = 0;
+  if (getVersion() == 2){
+    return JSON::fromDTMI2((const unsigned char *)data + 8, dataLen - 8, i);
+  }
+  return JSON::fromDTMI((const unsigned char *)data + 8, dataLen - 8, i);
+}
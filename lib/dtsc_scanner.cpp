@@ -0,0 +1,279 @@
+/// \file dtsc_scanner.cpp
+/// Holds all code for DTSC::Scanner, which reads DTSC files on multiple threads and finds corrupt parts in them.
+
+#include "dtsc.h"
+#include <algorithm> //for std::lower_bound
+#include <sys/mman.h> //for mmap
+#include <sys/stat.h> //for fstat
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h> //for memcmp, memchr
+#include <arpa/inet.h> //for ntohl
+
+static const long long int minPartSize = 1024 * 1024; ///< Files are not split into parts smaller than this.
+
+/// Orders scan entries by byte position.
+static bool entryBefore(const DTSC::scanEntry & a, const DTSC::scanEntry & b){
+  return a.bpos < b.bpos;
+}
+
+/// Returns true if a packet of part starts at pos.
+static bool isEntryStart(const std::vector<DTSC::scanEntry> & entries, long long int pos){
+  DTSC::scanEntry search;
+  search.bpos = pos;
+  std::vector<DTSC::scanEntry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), search, entryBefore);
+  return it != entries.end() && it->bpos == (long long unsigned int)pos;
+}
+
+/// Appends the range from start up to end to ranges, merging it with the last range if they touch.
+static void addRange(std::vector<Util::byteRange> & ranges, long long int start, long long int end){
+  if (start >= end){
+    return;
+  }
+  if (ranges.size() && ranges.back().end >= start){
+    ranges.back().end = std::max(ranges.back().end, end);
+    return;
+  }
+  Util::byteRange range;
+  range.start = start;
+  range.end = end;
+  ranges.push_back(range);
+}
+
+/// Creates a scanner that uses one thread per online processor.
+DTSC::Scanner::Scanner(){
+  threads = 0;
+  srcTime = 0;
+  mapping = 0;
+  mapLen = 0;
+}
+
+/// Checks for a complete packet or header at pos, and points pack at it if there is one.
+/// \returns The size of the packet, or 0 if there is no complete packet at pos.
+unsigned int DTSC::Scanner::packetAt(long long int pos, Packet & pack) const{
+  if (pos < 0 || pos + 8 > mapLen){
+    return 0;
+  }
+  const char * data = mapping + pos;
+  if (memcmp(data, Magic_Packet2, 4) && memcmp(data, Magic_Packet, 4) && memcmp(data, Magic_Header, 4)){
+    return 0;
+  }
+  long long int len = 8 + (long long int)ntohl(*(const uint32_t *)(data + 4));
+  if (pos + len > mapLen){
+    return 0;
+  }
+  pack.reInit(data, len);
+  return pack.isValid() ? len : 0;
+}
+
+/// Finds the first packet at or after from and before to that is followed by another packet or the end of the file.
+/// \returns The position of that packet, or to if there is none.
+long long int DTSC::Scanner::resync(long long int from, long long int to) const{
+  Packet pack;
+  for (long long int pos = from; pos < to; pos++){
+    const char * found = (const char *)memchr(mapping + pos, 'D', to - pos);
+    if ( !found){
+      return to;
+    }
+    pos = found - mapping;
+    unsigned int len = packetAt(pos, pack);
+    if (len && (pos + len == mapLen || packetAt(pos + len, pack))){
+      return pos;
+    }
+  }
+  return to;
+}
+
+/// Follows the packets from pos, which is trusted to be a packet position, up to the end of part.
+/// If joinWith is given, stops as soon as a packet found by joinWith is reached.
+void DTSC::Scanner::scanChain(scanPart & part, long long int pos, const scanPart * joinWith) const{
+  Packet pack;
+  while (pos < part.end){
+    if (joinWith && isEntryStart(joinWith->entries, pos)){
+      break;
+    }
+    unsigned int len = packetAt(pos, pack);
+    if (len){
+      scanEntry entry;
+      entry.bpos = pos;
+      entry.size = len;
+      entry.header = pack.isHeader();
+      entry.time = entry.header ? 0 : pack.getTime();
+      entry.trackID = entry.header ? 0 : pack.getTrackId();
+      entry.keyframe = !entry.header && pack.isKeyframe();
+      part.entries.push_back(entry);
+      pos += len;
+      continue;
+    }
+    long long int next = resync(pos + 1, part.end);
+    addRange(part.corrupt, pos, next);
+    if (next >= part.end){
+      part.exitPos = part.end;
+      part.exitSynced = false;
+      return;
+    }
+    pos = next;
+  }
+  part.exitPos = pos;
+  part.exitSynced = true;
+}
+
+/// Thread entry point, scans the part given as arg.
+/// Every part but the first starts at the first packet in its range that is followed by another one.
+void * DTSC::Scanner::scanThread(void * arg){
+  scanPart & part = *(scanPart *)arg;
+  long long int pos = part.start;
+  if (pos){
+    pos = part.scanner->resync(pos, part.end);
+  }
+  if (pos >= part.end){
+    part.exitPos = part.end;
+    part.exitSynced = false;
+    return 0;
+  }
+  part.scanner->scanChain(part, pos, 0);
+  return 0;
+}
+
+/// Adds all packets and corrupt ranges of part from byte position from on to the results.
+void DTSC::Scanner::addPart(const scanPart & part, long long int from){
+  for (std::vector<scanEntry>::const_iterator it = part.entries.begin(); it != part.entries.end(); it++){
+    if (it->bpos < (long long unsigned int)from){
+      continue;
+    }
+    if (it->header){
+      headers.push_back(it->bpos);
+      continue;
+    }
+    indexEntry entry;
+    entry.time = it->time;
+    entry.bpos = it->bpos;
+    entry.size = it->size;
+    packets[it->trackID].push_back(entry);
+    if (it->keyframe){
+      keyframes[it->trackID].push_back(entry);
+    }
+  }
+  for (std::vector<Util::byteRange>::const_iterator it = part.corrupt.begin(); it != part.corrupt.end(); it++){
+    if (it->start >= from){
+      addRange(corrupt, it->start, it->end);
+    }
+  }
+}
+
+/// Scans the DTSC file at the given path, replacing all earlier results.
+/// If the file could not be scanned for any reason, the reason is printed to stderr.
+/// \returns True on success, false otherwise.
+bool DTSC::Scanner::scan(const std::string & path){
+  packets.clear();
+  keyframes.clear();
+  headers.clear();
+  corrupt.clear();
+  this->path = path;
+  int handle = open(path.c_str(), O_RDONLY);
+  if (handle == -1){
+    fprintf(stderr, "Could not open file %s\n", path.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(handle, &st) != 0){
+    fprintf(stderr, "Could not stat file %s\n", path.c_str());
+    ::close(handle);
+    return false;
+  }
+  srcTime = st.st_mtime * 1000000000ull + st.st_mtim.tv_nsec;
+  mapLen = st.st_size;
+  if ( !mapLen){
+    ::close(handle);
+    return true;
+  }
+  void * result = mmap(0, mapLen, PROT_READ, MAP_SHARED, handle, 0);
+  ::close(handle);
+  if (result == MAP_FAILED){
+    fprintf(stderr, "Could not map file %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  mapping = (const char *)result;
+
+  long long int partCount = threads;
+  if ( !partCount){
+    partCount = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (partCount > mapLen / minPartSize){
+    partCount = mapLen / minPartSize;
+  }
+  if (partCount < 1){
+    partCount = 1;
+  }
+  std::vector<scanPart> parts(partCount);
+  std::vector<pthread_t> ids(partCount);
+  std::vector<bool> started(partCount, false);
+  for (long long int i = 0; i < partCount; i++){
+    parts[i].scanner = this;
+    parts[i].start = mapLen * i / partCount;
+    parts[i].end = mapLen * (i + 1) / partCount;
+    //the first part is scanned on this thread, as are any parts whose thread could not be started
+    if (i && pthread_create(&ids[i], 0, scanThread, &parts[i]) == 0){
+      started[i] = true;
+    }
+  }
+  for (long long int i = 0; i < partCount; i++){
+    if ( !started[i]){
+      scanThread(&parts[i]);
+    }
+  }
+  for (long long int i = 0; i < partCount; i++){
+    if (started[i]){
+      pthread_join(ids[i], 0);
+    }
+  }
+
+  //join the parts: each part continues where the packets of the parts before it left off
+  addPart(parts[0], 0);
+  long long int pos = parts[0].exitPos;
+  bool synced = parts[0].exitSynced;
+  for (long long int i = 1; i < partCount; i++){
+    scanPart & part = parts[i];
+    long long int joinPos = part.exitPos;
+    if (part.entries.size()){
+      joinPos = part.entries[0].bpos;
+    }
+    if ( !synced){
+      //the part before ended in corruption, which lasts until the first packet this part found
+      addRange(corrupt, pos, joinPos);
+    }else if (pos != joinPos || !part.entries.size()){
+      //this part did not start at the packet the part before leads to, so follow the packets until they meet
+      scanPart bridge;
+      bridge.scanner = this;
+      bridge.start = pos;
+      bridge.end = part.end;
+      scanChain(bridge, pos, &part);
+      addPart(bridge, 0);
+      if (bridge.exitPos >= part.end){
+        pos = bridge.exitPos;
+        synced = bridge.exitSynced;
+        continue;
+      }
+      joinPos = bridge.exitPos;
+    }
+    addPart(part, joinPos);
+    pos = part.exitPos;
+    synced = part.exitSynced;
+  }
+  munmap((void *)mapping, mapLen);
+  mapping = 0;
+  return true;
+}
+
+/// Writes the packets found by the last scan as the sidecar index of the scanned file, see DTSC::FileIndex.
+/// \returns True on success, false otherwise.
+bool DTSC::Scanner::saveIndex(){
+  if (path.empty()){
+    return false;
+  }
+  std::map<int, std::vector<indexEntry> > tracks = packets;
+  FileIndex index;
+  index.create(tracks, mapLen, srcTime);
+  return index.save(path + ".dtsh");
+}
@@ -0,0 +1,446 @@
+/// \file dtsc_shared.cpp
+/// Holds all code for the lock-free live packet log, and for sharing it between processes through shared memory.
+
+#include "dtsc.h"
+#include <string.h> //for memcpy/memcmp
+
+/// Layout of the start of a DTSC::LiveLog block.
+/// The header is followed by the data ring, which is followed by the metadata area.
+/// All offsets in the header are byte counts since the log started and only ever increase,
+/// the location in the ring is the offset modulo dataSize.
+struct liveLogHeader{
+  char magic[4]; ///< Always "DTSM".
+  uint32_t version; ///< Layout version, currently 1.
+  uint32_t dataSize; ///< Size of the data ring in bytes.
+  uint32_t metaSize; ///< Size of the metadata area in bytes.
+  volatile uint64_t writeOffset; ///< End of the newest complete record.
+  volatile uint64_t writeSeq; ///< Sequence number the next record will get.
+  volatile uint64_t oldestOffset; ///< Start of the oldest record that is guaranteed not to be overwritten yet.
+  volatile uint64_t oldestSeq; ///< Sequence number of the record at oldestOffset.
+  volatile uint64_t keyOffset; ///< Start of the newest keyframe record.
+  volatile uint64_t keySeq; ///< Sequence number of the record at keyOffset.
+  volatile uint32_t metaGeneration; ///< Incremented before and after every header update, odd while updating.
+  volatile uint32_t metaLength; ///< Length of the packed header in the metadata area.
+  volatile uint32_t closed; ///< Set to 1 when the writer stops.
+  uint32_t reserved;
+};
+
+/// Header of a single record in the data ring, directly followed by the packed packet.
+/// Records always start at 8-byte boundaries.
+struct liveLogRecord{
+  uint32_t length; ///< Length of the packed packet, or 0xFFFFFFFF if the ring wraps here.
+  uint32_t trackID;
+  uint64_t time;
+  uint64_t seq; ///< Sequence number of this record.
+  uint32_t flags; ///< Bit 0 is set for keyframes.
+  uint32_t reserved;
+};
+
+#define LOG_WRAP 0xFFFFFFFFu
+#define LOG_KEYFRAME 1
+
+/// Returns the size a record with a packet of the given length takes in the ring.
+static inline uint64_t recordSize(uint64_t length){
+  return (sizeof(liveLogRecord) + length + 7) & ~7ull;
+}
+
+/// Creates a log writer that is not attached to any block.
+DTSC::LiveLog::LiveLog(){
+  block = 0;
+}
+
+/// Returns the size in bytes of a block with the given data ring and metadata area sizes.
+/// Both sizes should be multiples of 8.
+unsigned int DTSC::LiveLog::blockSize(unsigned int dataSize, unsigned int metaSize){
+  return sizeof(liveLogHeader) + dataSize + metaSize;
+}
+
+/// Initializes the given block, which must be blockSize(dataSize, metaSize) bytes and 8-byte aligned, and starts writing to it.
+/// Both sizes should be multiples of 8.
+void DTSC::LiveLog::init(char * newBlock, unsigned int dataSize, unsigned int metaSize){
+  block = newBlock;
+  records.clear();
+  liveLogHeader * head = (liveLogHeader *)block;
+  head->version = 1;
+  head->dataSize = dataSize;
+  head->metaSize = metaSize;
+  head->writeOffset = 0;
+  head->writeSeq = 0;
+  head->oldestOffset = 0;
+  head->oldestSeq = 0;
+  head->keyOffset = 0;
+  head->keySeq = 0;
+  head->metaGeneration = 0;
+  head->metaLength = 0;
+  head->closed = 0;
+  __sync_synchronize();
+  //the magic is written last, so readers never see a half-initialized block
+  memcpy(head->magic, "DTSM", 4);
+  __sync_synchronize();
+}
+
+/// Marks the block as closed for all readers and stops writing to it.
+void DTSC::LiveLog::close(){
+  if (block){
+    ((liveLogHeader *)block)->closed = 1;
+    __sync_synchronize();
+  }
+  block = 0;
+  records.clear();
+}
+
+/// Returns true if this writer is attached to a block.
+DTSC::LiveLog::operator bool() const{
+  return block != 0;
+}
+
+/// Appends a packed packet to the data ring, overwriting the oldest records if needed.
+/// Readers are told which records will be overwritten before any data is touched.
+/// \returns False if no block is attached or the packet does not fit in half of the ring.
+bool DTSC::LiveLog::addPacket(const std::string & packed, const livePos & pos, bool keyframe){
+  if ( !block){
+    return false;
+  }
+  liveLogHeader * head = (liveLogHeader *)block;
+  char * data = block + sizeof(liveLogHeader);
+  uint64_t size = recordSize(packed.size());
+  if (size > head->dataSize / 2){
+    return false;
+  }
+  uint64_t seq = head->writeSeq;
+  uint64_t start = head->writeOffset;
+  bool wrapping = (start % head->dataSize) + size > head->dataSize;
+  if (wrapping){
+    start += head->dataSize - (start % head->dataSize);
+  }
+  uint64_t end = start + size;
+  //everything before the new end minus one ring length is about to be overwritten
+  if (end > head->dataSize){
+    uint64_t limit = end - head->dataSize;
+    uint64_t oldestSeq = head->oldestSeq;
+    while (records.size() && records.front() < limit){
+      records.pop_front();
+      oldestSeq++;
+    }
+    uint64_t oldest = (records.size() ? records.front() : start);
+    if (oldest != head->oldestOffset){
+      head->oldestSeq = oldestSeq;
+      __sync_synchronize();
+      head->oldestOffset = oldest;
+      __sync_synchronize();
+    }
+  }
+  if (wrapping){
+    ((liveLogRecord *)(data + (head->writeOffset % head->dataSize)))->length = LOG_WRAP;
+  }
+  liveLogRecord * rec = (liveLogRecord *)(data + (start % head->dataSize));
+  rec->length = packed.size();
+  rec->trackID = pos.trackID;
+  rec->time = pos.seekTime;
+  rec->seq = seq;
+  rec->flags = (keyframe ? LOG_KEYFRAME : 0);
+  rec->reserved = 0;
+  memcpy((char *)rec + sizeof(liveLogRecord), packed.data(), packed.size());
+  records.push_back(start);
+  __sync_synchronize();
+  if (keyframe){
+    head->keyOffset = start;
+    head->keySeq = seq;
+  }
+  head->writeOffset = end;
+  head->writeSeq = seq + 1;
+  __sync_synchronize();
+  return true;
+}
+
+/// Replaces the header in the metadata area with the given packed header.
+/// \returns False if no block is attached or the header does not fit.
+bool DTSC::LiveLog::setHeader(const std::string & packed){
+  if ( !block){
+    return false;
+  }
+  liveLogHeader * head = (liveLogHeader *)block;
+  if (packed.size() > head->metaSize){
+    return false;
+  }
+  head->metaGeneration++;
+  __sync_synchronize();
+  memcpy(block + sizeof(liveLogHeader) + head->dataSize, packed.data(), packed.size());
+  head->metaLength = packed.size();
+  __sync_synchronize();
+  head->metaGeneration++;
+  __sync_synchronize();
+  return true;
+}
+
+/// Returns the sequence number the next written packet will get, which equals the amount of packets written so far.
+long long unsigned int DTSC::LiveLog::writeSeq() const{
+  if ( !block){
+    return 0;
+  }
+  return ((liveLogHeader *)block)->writeSeq;
+}
+
+/// Creates a cursor that is not attached to any block.
+DTSC::LogCursor::LogCursor(){
+  block = 0;
+  offset = 0;
+  seq = 0;
+  generation = 0;
+  metaGeneration = 0;
+  keyframe = false;
+}
+
+/// Attaches this cursor to the given block of len bytes, starting at the newest key.
+/// \returns True if the block holds a valid log, false otherwise.
+bool DTSC::LogCursor::attach(const char * newBlock, unsigned int len){
+  detach();
+  const liveLogHeader * head = (const liveLogHeader *)newBlock;
+  if ( !newBlock || len < sizeof(liveLogHeader) || memcmp(head->magic, "DTSM", 4) != 0 || head->version != 1){
+    return false;
+  }
+  if (len < LiveLog::blockSize(head->dataSize, head->metaSize)){
+    return false;
+  }
+  block = newBlock;
+  seekNewestKey();
+  return true;
+}
+
+/// Detaches this cursor from its block and resets all counters.
+void DTSC::LogCursor::detach(){
+  block = 0;
+  offset = 0;
+  seq = 0;
+  generation = 0;
+  metaGeneration = 0;
+}
+
+/// Returns true if the cursor is not attached, or the writer closed the log.
+bool DTSC::LogCursor::closed() const{
+  return !block || ((const liveLogHeader *)block)->closed;
+}
+
+/// Copies the current header into packed, if it changed since the last call.
+/// \returns True if packed now holds a new header, false if it did not change or is being updated right now.
+bool DTSC::LogCursor::getHeader(std::string & packed){
+  if ( !block){
+    return false;
+  }
+  const liveLogHeader * head = (const liveLogHeader *)block;
+  unsigned int metaGen = head->metaGeneration;
+  if ((metaGen & 1) || metaGen == metaGeneration){
+    return false;
+  }
+  __sync_synchronize();
+  unsigned int length = head->metaLength;
+  if (length > head->metaSize){
+    return false;
+  }
+  packed.assign(block + sizeof(liveLogHeader) + head->dataSize, length);
+  __sync_synchronize();
+  if (head->metaGeneration != metaGen){
+    return false;
+  }
+  metaGeneration = metaGen;
+  return true;
+}
+
+/// Copies the next packed packet into packed and advances the cursor.
+/// Besides packets, a log may hold header deltas (starting with DTSC::Magic_HeaderDelta) that DTSC::Stream::parsePacket() applies.
+/// A record is only accepted if the writer did not start overwriting it while it was being copied.
+/// If the writer overwrote the record at the cursor, the cursor skips to the newest key and increments generation.
+/// \returns True if packed now holds a packet, false if no new packet is available.
+bool DTSC::LogCursor::getPacket(std::string & packed){
+  if ( !block){
+    return false;
+  }
+  const liveLogHeader * head = (const liveLogHeader *)block;
+  const char * data = block + sizeof(liveLogHeader);
+  while (true){
+    if (offset < head->oldestOffset){
+      generation++;
+      seekNewestKey();
+    }
+    if (offset >= head->writeOffset){
+      return false;
+    }
+    __sync_synchronize();
+    uint64_t position = offset % head->dataSize;
+    liveLogRecord rec = *(const liveLogRecord *)(data + position);
+    if (rec.length == LOG_WRAP){
+      offset += head->dataSize - position;
+      continue;
+    }
+    if (position + recordSize(rec.length) > head->dataSize){
+      //can only be a record that is being overwritten, which is caught as a lap above
+      if (offset < head->oldestOffset){
+        continue;
+      }
+      return false;
+    }
+    packed.assign(data + position + sizeof(liveLogRecord), rec.length);
+    __sync_synchronize();
+    if (offset < head->oldestOffset){
+      continue;
+    }
+    pos.trackID = rec.trackID;
+    pos.seekTime = rec.time;
+    keyframe = (rec.flags & LOG_KEYFRAME);
+    offset += recordSize(rec.length);
+    seq = rec.seq + 1;
+    return true;
+  }
+}
+
+/// Reads the position of the record the next getPacket() call will start at, without moving the cursor.
+/// \returns True if result now holds that position, false if there is no such record yet or it was overwritten.
+bool DTSC::LogCursor::peekPos(livePos & result) const{
+  if ( !block){
+    return false;
+  }
+  const liveLogHeader * head = (const liveLogHeader *)block;
+  const char * data = block + sizeof(liveLogHeader);
+  uint64_t at = offset;
+  while (true){
+    if (at < head->oldestOffset || at >= head->writeOffset){
+      return false;
+    }
+    __sync_synchronize();
+    uint64_t position = at % head->dataSize;
+    liveLogRecord rec = *(const liveLogRecord *)(data + position);
+    __sync_synchronize();
+    if (at < head->oldestOffset){
+      return false;
+    }
+    if (rec.length == LOG_WRAP){
+      at += head->dataSize - position;
+      continue;
+    }
+    result.trackID = rec.trackID;
+    result.seekTime = rec.time;
+    return true;
+  }
+}
+
+/// Moves the cursor to the newest keyframe, or the oldest record if that keyframe was overwritten already.
+void DTSC::LogCursor::seekNewestKey(){
+  if ( !block){
+    return;
+  }
+  const liveLogHeader * head = (const liveLogHeader *)block;
+  seq = head->keySeq;
+  offset = head->keyOffset;
+  __sync_synchronize();
+  if (offset < head->oldestOffset){
+    seekOldest();
+  }
+}
+
+/// Moves the cursor to the oldest record that is still available.
+/// The sequence number is only a hint until the next packet is read, which sets it from the record itself.
+void DTSC::LogCursor::seekOldest(){
+  if ( !block){
+    return;
+  }
+  const liveLogHeader * head = (const liveLogHeader *)block;
+  seq = head->oldestSeq;
+  offset = head->oldestOffset;
+}
+
+/// Creates the shared segment for the given stream, with a data ring of dataSize bytes and room for a header of metaSize bytes.
+/// Both sizes are rounded up to a multiple of 8. Use the boolean operator to check if creating the segment succeeded.
+DTSC::SharedBuffer::SharedBuffer(const std::string & streamName, unsigned int dataSize, unsigned int metaSize){
+  dataSize = (dataSize + 7) & ~7u;
+  metaSize = (metaSize + 7) & ~7u;
+  if (page.init("live_" + streamName, LiveLog::blockSize(dataSize, metaSize), true)){
+    log.init(page.mapped, dataSize, metaSize);
+  }
+}
+
+/// Marks the segment as closed for all readers, then removes it.
+DTSC::SharedBuffer::~SharedBuffer(){
+  log.close();
+}
+
+/// Returns true if the shared segment was created successfully.
+DTSC::SharedBuffer::operator bool() const{
+  return log;
+}
+
+/// Appends a packed packet to the segment. See DTSC::LiveLog::addPacket().
+bool DTSC::SharedBuffer::addPacket(const std::string & packed, const livePos & pos, bool keyframe){
+  return log.addPacket(packed, pos, keyframe);
+}
+
+/// Replaces the header in the segment. See DTSC::LiveLog::setHeader().
+bool DTSC::SharedBuffer::setHeader(const std::string & packed){
+  return log.setHeader(packed);
+}
+
+/// Creates a reader that is not attached to any stream.
+DTSC::SharedReader::SharedReader(){}
+
+/// Creates a reader and attaches it to the given stream. See open().
+DTSC::SharedReader::SharedReader(const std::string & streamName){
+  open(streamName);
+}
+
+/// Attaches this reader to the shared segment of the given stream, starting at the newest key.
+/// \returns True if the segment exists and is valid, false otherwise.
+bool DTSC::SharedReader::open(const std::string & streamName){
+  cursor.detach();
+  if ( !page.init("live_" + streamName)){
+    return false;
+  }
+  if ( !cursor.attach(page.mapped, page.len)){
+    page.close();
+    return false;
+  }
+  return true;
+}
+
+/// Returns true if this reader is attached to a segment.
+DTSC::SharedReader::operator bool() const{
+  return page;
+}
+
+/// Returns true if this reader is attached to a segment that the writer has not closed yet.
+bool DTSC::SharedReader::connected() const{
+  return page && !cursor.closed();
+}
+
+/// Copies the current header into packed, if it changed since the last call. See DTSC::LogCursor::getHeader().
+bool DTSC::SharedReader::getHeader(std::string & packed){
+  return cursor.getHeader(packed);
+}
+
+/// Copies the next packed packet into packed. See DTSC::LogCursor::getPacket().
+bool DTSC::SharedReader::getPacket(std::string & packed){
+  return cursor.getPacket(packed);
+}
+
+/// Moves the cursor to the newest keyframe that is still available.
+void DTSC::SharedReader::seekNewestKey(){
+  cursor.seekNewestKey();
+}
+
+/// Moves the cursor to the oldest packet that is still available.
+void DTSC::SharedReader::seekOldest(){
+  cursor.seekOldest();
+}
+
+/// Returns the position of the packet last returned by getPacket().
+const DTSC::livePos & DTSC::SharedReader::lastPos() const{
+  return cursor.pos;
+}
+
+/// Returns true if the packet last returned by getPacket() was a keyframe.
+bool DTSC::SharedReader::lastKeyframe() const{
+  return cursor.keyframe;
+}
+
+/// Returns how many times the writer overwrote data before this reader could read it.
+unsigned int DTSC::SharedReader::laps() const{
+  return cursor.generation;
+}
@@ -0,0 +1,129 @@
+/// \file dtsc_stats.cpp
+/// Holds all code for the ingest counters and latency histograms of DTSC::Stream.
+
+#include "dtsc.h"
+#include <sstream>
+
+/// Creates an empty histogram.
+DTSC::latencyHistogram::latencyHistogram(){
+  count = 0;
+  total = 0;
+  max = 0;
+  for (unsigned int i = 0; i < 40; i++){
+    buckets[i] = 0;
+  }
+}
+
+/// Adds a duration in nanoseconds to the histogram.
+void DTSC::latencyHistogram::add(long long unsigned int ns){
+  unsigned int bucket = 0;
+  while (bucket < 39 && (ns >> (bucket + 1))){
+    bucket++;
+  }
+  buckets[bucket]++;
+  count++;
+  total += ns;
+  if (ns > max){
+    max = ns;
+  }
+}
+
+/// Writes the histogram into target as count, total_ns, max_ns and avg_ns members,
+/// plus a buckets array that ends at the last bucket holding anything.
+void DTSC::latencyHistogram::toJSON(JSON::Value & target) const{
+  long long unsigned int tmpCount = count;
+  long long unsigned int tmpTotal = total;
+  target["count"] = (long long int)tmpCount;
+  target["total_ns"] = (long long int)tmpTotal;
+  target["max_ns"] = (long long int)max;
+  target["avg_ns"] = (long long int)(tmpCount ? tmpTotal / tmpCount : 0);
+  unsigned int used = 40;
+  while (used && !buckets[used - 1]){
+    used--;
+  }
+  target["buckets"].null();
+  for (unsigned int i = 0; i < used; i++){
+    target["buckets"].append((long long int)buckets[i]);
+  }
+}
+
+/// Creates empty counters for the given track.
+DTSC::trackStats::trackStats(int trackID){
+  this->trackID = trackID;
+  packets = 0;
+  bytes = 0;
+  keyframes = 0;
+  second = 0;
+  secondPackets = 0;
+  secondBytes = 0;
+  lastPackets = 0;
+  lastBytes = 0;
+}
+
+/// Writes the counters into target. The rates are those of the last complete second before nowSecond.
+void DTSC::trackStats::toJSON(JSON::Value & target, long long unsigned int nowSecond) const{
+  target["trackid"] = (long long int)trackID;
+  target["packets"] = (long long int)packets;
+  target["bytes"] = (long long int)bytes;
+  target["keyframes"] = (long long int)keyframes;
+  long long unsigned int tmpSecond = second;
+  __sync_synchronize();
+  if (tmpSecond == nowSecond){
+    target["packets_per_s"] = (long long int)lastPackets;
+    target["bytes_per_s"] = (long long int)lastBytes;
+  }else if (tmpSecond + 1 == nowSecond){
+    target["packets_per_s"] = (long long int)secondPackets;
+    target["bytes_per_s"] = (long long int)secondBytes;
+  }else{
+    target["packets_per_s"] = 0ll;
+    target["bytes_per_s"] = 0ll;
+  }
+  addTime.toJSON(target["add_ns"]);
+  cutTime.toJSON(target["cut_ns"]);
+}
+
+/// Returns the counters for the given track, creating them if needed.
+/// Returns NULL if the track is new and counters for 64 tracks exist already.
+/// Only to be called by the thread adding packets.
+DTSC::trackStats * DTSC::Stream::getTrackStats(int trackID){
+  for (unsigned int i = 0; i < statCount; i++){
+    if (statSlots[i]->trackID == trackID){
+      return statSlots[i];
+    }
+  }
+  if (statCount >= 64){
+    return 0;
+  }
+  statSlots[statCount] = new trackStats(trackID);
+  //publish the slot before the count, so readers never see an unset slot
+  __sync_synchronize();
+  statCount++;
+  return statSlots[statCount - 1];
+}
+
+/// Returns a snapshot of all ingest counters of this stream.
+/// Holds the amount of resyncs, parsed headers, packets and data bytes, the parse time histogram,
+/// and per track (indexed by track ID) the counters, rates over the last second and add/cut time histograms.
+/// Only reads counters and takes no locks, so it may be called from any thread without stalling the thread adding packets.
+/// Numbers may be slightly inconsistent with each other when packets are being added at the same time.
+JSON::Value DTSC::Stream::getStats(){
+  JSON::Value result;
+  long long unsigned int nowSecond = Util::getMS() / 1000;
+  result["resyncs"] = (long long int)resyncs;
+  result["headers"] = (long long int)headerCount;
+  parseTime.toJSON(result["parse_ns"]);
+  long long unsigned int packets = 0;
+  long long unsigned int bytes = 0;
+  unsigned int count = statCount;
+  __sync_synchronize();
+  for (unsigned int i = 0; i < count; i++){
+    std::stringstream trackID;
+    trackID << statSlots[i]->trackID;
+    statSlots[i]->toJSON(result["tracks"][trackID.str()], nowSecond);
+    packets += statSlots[i]->packets;
+    bytes += statSlots[i]->bytes;
+  }
+  result["packets"] = (long long int)packets;
+  result["bytes"] = (long long int)bytes;
+  return result;
+}
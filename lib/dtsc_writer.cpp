@@ -0,0 +1,189 @@
+/// \file dtsc_writer.cpp
+/// Holds all code for DTSC::FileWriter, the buffered background writer of DTSC files.
+
+#include "dtsc.h"
+#include <stdlib.h> //for posix_memalign
+#include <string.h> //for memcpy
+#include <unistd.h>
+#include <errno.h>
+
+static const unsigned int writerBuffers = 4; ///< Amount of buffers per writer.
+static const unsigned int writerAlign = 4096; ///< Alignment of the buffers.
+
+/// Starts a writer appending to fd from startPos on. The writer owns fd and closes it when destroyed.
+/// Every buffer holds bufferSize bytes; after each buffer is written, the file is synced according to sync.
+DTSC::FileWriter::FileWriter(int fd, long long int startPos, unsigned int bufferSize, syncPolicy sync){
+  this->fd = fd;
+  this->bufferSize = bufferSize ? bufferSize : writerAlign;
+  this->sync = sync;
+  current.data = 0;
+  current.len = 0;
+  current.pos = startPos;
+  endPos = startPos;
+  diskPos = startPos;
+  stopping = false;
+  failed = 0;
+  for (unsigned int i = 0; i < writerBuffers; i++){
+    void * buf = 0;
+    if (posix_memalign(&buf, writerAlign, this->bufferSize) != 0){
+      break;
+    }
+    allBuffers.push_back((char *)buf);
+    spare.push_back((char *)buf);
+  }
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&workCond, 0);
+  pthread_cond_init(&doneCond, 0);
+  if ( !allBuffers.size() || pthread_create(&thread, 0, flushThread, this) != 0){
+    fprintf(stderr, "Could not start file writer\n");
+    failed = 1;
+    stopping = true;
+  }
+}
+
+/// Writes everything still buffered, stops the thread and closes the file.
+DTSC::FileWriter::~FileWriter(){
+  if ( !stopping){
+    flush();
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&workCond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, 0);
+  }
+  pthread_cond_destroy(&doneCond);
+  pthread_cond_destroy(&workCond);
+  pthread_mutex_destroy(&lock);
+  for (unsigned int i = 0; i < allBuffers.size(); i++){
+    free(allBuffers[i]);
+  }
+  close(fd);
+}
+
+/// Returns false if the writer could not be started or a write failed.
+DTSC::FileWriter::operator bool() const{
+  return !failed;
+}
+
+/// Copies len bytes from data to the end of the buffered data.
+/// Only blocks when all buffers are full and waiting to be written.
+/// \returns False, without appending, if the writer could not be started or an earlier write failed.
+bool DTSC::FileWriter::append(const char * data, unsigned int len){
+  if (stopping || failed){
+    return false;
+  }
+  endPos += len;
+  while (len){
+    if ( !current.data){
+      pthread_mutex_lock(&lock);
+      while ( !spare.size()){
+        pthread_cond_wait(&doneCond, &lock);
+      }
+      current.data = spare.back();
+      spare.pop_back();
+      pthread_mutex_unlock(&lock);
+    }
+    unsigned int part = bufferSize - current.len;
+    if (part > len){
+      part = len;
+    }
+    memcpy(current.data + current.len, data, part);
+    current.len += part;
+    data += part;
+    len -= part;
+    if (current.len == bufferSize){
+      submit();
+    }
+  }
+  return true;
+}
+
+/// Hands the buffer being filled to the thread, if it holds anything.
+void DTSC::FileWriter::submit(){
+  if ( !current.data || !current.len){
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  pending.push_back(current);
+  pthread_cond_signal(&workCond);
+  pthread_mutex_unlock(&lock);
+  current.pos += current.len;
+  current.data = 0;
+  current.len = 0;
+}
+
+/// Blocks until everything appended so far has been written to the file.
+/// \returns True if all of it was written, false if the writer could not be started or any write failed.
+bool DTSC::FileWriter::flush(){
+  if (stopping){
+    return !failed;
+  }
+  submit();
+  pthread_mutex_lock(&lock);
+  while (pending.size()){
+    pthread_cond_wait(&doneCond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return !failed;
+}
+
+/// Returns the position after the last appended byte, including everything still buffered.
+long long int DTSC::FileWriter::getEndPos() const{
+  return endPos;
+}
+
+/// Returns the position up to which everything has been written to the file.
+long long int DTSC::FileWriter::getDiskPos(){
+  pthread_mutex_lock(&lock);
+  long long int ret = diskPos;
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+/// Thread entry point, runs flushLoop() for the writer given as arg.
+void * DTSC::FileWriter::flushThread(void * arg){
+  ((FileWriter *)arg)->flushLoop();
+  return 0;
+}
+
+/// Writes pending buffers in order until the writer is stopped.
+void DTSC::FileWriter::flushLoop(){
+  pthread_mutex_lock(&lock);
+  while (true){
+    while ( !pending.size() && !stopping){
+      pthread_cond_wait(&workCond, &lock);
+    }
+    if ( !pending.size()){
+      break;
+    }
+    block work = pending.front();
+    pthread_mutex_unlock(&lock);
+    unsigned int done = 0;
+    while (done < work.len){
+      ssize_t ret = pwrite(fd, work.data + done, work.len - done, work.pos + done);
+      if (ret < 0 && errno == EINTR){
+        continue;
+      }
+      if (ret <= 0){
+        //only the first failure is reported
+        if (__sync_bool_compare_and_swap(&failed, 0, 1)){
+          fprintf(stderr, "Could not write to file: %s\n", strerror(errno));
+        }
+        break;
+      }
+      done += ret;
+    }
+    if (sync == SYNC_DATA){
+      fdatasync(fd);
+    }
+    if (sync == SYNC_FULL){
+      fsync(fd);
+    }
+    pthread_mutex_lock(&lock);
+    pending.pop_front();
+    spare.push_back(work.data);
+    diskPos = work.pos + work.len;
+    pthread_cond_broadcast(&doneCond);
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -360,14 +360,103 @@ FLV::Tag & FLV::Tag::operator=(const FLV::Tag& O){
   return *this;
 } //assignment operator
 
+/// Returns the AMF0 onMetaData tag body holding all members of a DTSC meta packet's data object.
+static std::string metaToAMF(JSON::Value & metaData){
+  AMF::Object amfdata("root", AMF::AMF0_DDV_CONTAINER);
+  amfdata.addContent(AMF::Object("", "onMetaData"));
+  amfdata.addContent(AMF::Object("", AMF::AMF0_ECMA_ARRAY));
+  for (JSON::ObjIter it = metaData.ObjBegin(); it != metaData.ObjEnd(); it++){
+    if (it->second.asInt()){
+      amfdata.getContentP(1)->addContent(AMF::Object(it->first, it->second.asInt(), AMF::AMF0_NUMBER));
+    }else{
+      amfdata.getContentP(1)->addContent(AMF::Object(it->first, it->second.asString(), AMF::AMF0_STRING));
+    }
+  }
+  return amfdata.Pack();
+}
+
+/// Returns the DTSC::datatype for the given DTSC type name, which is len bytes long.
+static DTSC::datatype typeFromName(const char * name, unsigned int len){
+  if (len == 5 && !memcmp(name, "video", 5)){
+    return DTSC::VIDEO;
+  }
+  if (len == 5 && !memcmp(name, "audio", 5)){
+    return DTSC::AUDIO;
+  }
+  if (len == 4 && !memcmp(name, "meta", 4)){
+    return DTSC::META;
+  }
+  if (len == 12 && !memcmp(name, "pause_marker", 12)){
+    return DTSC::PAUSEMARK;
+  }
+  return DTSC::INVALID;
+}
+
 /// FLV loader function from DTSC.
 /// Takes the DTSC data and makes it into FLV.
 bool FLV::Tag::DTSCLoader(DTSC::Stream & S){
-  std::string meta_str;
   JSON::Value & track = S.getTrackById(S.getPacket()["trackid"].asInt());
-  switch (S.lastType()){
+  std::string meta_str;
+  if (S.lastType() == DTSC::META){
+    meta_str = metaToAMF(S.getPacket()["data"]);
+  }
+  int frameType = 0;
+  if (S.lastType() == DTSC::VIDEO){
+    if (S.getPacket().isMember("keyframe")){
+      frameType += 0x10;
+    }
+    if (S.getPacket().isMember("interframe")){
+      frameType += 0x20;
+    }
+    if (S.getPacket().isMember("disposableframe")){
+      frameType += 0x30;
+    }
+  }
+  bool nalu = S.getPacket().isMember("nalu");
+  int offs = S.getPacket().isMember("offset") ? S.getPacket()["offset"].asInt() : 0;
+  return DTSCLoader(S.lastType(), S.getPacket()["time"].asInt(), S.lastData().data(), S.lastData().size(), meta_str, frameType, nalu, offs, track);
+}
+
+/// FLV loader function from a DTSC packet, such as one read from a DTSC::File, belonging to the given track.
+/// The members of the packet are read in place through a JSON::View, so no JSON::Value is built for it.
+bool FLV::Tag::DTSCLoader(const DTSC::Packet & packet, JSON::Value & track){
+  JSON::View pack = packet.getObject();
+  const char * typeName = 0;
+  unsigned int typeLen = 0;
+  if ( !pack.getMember("datatype").getString(typeName, typeLen) && track.isMember("type")){
+    typeName = track["type"].asStringRef().data();
+    typeLen = track["type"].asStringRef().size();
+  }
+  DTSC::datatype type = typeFromName(typeName, typeLen);
+  const char * payload = 0;
+  unsigned int payloadLen = 0;
+  packet.getPayloadData(payload, payloadLen);
+  std::string meta_str;
+  if (type == DTSC::META){
+    JSON::Value metaData = pack.getMember("data").toJSON();
+    meta_str = metaToAMF(metaData);
+  }
+  int frameType = 0;
+  if (pack.isMember("keyframe")){
+    frameType += 0x10;
+  }
+  if (pack.isMember("interframe")){
+    frameType += 0x20;
+  }
+  if (pack.isMember("disposableframe")){
+    frameType += 0x30;
+  }
+  return DTSCLoader(type, packet.getTime(), payload, payloadLen, meta_str, frameType, pack.isMember("nalu"), pack.getMember("offset").asInt(), track);
+}
+
+/// Builds a tag from the parts of a DTSC packet, for both public DTSCLoader functions.
+/// \param frameType The FLV frame type bits for video packets, 0x10 for keyframes.
+/// \param nalu Whether the video data holds NAL units, as opposed to an end of sequence.
+/// \param offs The composition offset of video packets.
+bool FLV::Tag::DTSCLoader(DTSC::datatype type, long long int time, const char * payload, unsigned int payloadLen, const std::string & meta_str, int frameType, bool nalu, int offs, JSON::Value & track){
+  switch (type){
     case DTSC::VIDEO:
-      len = S.lastData().length() + 16;
+      len = payloadLen + 16;
       if (track && track.isMember("codec")){
         if (track["codec"].asStringRef() == "H264"){
           len += 4;
@@ -375,28 +464,16 @@ bool FLV::Tag::DTSCLoader(DTSC::Stream & S){
       }
       break;
     case DTSC::AUDIO:
-      len = S.lastData().length() + 16;
+      len = payloadLen + 16;
       if (track && track.isMember("codec")){
         if (track["codec"].asStringRef() == "AAC"){
           len += 1;
         }
       }
       break;
-    case DTSC::META:{
-      AMF::Object amfdata("root", AMF::AMF0_DDV_CONTAINER);
-      amfdata.addContent(AMF::Object("", "onMetaData"));
-      amfdata.addContent(AMF::Object("", AMF::AMF0_ECMA_ARRAY));
-      for (JSON::ObjIter it = S.getPacket()["data"].ObjBegin(); it != S.getPacket()["data"].ObjEnd(); it++){
-        if (it->second.asInt()){
-          amfdata.getContentP(1)->addContent(AMF::Object(it->first, it->second.asInt(), AMF::AMF0_NUMBER));
-        }else{
-          amfdata.getContentP(1)->addContent(AMF::Object(it->first, it->second.asString(), AMF::AMF0_STRING));
-        }
-      }
-      meta_str = amfdata.Pack();
+    case DTSC::META:
       len = meta_str.length() + 15;
       break;
-    }
     default: //ignore all other types (there are currently no other types...)
       break;
   }
@@ -404,18 +481,18 @@ bool FLV::Tag::DTSCLoader(DTSC::Stream & S){
     if ( !checkBufferSize()){
       return false;
     }
-    switch (S.lastType()){
+    switch (type){
       case DTSC::VIDEO:
-        if ((unsigned int)len == S.lastData().length() + 16){
-          memcpy(data + 12, S.lastData().c_str(), S.lastData().length());
+        if ((unsigned int)len == payloadLen + 16){
+          memcpy(data + 12, payload, payloadLen);
         }else{
-          memcpy(data + 16, S.lastData().c_str(), S.lastData().length());
-          if (S.getPacket().isMember("nalu")){
+          memcpy(data + 16, payload, payloadLen);
+          if (nalu){
             data[12] = 1;
           }else{
             data[12] = 2;
           }
-          offset(S.getPacket()["offset"].asInt());
+          offset(offs);
         }
         data[11] = 0;
         if (track.isMember("codec") && track["codec"].asStringRef() == "H264"){
@@ -424,21 +501,13 @@ bool FLV::Tag::DTSCLoader(DTSC::Stream & S){
         if (track.isMember("codec") && track["codec"].asStringRef() == "H263"){
           data[11] += 2;
         }
-        if (S.getPacket().isMember("keyframe")){
-          data[11] += 0x10;
-        }
-        if (S.getPacket().isMember("interframe")){
-          data[11] += 0x20;
-        }
-        if (S.getPacket().isMember("disposableframe")){
-          data[11] += 0x30;
-        }
+        data[11] += frameType;
         break;
       case DTSC::AUDIO: {
-        if ((unsigned int)len == S.lastData().length() + 16){
-          memcpy(data + 12, S.lastData().c_str(), S.lastData().length());
+        if ((unsigned int)len == payloadLen + 16){
+          memcpy(data + 12, payload, payloadLen);
         }else{
-          memcpy(data + 13, S.lastData().c_str(), S.lastData().length());
+          memcpy(data + 13, payload, payloadLen);
           data[12] = 1; //raw AAC data, not sequence header
         }
         data[11] = 0;
@@ -472,7 +541,7 @@ bool FLV::Tag::DTSCLoader(DTSC::Stream & S){
     }
   }
   setLen();
-  switch (S.lastType()){
+  switch (type){
     case DTSC::VIDEO:
       data[0] = 0x09;
       break;
@@ -491,7 +560,7 @@ bool FLV::Tag::DTSCLoader(DTSC::Stream & S){
   data[8] = 0;
   data[9] = 0;
   data[10] = 0;
-  tagTime(S.getPacket()["time"].asInt());
+  tagTime(time);
   return true;
 }
 
@@ -885,8 +954,9 @@ bool FLV::Tag::FileReadUntil(char * buffer, unsigned int count, unsigned int & s
 /// This is a stateful function - if fed incorrect data, it will most likely never return true again!
 /// While this function returns false, the Tag might not contain valid data.
 /// \param f The file to read from.
+/// \param prefetch Optional prefetcher started on f, which is told the position and time of every tag read.
 /// \return True if a whole tag is succesfully read, false otherwise.
-bool FLV::Tag::FileLoader(FILE * f){
+bool FLV::Tag::FileLoader(FILE * f, Util::Prefetcher * prefetch){
   int preflags = fcntl(fileno(f), F_GETFL, 0);
   int postflags = preflags | O_NONBLOCK;
   fcntl(fileno(f), F_SETFL, postflags);
@@ -946,6 +1016,9 @@ bool FLV::Tag::FileLoader(FILE * f){
       done = true;
       sofar = 0;
       fcntl(fileno(f), F_SETFL, preflags);
+      if (prefetch){
+        prefetch->progress(ftello(f), tagTime());
+      }
       return true;
     }else{
       Util::sleep(100);//sleep 100ms
@@ -47,6 +47,7 @@ namespace FLV {
       //loader functions
       bool ChunkLoader(const RTMPStream::Chunk& O);
       bool DTSCLoader(DTSC::Stream & S);
+      bool DTSCLoader(const DTSC::Packet & packet, JSON::Value & track);
       bool DTSCVideoInit(DTSC::Stream & S);
       bool DTSCVideoInit(JSON::Value & video);
       bool DTSCAudioInit(DTSC::Stream & S);
@@ -54,13 +55,14 @@ namespace FLV {
       bool DTSCMetaInit(DTSC::Stream & S, JSON::Value & videoRef, JSON::Value & audioRef);
       JSON::Value toJSON(JSON::Value & metadata);
       bool MemLoader(char * D, unsigned int S, unsigned int & P);
-      bool FileLoader(FILE * f);
+      bool FileLoader(FILE * f, Util::Prefetcher * prefetch = 0);
     protected:
       int buf; ///< Maximum length of buffer space.
       bool done; ///< Body reading done?
       unsigned int sofar; ///< How many bytes are read sofar?
       void setLen();
       bool checkBufferSize();
+      bool DTSCLoader(DTSC::datatype type, long long int time, const char * payload, unsigned int payloadLen, const std::string & meta_str, int frameType, bool nalu, int offs, JSON::Value & track);
       //loader helper functions
       bool MemReadUntil(char * buffer, unsigned int count, unsigned int & sofar, char * D, unsigned int S, unsigned int & P);
       bool FileReadUntil(char * buffer, unsigned int count, unsigned int & sofar, FILE * f);
@@ -6,7 +6,8 @@
 #include <stdlib.h>
 #include <stdint.h> //for uint64_t
 #include <string.h> //for memcpy
-#include <arpa/inet.h> //for htonl
+#include "bitfields.h"
+#include <algorithm> //for std::min, std::lower_bound
 
 static inline char c2hex(char c){
   if (c >= '0' && c <= '9') return c - '0';
@@ -132,14 +133,269 @@ static void skipToEnd(std::istream & fromstream){
   }
 }
 
+static const size_t arenaFirstBlock = 16 * 1024; ///< Size of the first block of an arena.
+static const size_t arenaMaxBlock = 1024 * 1024; ///< Every next block of an arena doubles in size, up to this size.
+static const size_t nodeHeader = 16; ///< Bytes in front of every node, holding its arena and size, keeping the node aligned.
+static const size_t reusedSizes = 64; ///< Nodes of less than this many times 16 bytes are reused once freed, while their arena is in use.
+
+/// The blocks of a JSON::Arena. These stay until the arena is gone and every node taken from them was freed.
+struct arenaBlocks{
+  char * block; ///< The block nodes are taken from. Its first bytes point to the block before it.
+  size_t used; ///< Bytes of block in use.
+  size_t size; ///< Size of block.
+  volatile long int live; ///< Amount of nodes in use, plus one while the arena exists.
+  char * freed[reusedSizes]; ///< Per size in units of 16 bytes, the last node freed while this arena was in use.
+};
+
+static bool arenasEnabled = true; ///< Whether new arenas are used, see JSON::Arena::setEnabled().
+static __thread arenaBlocks * currentArena = 0; ///< The arena used by this thread, if any.
+
+/// Frees all blocks of the given arena.
+static void releaseArena(arenaBlocks * arena){
+  while (arena->block){
+    char * previous = *(char **)arena->block;
+    free(arena->block);
+    arena->block = previous;
+  }
+  delete arena;
+}
+
+/// Allocates a node for the containers of a JSON::Value, from the arena of this thread if there is one.
+/// Large nodes are always taken from the heap.
+void * JSON::allocNode(size_t size){
+  arenaBlocks * arena = currentArena;
+  size_t total = nodeHeader + ((size + 15) & ~(size_t)15);
+  char * node = 0;
+  if ( !arena || total > arenaMaxBlock / 8){
+    node = (char *)malloc(nodeHeader + size);
+    if ( !node){
+      throw std::bad_alloc();
+    }
+    *(arenaBlocks **)node = 0;
+    return node + nodeHeader;
+  }
+  if (total / 16 < reusedSizes && arena->freed[total / 16]){
+    //reuse a node freed earlier, for temporary values created while parsing
+    node = arena->freed[total / 16];
+    arena->freed[total / 16] = *(char **)(node + nodeHeader);
+    __sync_add_and_fetch(&arena->live, 1);
+    return node + nodeHeader;
+  }
+  if ( !arena->block || arena->used + total > arena->size){
+    size_t newSize = arena->block ? std::min(arena->size * 2, arenaMaxBlock) : arenaFirstBlock;
+    char * block = (char *)malloc(newSize);
+    if ( !block){
+      throw std::bad_alloc();
+    }
+    *(char **)block = arena->block;
+    arena->block = block;
+    arena->size = newSize;
+    arena->used = nodeHeader;
+  }
+  node = arena->block + arena->used;
+  arena->used += total;
+  *(arenaBlocks **)node = arena;
+  ((size_t *)node)[1] = total;
+  __sync_add_and_fetch(&arena->live, 1);
+  return node + nodeHeader;
+}
+
+/// Frees a node allocated by allocNode(). Nodes from an arena are only counted, see JSON::Arena,
+/// and kept for reuse if that arena is still in use on this thread.
+void JSON::freeNode(void * ptr){
+  if ( !ptr){
+    return;
+  }
+  char * node = (char *)ptr - nodeHeader;
+  arenaBlocks * arena = *(arenaBlocks **)node;
+  if ( !arena){
+    free(node);
+    return;
+  }
+  size_t total = ((size_t *)node)[1];
+  if (arena == currentArena && total / 16 < reusedSizes){
+    //the arena is in use on this thread, so nothing else takes nodes from it
+    *(char **)ptr = arena->freed[total / 16];
+    arena->freed[total / 16] = node;
+  }
+  if (__sync_sub_and_fetch(&arena->live, 1) == 0){
+    releaseArena(arena);
+  }
+}
+
+/// Starts using a new arena on this thread, unless arenas are disabled.
+JSON::Arena::Arena(){
+  previous = currentArena;
+  blocks = 0;
+  if ( !arenasEnabled){
+    return;
+  }
+  arenaBlocks * arena = new arenaBlocks;
+  arena->block = 0;
+  arena->used = 0;
+  arena->size = 0;
+  arena->live = 1;
+  memset(arena->freed, 0, sizeof(arena->freed));
+  blocks = arena;
+  currentArena = arena;
+}
+
+/// Goes back to the arena that was used before this one, if any.
+/// The blocks of this arena are freed once no value uses them anymore.
+JSON::Arena::~Arena(){
+  if ( !blocks){
+    return;
+  }
+  currentArena = (arenaBlocks *)previous;
+  arenaBlocks * arena = (arenaBlocks *)blocks;
+  if (__sync_sub_and_fetch(&arena->live, 1) == 0){
+    releaseArena(arena);
+  }
+}
+
+/// Enables or disables the use of arenas created after this call, on all threads. Enabled by default.
+/// While disabled, creating an arena does nothing and all values are allocated from the heap.
+void JSON::Arena::setEnabled(bool enabled){
+  arenasEnabled = enabled;
+}
+
+/// The contents of an object type JSON::Value.
+struct JSON::Value::ObjData{
+  ObjData(){}
+  ~ObjData();
+  MemberList members; ///< All members, sorted by name.
+  std::string packed; ///< The value as packed by netPrepare(), see toNetPacked().
+  private:
+    ObjData(const ObjData & rhs);
+    ObjData & operator=(const ObjData & rhs);
+};
+
+/// Creates a copy of val in a node from allocNode().
+template <typename T>
+static T * newNode(const T & val){
+  return new (JSON::allocNode(sizeof(T))) T(val);
+}
+
+/// Destroys and frees a node created by newNode().
+template <typename T>
+static void deleteNode(T * ptr){
+  ptr->~T();
+  JSON::freeNode(ptr);
+}
+
+/// Frees all members.
+JSON::Value::ObjData::~ObjData(){
+  for (MemberList::iterator it = members.begin(); it != members.end(); it++){
+    deleteNode( *it);
+  }
+}
+
+/// Orders members by name, the same way a std::map<std::string, Value> does.
+struct memberOrder{
+  bool operator()(const JSON::Member * member, const std::string & name) const{
+    return member->first < name;
+  }
+  bool operator()(const JSON::Member * member, const char * name) const{
+    return member->first.compare(name) < 0;
+  }
+};
+
+/// Returns the position of the member with the given name in members, or members.end() if there is none.
+template <typename K>
+static JSON::MemberList::const_iterator findMember(const JSON::MemberList & members, const K & name){
+  JSON::MemberList::const_iterator it = std::lower_bound(members.begin(), members.end(), name, memberOrder());
+  if (it != members.end() && ( *it)->first == name){
+    return it;
+  }
+  return members.end();
+}
+
+/// Returns the member with the given name from members, adding it as null in its place if it is not there yet.
+template <typename K>
+static JSON::Value & getMember(JSON::MemberList & members, const K & name){
+  JSON::MemberList::iterator it = std::lower_bound(members.begin(), members.end(), name, memberOrder());
+  if (it != members.end() && ( *it)->first == name){
+    return ( *it)->second;
+  }
+  JSON::Member * member = newNode(JSON::Member(name, JSON::Value()));
+  members.insert(it, member);
+  return member->second;
+}
+
+static JSON::MemberList emptyMembers; ///< Iterated over for values that are not objects.
+static JSON::ArrList emptyArray; ///< Iterated over for values that are not arrays.
+
+/// Makes this value an empty value of the given type, releasing what it held before.
+void JSON::Value::setType(ValueType type){
+  null();
+  switch (type){
+    case STRING:
+      strVal = newNode(std::string());
+      break;
+    case ARRAY:
+      arrVal = newNode(ArrList());
+      break;
+    case OBJECT:
+      objVal = new (allocNode(sizeof(ObjData))) ObjData();
+      break;
+    default:
+      break;
+  }
+  myType = type;
+}
+
 /// Sets this JSON::Value to null;
 JSON::Value::Value(){
+  myType = EMPTY;
+  intVal = 0;
+}
+
+/// Creates a deep copy of the given JSON::Value.
+JSON::Value::Value(const Value & rhs){
+  myType = EMPTY;
+  intVal = 0;
+  switch (rhs.myType){
+    case STRING:
+      strVal = newNode( *rhs.strVal);
+      break;
+    case ARRAY:
+      arrVal = newNode( *rhs.arrVal);
+      break;
+    case OBJECT: {
+      ObjData * data = new (allocNode(sizeof(ObjData))) ObjData();
+      data->packed = rhs.objVal->packed;
+      data->members.reserve(rhs.objVal->members.size());
+      for (MemberList::const_iterator it = rhs.objVal->members.begin(); it != rhs.objVal->members.end(); it++){
+        data->members.push_back(newNode( **it));
+      }
+      objVal = data;
+      break;
+    }
+    default:
+      intVal = rhs.intVal;
+      break;
+  }
+  myType = rhs.myType;
+}
+
+/// Frees everything this JSON::Value holds.
+JSON::Value::~Value(){
   null();
 }
 
+/// Replaces this JSON::Value with a deep copy of the given one, which may be a part of this value.
+JSON::Value & JSON::Value::operator=(const Value & rhs){
+  if (this != &rhs){
+    Value tmp(rhs);
+    swap(tmp);
+  }
+  return *this;
+}
+
 /// Sets this JSON::Value to read from this position in the std::istream
 JSON::Value::Value(std::istream & fromstream){
-  null();
+  myType = EMPTY;
+  intVal = 0;
   bool reading_object = false;
   bool reading_array = false;
   while (fromstream.good()){
@@ -148,15 +404,16 @@ JSON::Value::Value(std::istream & fromstream){
       case '{':
         reading_object = true;
         c = fromstream.get();
-        myType = OBJECT;
+        setType(OBJECT);
         break;
       case '[': {
         reading_array = true;
         c = fromstream.get();
-        myType = ARRAY;
+        setType(ARRAY);
         Value tmp = JSON::Value(fromstream);
         if (tmp.myType != EMPTY){
-          append(tmp);
+          arrVal->push_back(Value());
+          arrVal->back().swap(tmp);
         }
         break;
       }
@@ -164,12 +421,13 @@ JSON::Value::Value(std::istream & fromstream){
       case '"':
         c = fromstream.get();
         if ( !reading_object){
-          myType = STRING;
-          strVal = read_string(c, fromstream);
+          setType(STRING);
+          *strVal = read_string(c, fromstream);
           return;
         }else{
           std::string tmpstr = read_string(c, fromstream);
-          ( *this)[tmpstr] = JSON::Value(fromstream);
+          Value tmp = JSON::Value(fromstream);
+          ( *this)[tmpstr].swap(tmp);
         }
         break;
       case '0':
@@ -183,15 +441,19 @@ JSON::Value::Value(std::istream & fromstream){
       case '8':
       case '9':
         c = fromstream.get();
-        myType = INTEGER;
+        if (myType != INTEGER){
+          setType(INTEGER);
+        }
         intVal *= 10;
         intVal += c - '0';
         break;
       case ',':
         if ( !reading_object && !reading_array) return;
         c = fromstream.get();
-        if (reading_array){
-          append(JSON::Value(fromstream));
+        if (reading_array && myType == ARRAY){
+          Value tmp = JSON::Value(fromstream);
+          arrVal->push_back(Value());
+          arrVal->back().swap(tmp);
         }
         break;
       case '}':
@@ -209,21 +471,21 @@ JSON::Value::Value(std::istream & fromstream){
       case 't':
       case 'T':
         skipToEnd(fromstream);
-        myType = BOOL;
+        setType(BOOL);
         intVal = 1;
         return;
         break;
       case 'f':
       case 'F':
         skipToEnd(fromstream);
-        myType = BOOL;
+        setType(BOOL);
         intVal = 0;
         return;
         break;
       case 'n':
       case 'N':
         skipToEnd(fromstream);
-        myType = EMPTY;
+        null();
         return;
         break;
       default:
@@ -237,15 +499,13 @@ JSON::Value::Value(std::istream & fromstream){
 /// Sets this JSON::Value to the given string.
 JSON::Value::Value(const std::string & val){
   myType = STRING;
-  strVal = val;
-  intVal = 0;
+  strVal = newNode(val);
 }
 
 /// Sets this JSON::Value to the given string.
 JSON::Value::Value(const char * val){
   myType = STRING;
-  strVal = val;
-  intVal = 0;
+  strVal = newNode(std::string(val));
 }
 
 /// Sets this JSON::Value to the given integer.
@@ -261,28 +521,26 @@ bool JSON::Value::operator==(const JSON::Value & rhs) const{
     return intVal == rhs.intVal;
   }
   if (myType == STRING){
-    return strVal == rhs.strVal;
+    return *strVal == *rhs.strVal;
   }
   if (myType == EMPTY){
     return true;
   }
   if (myType == OBJECT){
-    if (objVal.size() != rhs.objVal.size()) return false;
-    for (std::map<std::string, Value>::const_iterator it = objVal.begin(); it != objVal.end(); ++it){
-      if ( !rhs.isMember(it->first)){
-        return false;
-      }
-      if (it->second != rhs.objVal.find(it->first)->second){
+    if (size() != rhs.size()) return false;
+    //both member lists are sorted by name, so equal objects have equal members at every position
+    for (MemberList::const_iterator it = objVal->members.begin(), rIt = rhs.objVal->members.begin(); it != objVal->members.end(); ++it, ++rIt){
+      if (( *it)->first != ( *rIt)->first || ( *it)->second != ( *rIt)->second){
         return false;
       }
     }
     return true;
   }
   if (myType == ARRAY){
-    if (arrVal.size() != rhs.arrVal.size()) return false;
+    if (size() != rhs.size()) return false;
     int i = 0;
-    for (std::deque<Value>::const_iterator it = arrVal.begin(); it != arrVal.end(); ++it){
-      if ( *it != rhs.arrVal[i]){
+    for (ArrConstIter it = arrVal->begin(); it != arrVal->end(); ++it){
+      if ( *it != ( *rhs.arrVal)[i]){
         return false;
       }
       i++;
@@ -299,17 +557,17 @@ bool JSON::Value::operator!=(const JSON::Value & rhs) const{
 
 /// Sets this JSON::Value to the given boolean.
 JSON::Value & JSON::Value::operator=(const bool &rhs){
-  null();
-  myType = BOOL;
+  setType(BOOL);
   if (rhs) intVal = 1;
   return *this;
 }
 
 /// Sets this JSON::Value to the given string.
 JSON::Value & JSON::Value::operator=(const std::string &rhs){
-  null();
-  myType = STRING;
-  strVal = rhs;
+  if (myType != STRING){
+    setType(STRING);
+  }
+  *strVal = rhs;
   return *this;
 }
 
@@ -320,8 +578,7 @@ JSON::Value & JSON::Value::operator=(const char * rhs){
 
 /// Sets this JSON::Value to the given integer.
 JSON::Value & JSON::Value::operator=(const long long int &rhs){
-  null();
-  myType = INTEGER;
+  setType(INTEGER);
   intVal = rhs;
   return *this;
 }
@@ -342,7 +599,7 @@ JSON::Value::operator long long int() const{
     return intVal;
   }
   if (myType == STRING){
-    return atoll(strVal.c_str());
+    return atoll(strVal->c_str());
   }
   return 0;
 }
@@ -351,7 +608,7 @@ JSON::Value::operator long long int() const{
 /// Returns the raw string value if available, otherwise calls toString().
 JSON::Value::operator std::string() const{
   if (myType == STRING){
-    return strVal;
+    return *strVal;
   }else{
     if (myType == EMPTY){
       return "";
@@ -365,7 +622,7 @@ JSON::Value::operator std::string() const{
 /// Returns true if there is anything meaningful stored into this value.
 JSON::Value::operator bool() const{
   if (myType == STRING){
-    return strVal != "";
+    return *strVal != "";
   }
   if (myType == INTEGER){
     return intVal != 0;
@@ -405,7 +662,7 @@ const bool JSON::Value::asBool() const{
 const std::string & JSON::Value::asStringRef() const{
   static std::string ugly_buffer;
   if (myType == STRING){
-    return strVal;
+    return *strVal;
   }
   return ugly_buffer;
 }
@@ -416,7 +673,7 @@ const std::string & JSON::Value::asStringRef() const{
 /// \warning Only save to use when the JSON::Value is a string type!
 const char * JSON::Value::c_str() const{
   if (myType == STRING){
-    return strVal.c_str();
+    return strVal->c_str();
   }
   return "";
 }
@@ -425,288 +682,342 @@ const char * JSON::Value::c_str() const{
 /// Converts destructively to object if not already an object.
 JSON::Value & JSON::Value::operator[](const std::string i){
   if (myType != OBJECT){
-    null();
-    myType = OBJECT;
+    setType(OBJECT);
   }
-  return objVal[i];
+  return getMember(objVal->members, i);
 }
 
 /// Retrieves or sets the JSON::Value at this position in the object.
 /// Converts destructively to object if not already an object.
 JSON::Value & JSON::Value::operator[](const char * i){
   if (myType != OBJECT){
-    null();
-    myType = OBJECT;
+    setType(OBJECT);
   }
-  return objVal[i];
+  return getMember(objVal->members, i);
 }
 
 /// Retrieves or sets the JSON::Value at this position in the array.
 /// Converts destructively to array if not already an array.
 JSON::Value & JSON::Value::operator[](unsigned int i){
   if (myType != ARRAY){
-    null();
-    myType = ARRAY;
+    setType(ARRAY);
   }
-  while (i >= arrVal.size()){
+  while (i >= arrVal->size()){
     append(JSON::Value());
   }
-  return arrVal[i];
+  return ( *arrVal)[i];
 }
 
 /// Retrieves the JSON::Value at this position in the object.
-/// Fails horribly if that values does not exist.
+/// Returns a null value if there is no such member.
 const JSON::Value & JSON::Value::operator[](const std::string i) const{
-  return objVal.find(i)->second;
+  static const JSON::Value empty;
+  if (myType != OBJECT){
+    return empty;
+  }
+  MemberList::const_iterator it = findMember(objVal->members, i);
+  return (it != objVal->members.end()) ? ( *it)->second : empty;
 }
 
 /// Retrieves the JSON::Value at this position in the object.
-/// Fails horribly if that values does not exist.
+/// Returns a null value if there is no such member.
 const JSON::Value & JSON::Value::operator[](const char * i) const{
-  return objVal.find(i)->second;
+  static const JSON::Value empty;
+  if (myType != OBJECT){
+    return empty;
+  }
+  MemberList::const_iterator it = findMember(objVal->members, i);
+  return (it != objVal->members.end()) ? ( *it)->second : empty;
 }
 
 /// Retrieves the JSON::Value at this position in the array.
-/// Fails horribly if that values does not exist.
+/// Returns a null value if there is no such element.
 const JSON::Value & JSON::Value::operator[](unsigned int i) const{
-  return arrVal[i];
+  static const JSON::Value empty;
+  if (myType != ARRAY || i >= arrVal->size()){
+    return empty;
+  }
+  return ( *arrVal)[i];
 }
 
+/// Returns true if name is in skip, a NULL-terminated list of member names, which may itself be NULL.
+static bool isSkipped(const std::string & name, const char * const * skip){
+  if ( !skip){
+    return false;
+  }
+  for (; *skip; skip++){
+    if (name == *skip){
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Members that are moved to the header of a DTP2 packet by netPrepare() and sendTo().
+/// Datatype comes first, so that it can be left out by skipping the first entry.
+static const char * const packetMembers[] = {"datatype", "time", "trackid", 0};
+
 /// Packs to a std::string for transfer over the network.
 /// If the object is a container type, this function will call itself recursively and contain all contents.
-/// As a side effect, this function clear the internal buffer of any object-types.
+/// The exact size is calculated first, so the result is allocated once and written in a single pass.
 std::string JSON::Value::toPacked() const{
   std::string r;
-  if (isInt() || isNull() || isBool()){
-    r += 0x01;
-    uint64_t numval = intVal;
-    r += *(((char*) &numval) + 7);
-    r += *(((char*) &numval) + 6);
-    r += *(((char*) &numval) + 5);
-    r += *(((char*) &numval) + 4);
-    r += *(((char*) &numval) + 3);
-    r += *(((char*) &numval) + 2);
-    r += *(((char*) &numval) + 1);
-    r += *(((char*) &numval));
-  }
-  if (isString()){
-    r += 0x02;
-    r += strVal.size() / (256 * 256 * 256);
-    r += strVal.size() / (256 * 256);
-    r += strVal.size() / 256;
-    r += strVal.size() % 256;
-    r += strVal;
-  }
-  if (isObject()){
-    r += 0xE0;
-    if (objVal.size() > 0){
-      for (JSON::ObjConstIter it = objVal.begin(); it != objVal.end(); it++){
-        if (it->first.size() > 0){
-          r += it->first.size() / 256;
-          r += it->first.size() % 256;
-          r += it->first;
-          r += it->second.toPacked();
+  r.resize(packedSize());
+  packTo( &r[0]);
+  return r;
+}
+//toPacked
+
+/// Writes the packed form of this value to p, which must have room for packedSize(skip) bytes.
+/// Members of this value named in skip, a NULL-terminated list, are left out. Members of children are never left out.
+/// \returns The position right after the written data.
+char * JSON::Value::packTo(char * p, const char * const * skip) const{
+  switch (myType){
+    case STRING:
+      *(p++) = 0x02;
+      p = Bit::htobl(p, strVal->size());
+      memcpy(p, strVal->data(), strVal->size());
+      return p + strVal->size();
+    case OBJECT:
+      *(p++) = 0xE0;
+      for (MemberList::const_iterator it = objVal->members.begin(); it != objVal->members.end(); it++){
+        const std::string & name = ( *it)->first;
+        if (name.size() > 0 && !isSkipped(name, skip)){
+          *(p++) = (name.size() >> 8) & 0xFF;
+          *(p++) = name.size() & 0xFF;
+          memcpy(p, name.data(), name.size());
+          p = ( *it)->second.packTo(p + name.size());
         }
       }
+      break;
+    case ARRAY:
+      *(p++) = 0x0A;
+      for (ArrList::const_iterator it = arrVal->begin(); it != arrVal->end(); it++){
+        p = it->packTo(p);
+      }
+      break;
+    default:
+      *(p++) = 0x01;
+      return Bit::htobll(p, intVal);
+  }
+  memcpy(p, "\000\000\356", 3);
+  return p + 3;
+}
+
+/// Collects the pieces of a value being sent by sendTo(), and sends them with a single scatter-gather write
+/// whenever it is full and when flushed. Long strings, such as packet data, are sent from where they are.
+/// Short pieces are copied together into a small buffer, so they do not need an entry each.
+class JSON::Value::SendList{
+  public:
+    SendList(Socket::Connection & socket);
+    void add(const char * data, unsigned int len);
+    void copy(const char * data, unsigned int len);
+    void flush();
+  private:
+    static const unsigned int maxEntries = 64; ///< Amount of pieces sent with one write.
+    static const unsigned int copyLimit = 128; ///< Pieces shorter than this are copied instead of referenced.
+    Socket::Connection & socket; ///< Connection to send to.
+    struct iovec entries[maxEntries]; ///< The pieces collected so far.
+    unsigned int count; ///< Amount of entries in use.
+    char buffer[4096]; ///< Holds the copied pieces.
+    unsigned int used; ///< Amount of bytes of buffer in use.
+};
+
+/// Creates an empty list that sends to the given connection.
+JSON::Value::SendList::SendList(Socket::Connection & socket) : socket(socket){
+  count = 0;
+  used = 0;
+}
+
+/// Adds len bytes from data to the list. Unless they are copied, they must stay unchanged until the list is flushed.
+void JSON::Value::SendList::add(const char * data, unsigned int len){
+  if (len < copyLimit){
+    copy(data, len);
+    return;
+  }
+  if (count == maxEntries){
+    flush();
+  }
+  entries[count].iov_base = (void *)data;
+  entries[count].iov_len = len;
+  count++;
+}
+
+/// Adds a copy of len bytes from data to the list, which must be at most the size of the copy buffer.
+void JSON::Value::SendList::copy(const char * data, unsigned int len){
+  if (used + len > sizeof(buffer)){
+    flush();
+  }
+  memcpy(buffer + used, data, len);
+  //extend the last entry if it ends where this copy starts
+  if (count && (char *)entries[count - 1].iov_base + entries[count - 1].iov_len == buffer + used){
+    entries[count - 1].iov_len += len;
+  }else{
+    if (count == maxEntries){
+      flush();
+      memcpy(buffer, data, len);
     }
-    r += (char)0x0;
-    r += (char)0x0;
-    r += (char)0xEE;
-  }
-  if (isArray()){
-    r += 0x0A;
-    for (JSON::ArrConstIter it = arrVal.begin(); it != arrVal.end(); it++){
-      r += it->toPacked();
-    }
-    r += (char)0x0;
-    r += (char)0x0;
-    r += (char)0xEE;
+    entries[count].iov_base = buffer + used;
+    entries[count].iov_len = len;
+    count++;
   }
-  return r;
+  used += len;
+}
+
+/// Sends everything in the list, blocking until it is sent, and empties the list.
+void JSON::Value::SendList::flush(){
+  if (count){
+    socket.SendNow(entries, count);
+  }
+  count = 0;
+  used = 0;
 }
-//toPacked
 
 /// Packs and transfers over the network.
 /// If the object is a container type, this function will call itself recursively for all contents.
+/// All pieces are collected first and sent with as few system calls as possible, without copying strings.
 void JSON::Value::sendTo(Socket::Connection & socket) const{
-  if (isInt() || isNull() || isBool()){
-    socket.SendNow("\001", 1);
-    int tmpHalf = htonl((int)(intVal >> 32));
-    socket.SendNow((char*)&tmpHalf, 4);
-    tmpHalf = htonl((int)(intVal & 0xFFFFFFFF));
-    socket.SendNow((char*)&tmpHalf, 4);
-    return;
-  }
-  if (isString()){
-    socket.SendNow("\002", 1);
-    int tmpVal = htonl((int)strVal.size());
-    socket.SendNow((char*)&tmpVal, 4);
-    socket.SendNow(strVal);
-    return;
-  }
-  if (isObject()){
-    if (isMember("trackid") && isMember("time")){
-      unsigned int trackid = objVal.find("trackid")->second.asInt();
-      long long time = objVal.find("time")->second.asInt();
-      unsigned int size = 16;
-      if (objVal.size() > 0){
-        for (JSON::ObjConstIter it = objVal.begin(); it != objVal.end(); it++){
-          if (it->first.size() > 0 && it->first != "trackid" && it->first != "time" && it->first != "datatype"){
-            size += 2+it->first.size()+it->second.packedSize();
-          }
-        }
+  SendList list(socket);
+  gather(list);
+  list.flush();
+}//sendTo
+
+/// Adds the pieces sendTo() sends for this value to list.
+void JSON::Value::gather(SendList & list) const{
+  char header[20];
+  switch (myType){
+    case STRING:
+      header[0] = 0x02;
+      Bit::htobl(header + 1, strVal->size());
+      list.copy(header, 5);
+      list.add(strVal->data(), strVal->size());
+      return;
+    case OBJECT: {
+      const char * const * skip = 0;
+      if (isMember("trackid") && isMember("time")){
+        //a packet: time and trackid go in the header, datatype is left out entirely
+        skip = packetMembers;
+        memcpy(header, "DTP2", 4);
+        char * p = Bit::htobl(header + 4, packedSize(skip) + 12);
+        p = Bit::htobl(p, ( *this)["trackid"].asInt());
+        Bit::htobll(p, ( *this)["time"].asInt());
+        list.copy(header, 20);
+      }else if (isMember("tracks")){
+        memcpy(header, "DTSC", 4);
+        Bit::htobl(header + 4, packedSize());
+        list.copy(header, 8);
       }
-      socket.SendNow("DTP2", 4);
-      size = htonl(size);
-      socket.SendNow((char*)&size, 4);
-      trackid = htonl(trackid);
-      socket.SendNow((char*)&trackid, 4);
-      int tmpHalf = htonl((int)(time >> 32));
-      socket.SendNow((char*)&tmpHalf, 4);
-      tmpHalf = htonl((int)(time & 0xFFFFFFFF));
-      socket.SendNow((char*)&tmpHalf, 4);
-      socket.SendNow("\340", 1);
-      if (objVal.size() > 0){
-        for (JSON::ObjConstIter it = objVal.begin(); it != objVal.end(); it++){
-          if (it->first.size() > 0 && it->first != "trackid" && it->first != "time" && it->first != "datatype"){
-            char sizebuffer[2] = {0, 0};
-            sizebuffer[0] = (it->first.size() >> 8) & 0xFF;
-            sizebuffer[1] = it->first.size() & 0xFF;
-            socket.SendNow(sizebuffer, 2);
-            socket.SendNow(it->first);
-            it->second.sendTo(socket);
-          }
+      list.copy("\340", 1);
+      for (MemberList::const_iterator it = objVal->members.begin(); it != objVal->members.end(); it++){
+        const std::string & name = ( *it)->first;
+        if (name.size() > 0 && !isSkipped(name, skip)){
+          header[0] = (name.size() >> 8) & 0xFF;
+          header[1] = name.size() & 0xFF;
+          list.copy(header, 2);
+          list.add(name.data(), name.size());
+          ( *it)->second.gather(list);
         }
       }
-      socket.SendNow("\000\000\356", 3);
+      list.copy("\000\000\356", 3);
       return;
     }
-    if (isMember("tracks")){
-      socket.SendNow("DTSC", 4);
-      unsigned int size = htonl(packedSize());
-      socket.SendNow((char*)&size, 4);
-    }
-    socket.SendNow("\340", 1);
-    if (objVal.size() > 0){
-      for (JSON::ObjConstIter it = objVal.begin(); it != objVal.end(); it++){
-        if (it->first.size() > 0){
-          char sizebuffer[2] = {0, 0};
-          sizebuffer[0] = (it->first.size() >> 8) & 0xFF;
-          sizebuffer[1] = it->first.size() & 0xFF;
-          socket.SendNow(sizebuffer, 2);
-          socket.SendNow(it->first);
-          it->second.sendTo(socket);
-        }
+    case ARRAY:
+      list.copy("\012", 1);
+      for (ArrList::const_iterator it = arrVal->begin(); it != arrVal->end(); it++){
+        it->gather(list);
       }
-    }
-    socket.SendNow("\000\000\356", 3);
-    return;
-  }
-  if (isArray()){
-    socket.SendNow("\012", 1);
-    for (JSON::ArrConstIter it = arrVal.begin(); it != arrVal.end(); it++){
-      it->sendTo(socket);
-    }
-    socket.SendNow("\000\000\356", 3);
-    return;
+      list.copy("\000\000\356", 3);
+      return;
+    default:
+      header[0] = 0x01;
+      Bit::htobll(header + 1, intVal);
+      list.copy(header, 9);
+      return;
   }
-}//sendTo
+}
 
 /// Returns the packed size of this Value.
 unsigned int JSON::Value::packedSize() const{
-  if (isInt() || isNull() || isBool()){
-    return 9;
-  }
-  if (isString()){
-    return 5 + strVal.size();
-  }
-  if (isObject()){
-    unsigned int ret = 4;
-    if (objVal.size() > 0){
-      for (JSON::ObjConstIter it = objVal.begin(); it != objVal.end(); it++){
-        if (it->first.size() > 0){
-          ret += 2+it->first.size()+it->second.packedSize();
+  return packedSize(0);
+}
+
+/// Returns the packed size of this Value, leaving out the members named in skip, see packTo().
+unsigned int JSON::Value::packedSize(const char * const * skip) const{
+  switch (myType){
+    case STRING:
+      return 5 + strVal->size();
+    case OBJECT: {
+      unsigned int ret = 4;
+      for (MemberList::const_iterator it = objVal->members.begin(); it != objVal->members.end(); it++){
+        const std::string & name = ( *it)->first;
+        if (name.size() > 0 && !isSkipped(name, skip)){
+          ret += 2 + name.size() + ( *it)->second.packedSize();
         }
       }
+      return ret;
     }
-    return ret;
-  }
-  if (isArray()){
-    unsigned int ret = 4;
-    for (JSON::ArrConstIter it = arrVal.begin(); it != arrVal.end(); it++){
-      ret += it->packedSize();
+    case ARRAY: {
+      unsigned int ret = 4;
+      for (ArrList::const_iterator it = arrVal->begin(); it != arrVal->end(); it++){
+        ret += it->packedSize();
+      }
+      return ret;
     }
-    return ret;
+    default:
+      return 9;
   }
 }//packedSize
 
 /// Pre-packs any object-type JSON::Value to a std::string for transfer over the network, including proper DTMI header.
 /// Non-object-types will print an error to stderr.
+/// Objects with a trackid or datatype member become a DTP2 packet, with the time and track in the packet header
+/// instead of in the object. The object itself is not changed.
 /// The internal buffer is guaranteed to be up-to-date after this function is called.
 void JSON::Value::netPrepare(){
   if (myType != OBJECT){
     fprintf(stderr, "Error: Only objects may be NetPacked!\n");
     return;
   }
-  std::string packed = toPacked();
+  std::string & packed = objVal->packed;
+  const Value & self = *this;
+  if ( !isMember("datatype") && !isMember("trackid")){
+    unsigned int size = packedSize();
+    packed.resize(size + 8);
+    char * p = &packed[0];
+    memcpy(p, "DTSC", 4);
+    packTo(Bit::htobl(p + 4, size));
+    return;
+  }
   //insert proper header for this type of data
   int packID = -1;
-  long long unsigned int time = objVal["time"].asInt();
-  std::string dataType;
-  if (isMember("datatype") || isMember("trackid")){
-    dataType = objVal["datatype"].asString();
-    if (isMember("trackid")){
-      packID = objVal["trackid"].asInt();
-    }else{ 
-      if (objVal["datatype"].asString() == "video"){
-        packID = 1;
-      }
-      if (objVal["datatype"].asString() == "audio"){
-        packID = 2;
-      }
-      if (objVal["datatype"].asString() == "meta"){
-        packID = 3;
-      }
-      //endmark and the likes...
-      if (packID == -1){
-        packID = 0;
-      }
+  if (isMember("trackid")){
+    packID = self["trackid"].asInt();
+  }else{
+    const std::string & dataType = self["datatype"].asStringRef();
+    if (dataType == "video"){
+      packID = 1;
     }
-    removeMember("time");
-    if (packID != 0){
-      removeMember("datatype");
+    if (dataType == "audio"){
+      packID = 2;
+    }
+    if (dataType == "meta"){
+      packID = 3;
+    }
+    //endmark and the likes...
+    if (packID == -1){
+      packID = 0;
     }
-    removeMember("trackid");
-    packed = toPacked();
-    objVal["time"] = (long long int)time;
-    objVal["datatype"] = dataType;
-    objVal["trackid"] = packID;
-    strVal.resize(packed.size() + 20);
-    memcpy((void*)strVal.c_str(), "DTP2", 4);
-  }else{
-    packID = -1;
-    strVal.resize(packed.size() + 8);
-    memcpy((void*)strVal.c_str(), "DTSC", 4);
-  }
-  //insert the packet length at bytes 4-7
-  unsigned int size = packed.size();
-  if (packID != -1){
-    size += 12;
-  }
-  size = htonl(size);
-  memcpy((void*)(strVal.c_str() + 4), (void*) &size, 4);
-  //copy the rest of the string
-  if (packID == -1){
-    memcpy((void*)(strVal.c_str() + 8), packed.c_str(), packed.size());
-    return;
   }
-  packID = htonl(packID);
-  memcpy((void*)(strVal.c_str() + 8), (void*) &packID, 4);
-  int tmpHalf = htonl((int)(time >> 32));
-  memcpy((void*)(strVal.c_str() + 12), (void*) &tmpHalf, 4);
-  tmpHalf = htonl((int)(time & 0xFFFFFFFF));
-  memcpy((void*)(strVal.c_str() + 16), (void*) &tmpHalf, 4);
-  memcpy((void*)(strVal.c_str() + 20), packed.c_str(), packed.size());
+  //the datatype stays in the object for packets that are not for a track
+  const char * const * skip = packID ? packetMembers : packetMembers + 1;
+  unsigned int size = packedSize(skip);
+  packed.resize(size + 20);
+  char * p = &packed[0];
+  memcpy(p, "DTP2", 4);
+  p = Bit::htobl(p + 4, size + 12);
+  p = Bit::htobl(p, packID);
+  p = Bit::htobll(p, self["time"].asInt());
+  packTo(p, skip);
 }
 
 /// Packs any object-type JSON::Value to a std::string for transfer over the network, including proper DTMI header.
@@ -722,10 +1033,10 @@ std::string & JSON::Value::toNetPacked(){
     return emptystring;
   }
   //if sneaky storage doesn't contain correct data, re-calculate it
-  if (strVal.size() == 0 || strVal[0] != 'D' || strVal[1] != 'T'){
+  if (objVal->packed.size() == 0 || objVal->packed[0] != 'D' || objVal->packed[1] != 'T'){
     netPrepare();
   }
-  return strVal;
+  return objVal->packed;
 }
 
 /// Converts this JSON::Value to valid JSON notation and returns it.
@@ -739,12 +1050,12 @@ std::string JSON::Value::toString() const{
       break;
     }
     case STRING: {
-      return string_escape(strVal);
+      return string_escape( *strVal);
       break;
     }
     case ARRAY: {
       std::string tmp = "[";
-      if (arrVal.size() > 0){
+      if (size() > 0){
         for (ArrConstIter it = ArrBegin(); it != ArrEnd(); it++){
           tmp += it->toString();
           if (it + 1 != ArrEnd()){
@@ -758,7 +1069,7 @@ std::string JSON::Value::toString() const{
     }
     case OBJECT: {
       std::string tmp2 = "{";
-      if (objVal.size() > 0){
+      if (size() > 0){
         ObjConstIter it3 = ObjEnd();
         --it3;
         for (ObjConstIter it2 = ObjBegin(); it2 != ObjEnd(); it2++){
@@ -791,16 +1102,16 @@ std::string JSON::Value::toPrettyString(int indentation) const{
       break;
     }
     case STRING: {
-      for (unsigned int i = 0; i < 201 && i < strVal.size(); ++i){
-        if (strVal[i] < 32 || strVal[i] > 126 || strVal.size() > 200){
-          return "\""+JSON::Value((long long int)strVal.size()).asString() + " bytes of data\"";
+      for (unsigned int i = 0; i < 201 && i < strVal->size(); ++i){
+        if (( *strVal)[i] < 32 || ( *strVal)[i] > 126 || strVal->size() > 200){
+          return "\""+JSON::Value((long long int)strVal->size()).asString() + " bytes of data\"";
         }
       }
-      return string_escape(strVal);
+      return string_escape( *strVal);
       break;
     }
     case ARRAY: {
-      if (arrVal.size() > 0){
+      if (size() > 0){
         std::string tmp = "[\n" + std::string(indentation + 2, ' ');
         for (ArrConstIter it = ArrBegin(); it != ArrEnd(); it++){
           tmp += it->toPrettyString(indentation + 2);
@@ -816,7 +1127,7 @@ std::string JSON::Value::toPrettyString(int indentation) const{
       break;
     }
     case OBJECT: {
-      if (objVal.size() > 0){
+      if (size() > 0){
         bool shortMode = false;
         if (size() <= 3 && isMember("len")){
           shortMode = true;
@@ -849,20 +1160,18 @@ std::string JSON::Value::toPrettyString(int indentation) const{
 /// Turns this value into an array if it is not already one.
 void JSON::Value::append(const JSON::Value & rhs){
   if (myType != ARRAY){
-    null();
-    myType = ARRAY;
+    setType(ARRAY);
   }
-  arrVal.push_back(rhs);
+  arrVal->push_back(rhs);
 }
 
 /// Prepends the given value to the beginning of this JSON::Value array.
 /// Turns this value into an array if it is not already one.
 void JSON::Value::prepend(const JSON::Value & rhs){
   if (myType != ARRAY){
-    null();
-    myType = ARRAY;
+    setType(ARRAY);
   }
-  arrVal.push_front(rhs);
+  arrVal->push_front(rhs);
 }
 
 /// For array and object JSON::Value objects, reduces them
@@ -873,29 +1182,51 @@ void JSON::Value::prepend(const JSON::Value & rhs){
 /// given size.
 void JSON::Value::shrink(unsigned int size){
   if (myType == ARRAY){
-    while (arrVal.size() > size){
-      arrVal.pop_front();
+    while (arrVal->size() > size){
+      arrVal->pop_front();
     }
     return;
   }
   if (myType == OBJECT){
-    while (objVal.size() > size){
-      objVal.erase(objVal.begin());
+    if (objVal->members.size() > size){
+      unsigned int removed = objVal->members.size() - size;
+      for (unsigned int i = 0; i < removed; i++){
+        deleteNode(objVal->members[i]);
+      }
+      objVal->members.erase(objVal->members.begin(), objVal->members.begin() + removed);
     }
     return;
   }
 }
 
+/// Exchanges the contents of this JSON::Value with the given JSON::Value.
+/// No values are copied, making this a cheap way to move a value into place.
+void JSON::Value::swap(JSON::Value & rhs){
+  ValueType tmpType = myType;
+  myType = rhs.myType;
+  rhs.myType = tmpType;
+  long long int tmpInt = intVal;
+  intVal = rhs.intVal;
+  rhs.intVal = tmpInt;
+}
+
 /// For object JSON::Value objects, removes the member with
 /// the given name, if it exists. Has no effect otherwise.
 void JSON::Value::removeMember(const std::string & name){
-  objVal.erase(name);
+  if (myType != OBJECT){
+    return;
+  }
+  MemberList::iterator it = std::lower_bound(objVal->members.begin(), objVal->members.end(), name, memberOrder());
+  if (it != objVal->members.end() && ( *it)->first == name){
+    deleteNode( *it);
+    objVal->members.erase(it);
+  }
 }
 
 /// For object JSON::Value objects, returns true if the
 /// given name is a member. Returns false otherwise.
 bool JSON::Value::isMember(const std::string & name) const{
-  return objVal.count(name) > 0;
+  return myType == OBJECT && findMember(objVal->members, name) != objVal->members.end();
 }
 
 /// Returns true if this object is an integer.
@@ -930,55 +1261,73 @@ bool JSON::Value::isNull() const{
 
 /// Returns an iterator to the begin of the object map, if any.
 JSON::ObjIter JSON::Value::ObjBegin(){
-  return objVal.begin();
+  return (myType == OBJECT) ? objVal->members.begin() : emptyMembers.begin();
 }
 
 /// Returns an iterator to the end of the object map, if any.
 JSON::ObjIter JSON::Value::ObjEnd(){
-  return objVal.end();
+  return (myType == OBJECT) ? objVal->members.end() : emptyMembers.end();
 }
 
 /// Returns an iterator to the begin of the array, if any.
 JSON::ArrIter JSON::Value::ArrBegin(){
-  return arrVal.begin();
+  return (myType == ARRAY) ? arrVal->begin() : emptyArray.begin();
 }
 
 /// Returns an iterator to the end of the array, if any.
 JSON::ArrIter JSON::Value::ArrEnd(){
-  return arrVal.end();
+  return (myType == ARRAY) ? arrVal->end() : emptyArray.end();
 }
 
 /// Returns an iterator to the begin of the object map, if any.
 JSON::ObjConstIter JSON::Value::ObjBegin() const{
-  return objVal.begin();
+  const MemberList & members = (myType == OBJECT) ? objVal->members : emptyMembers;
+  return members.begin();
 }
 
 /// Returns an iterator to the end of the object map, if any.
 JSON::ObjConstIter JSON::Value::ObjEnd() const{
-  return objVal.end();
+  const MemberList & members = (myType == OBJECT) ? objVal->members : emptyMembers;
+  return members.end();
 }
 
 /// Returns an iterator to the begin of the array, if any.
 JSON::ArrConstIter JSON::Value::ArrBegin() const{
-  return arrVal.begin();
+  return (myType == ARRAY) ? arrVal->begin() : emptyArray.begin();
 }
 
 /// Returns an iterator to the end of the array, if any.
 JSON::ArrConstIter JSON::Value::ArrEnd() const{
-  return arrVal.end();
+  return (myType == ARRAY) ? arrVal->end() : emptyArray.end();
 }
 
 /// Returns the total of the objects and array size combined.
 unsigned int JSON::Value::size() const{
-  return objVal.size() + arrVal.size();
+  if (myType == OBJECT){
+    return objVal->members.size();
+  }
+  if (myType == ARRAY){
+    return arrVal->size();
+  }
+  return 0;
 }
 
 /// Completely clears the contents of this value,
 /// changing its type to NULL in the process.
 void JSON::Value::null(){
-  objVal.clear();
-  arrVal.clear();
-  strVal.clear();
+  switch (myType){
+    case STRING:
+      deleteNode(strVal);
+      break;
+    case ARRAY:
+      deleteNode(arrVal);
+      break;
+    case OBJECT:
+      deleteNode(objVal);
+      break;
+    default:
+      break;
+  }
   intVal = 0;
   myType = EMPTY;
 }
@@ -998,23 +1347,20 @@ JSON::Value JSON::fromFile(std::string filename){
   return ret;
 }
 
-/// Parses a single DTMI type - used recursively by the JSON::fromDTMI functions.
+/// Parses a single DTMI type into result - used recursively by the JSON::fromDTMI functions.
+/// Members and elements are parsed straight into their place in the tree, so nothing is copied.
 /// This function updates i every call with the new position in the data.
-/// \param data The raw data to parse.
-/// \param len The size of the raw data.
-/// \param i Current parsing position in the raw data (defaults to 0).
-/// \returns A single JSON::Value, parsed from the raw data.
-JSON::Value JSON::fromDTMI(const unsigned char * data, unsigned int len, unsigned int &i){
+static void parseDTMI(const unsigned char * data, unsigned int len, unsigned int &i, JSON::Value & result){
 #if DEBUG >= 10
   fprintf(stderr, "Note: AMF type %hhx found. %i bytes left\n", data[i], len-i);
 #endif
   if (i >= len){
-    return JSON::Value();
+    return;
   }
   switch (data[i]){
     case 0x01: { //integer
       if (i+8 >= len){
-        return JSON::Value();
+        return;
       }
       unsigned char tmpdbl[8];
       tmpdbl[7] = data[i + 1];
@@ -1027,55 +1373,64 @@ JSON::Value JSON::fromDTMI(const unsigned char * data, unsigned int len, unsigne
       tmpdbl[0] = data[i + 8];
       i += 9; //skip 8(an uint64_t)+1 forwards
       uint64_t * d = (uint64_t*)tmpdbl;
-      return JSON::Value((long long int) *d);
-      break;
+      result = (long long int) *d;
+      return;
     }
     case 0x02: { //string
       if (i+4 >= len){
-        return JSON::Value();
+        return;
       }
       unsigned int tmpi = data[i + 1] * 256 * 256 * 256 + data[i + 2] * 256 * 256 + data[i + 3] * 256 + data[i + 4]; //set tmpi to UTF-8-long length
-      std::string tmpstr = std::string((const char *)data + i + 5, (size_t)tmpi); //set the string data
       if (i+4+tmpi >= len){
-        return JSON::Value();
+        return;
       }
+      result = std::string((const char *)data + i + 5, (size_t)tmpi); //set the string data
       i += tmpi + 5; //skip length+size+1 forwards
-      return JSON::Value(tmpstr);
-      break;
+      return;
     }
     case 0xFF: //also object
     case 0xE0: { //object
       ++i;
-      JSON::Value ret;
       while (data[i] + data[i + 1] != 0 && i < len){ //while not encountering 0x0000 (we assume 0x0000EE)
         if (i+2 >= len){
-          return JSON::Value();
+          result.null();
+          return;
         }
         unsigned int tmpi = data[i] * 256 + data[i + 1]; //set tmpi to the UTF-8 length
         std::string tmpstr = std::string((const char *)data + i + 2, (size_t)tmpi); //set the string data
         i += tmpi + 2; //skip length+size forwards
-        ret[tmpstr] = fromDTMI(data, len, i); //add content, recursively parsed, updating i, setting indice to tmpstr
+        JSON::Value & member = result[tmpstr];
+        member.null();
+        parseDTMI(data, len, i, member); //add content, recursively parsed, updating i, setting indice to tmpstr
       }
       i += 3; //skip 0x0000EE
-      return ret;
-      break;
+      return;
     }
     case 0x0A: { //array
-      JSON::Value ret;
       ++i;
       while (data[i] + data[i + 1] != 0 && i < len){ //while not encountering 0x0000 (we assume 0x0000EE)
-        ret.append(fromDTMI(data, len, i)); //add content, recursively parsed, updating i
+        parseDTMI(data, len, i, result[result.size()]); //add content, recursively parsed, updating i
       }
       i += 3; //skip 0x0000EE
-      return ret;
-      break;
+      return;
     }
   }
 #if DEBUG >= 2
   fprintf(stderr, "Error: Unimplemented DTMI type %hhx, @ %i / %i - returning.\n", data[i], i, len);
 #endif
   i += 1;
-  return JSON::Value();
+}
+
+/// Parses a single DTMI type - used recursively by the JSON::fromDTMI functions.
+/// This function updates i every call with the new position in the data.
+/// \param data The raw data to parse.
+/// \param len The size of the raw data.
+/// \param i Current parsing position in the raw data (defaults to 0).
+/// \returns A single JSON::Value, parsed from the raw data.
+JSON::Value JSON::fromDTMI(const unsigned char * data, unsigned int len, unsigned int &i){
+  JSON::Value ret;
+  parseDTMI(data, len, i, ret);
+  return ret;
 } //fromOneDTMI
 
 /// Parses a std::string to a valid JSON::Value.
@@ -1109,3 +1464,251 @@ JSON::Value JSON::fromDTMI2(const unsigned char * data, unsigned int len, unsign
   tmp["trackid"] = tmpTrackID;
   return tmp;
 }
+
+/// Returns a pointer to the byte after the DTMI value starting at p, or NULL if the value does not fit before end.
+static const char * skipDTMI(const char * p, const char * end){
+  if (p >= end){
+    return 0;
+  }
+  switch ((unsigned char)p[0]){
+    case 0x01: //integer
+      return (p + 9 <= end) ? p + 9 : 0;
+    case 0x02: { //string
+      if (p + 5 > end){
+        return 0;
+      }
+      unsigned int strLen = ntohl(*(const uint32_t *)(p + 1));
+      if ((unsigned int)(end - p - 5) < strLen){
+        return 0;
+      }
+      return p + 5 + strLen;
+    }
+    case 0xFF: //also object
+    case 0xE0: { //object
+      p++;
+      while (p + 2 <= end && (p[0] || p[1])){
+        unsigned int nameLen = ((unsigned char)p[0] << 8) | (unsigned char)p[1];
+        p += 2 + nameLen;
+        p = skipDTMI(p, end);
+        if ( !p){
+          return 0;
+        }
+      }
+      return (p + 3 <= end) ? p + 3 : 0;
+    }
+    case 0x0A: { //array
+      p++;
+      while (p + 2 <= end && (p[0] || p[1])){
+        p = skipDTMI(p, end);
+        if ( !p){
+          return 0;
+        }
+      }
+      return (p + 3 <= end) ? p + 3 : 0;
+    }
+  }
+  return 0;
+}
+
+/// Creates a null view.
+JSON::View::View(){
+  data = 0;
+  dataLen = 0;
+}
+
+/// Creates a view of the DTMI value at data, which may use at most len bytes.
+/// Nothing is copied: the memory must stay valid for as long as this view is used.
+JSON::View::View(const char * data, unsigned int len){
+  this->data = len ? data : 0;
+  dataLen = data ? len : 0;
+}
+
+/// Returns true if this view is not null.
+JSON::View::operator bool() const{
+  return getType() != EMPTY;
+}
+
+/// Returns the type of the viewed value. Integers and strings that do not fit in the data are EMPTY.
+/// Objects and arrays are only checked while walking them.
+JSON::ValueType JSON::View::getType() const{
+  if ( !data){
+    return EMPTY;
+  }
+  switch ((unsigned char)data[0]){
+    case 0x01:
+      return (dataLen >= 9) ? INTEGER : EMPTY;
+    case 0x02:
+      return (dataLen >= 5 && ntohl(*(const uint32_t *)(data + 1)) <= dataLen - 5) ? STRING : EMPTY;
+    case 0xFF:
+    case 0xE0:
+      return OBJECT;
+    case 0x0A:
+      return ARRAY;
+  }
+  return EMPTY;
+}
+
+/// Returns true if the viewed value is an integer.
+bool JSON::View::isInt() const{
+  return getType() == INTEGER;
+}
+
+/// Returns true if the viewed value is a string.
+bool JSON::View::isString() const{
+  return getType() == STRING;
+}
+
+/// Returns true if the viewed value is an object.
+bool JSON::View::isObject() const{
+  return getType() == OBJECT;
+}
+
+/// Returns true if the viewed value is an array.
+bool JSON::View::isArray() const{
+  return getType() == ARRAY;
+}
+
+/// Returns true if this view is null.
+bool JSON::View::isNull() const{
+  return getType() == EMPTY;
+}
+
+/// Returns a pointer to the start of the viewed value, at its type byte.
+const char * JSON::View::getData() const{
+  return data;
+}
+
+/// Returns the size in bytes of the viewed value, walking it if it is an object or array.
+/// Returns 0 if the value does not fit in the data.
+unsigned int JSON::View::getSize() const{
+  const char * end = skipDTMI(data, data + dataLen);
+  return end ? end - data : 0;
+}
+
+/// Returns the viewed integer, or 0 if it is not an integer.
+long long int JSON::View::asInt() const{
+  if ( !isInt()){
+    return 0;
+  }
+  long long unsigned int result = 0;
+  for (unsigned int i = 1; i < 9; i++){
+    result = (result << 8) | (unsigned char)data[i];
+  }
+  return result;
+}
+
+/// Points str to the viewed string and sets len to its length, without copying.
+/// \returns True if the value is a string, false otherwise.
+bool JSON::View::getString(const char * & str, unsigned int & len) const{
+  if ( !isString()){
+    return false;
+  }
+  str = data + 5;
+  len = ntohl(*(const uint32_t *)(data + 1));
+  return true;
+}
+
+/// Returns a copy of the viewed string, or the decimal form of the viewed integer.
+/// Returns an empty string for all other types.
+std::string JSON::View::asString() const{
+  const char * str = 0;
+  unsigned int len = 0;
+  if (getString(str, len)){
+    return std::string(str, len);
+  }
+  if (isInt()){
+    std::stringstream st;
+    st << asInt();
+    return st.str();
+  }
+  return "";
+}
+
+/// Returns true if the viewed value is an object with a member of the given name.
+bool JSON::View::isMember(const char * name) const{
+  return getMember(name).getData() != 0;
+}
+
+/// Returns a view of the member of the viewed object with the given name.
+/// Returns a null view if there is no such member or the value is not an object.
+JSON::View JSON::View::getMember(const char * name) const{
+  if ( !isObject()){
+    return View();
+  }
+  const char * p = data + 1;
+  const char * end = data + dataLen;
+  unsigned int wantLen = strlen(name);
+  while (p + 2 <= end && (p[0] || p[1])){
+    unsigned int nameLen = ((unsigned char)p[0] << 8) | (unsigned char)p[1];
+    const char * value = p + 2 + nameLen;
+    if (value >= end){
+      return View();
+    }
+    if (nameLen == wantLen && !memcmp(p + 2, name, nameLen)){
+      return View(value, end - value);
+    }
+    p = skipDTMI(value, end);
+    if ( !p){
+      return View();
+    }
+  }
+  return View();
+}
+
+/// Returns a view of the member of the viewed object with the given name, see getMember().
+JSON::View JSON::View::operator[](const char * name) const{
+  return getMember(name);
+}
+
+/// Returns a view of element i of the viewed array.
+/// Returns a null view if there is no such element or the value is not an array.
+JSON::View JSON::View::operator[](unsigned int i) const{
+  if ( !isArray()){
+    return View();
+  }
+  const char * p = data + 1;
+  const char * end = data + dataLen;
+  while (p + 2 <= end && (p[0] || p[1])){
+    if ( !i){
+      return View(p, end - p);
+    }
+    p = skipDTMI(p, end);
+    if ( !p){
+      return View();
+    }
+    i--;
+  }
+  return View();
+}
+
+/// Returns the amount of members of the viewed object or elements of the viewed array, or 0 for other types.
+unsigned int JSON::View::size() const{
+  ValueType type = getType();
+  if (type != OBJECT && type != ARRAY){
+    return 0;
+  }
+  unsigned int count = 0;
+  const char * p = data + 1;
+  const char * end = data + dataLen;
+  while (p + 2 <= end && (p[0] || p[1])){
+    if (type == OBJECT){
+      p += 2 + (((unsigned char)p[0] << 8) | (unsigned char)p[1]);
+    }
+    p = skipDTMI(p, end);
+    if ( !p){
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+/// Parses the viewed value into a JSON::Value, copying all of it.
+JSON::Value JSON::View::toJSON() const{
+  unsigned int size = getSize();
+  if ( !size){
+    return JSON::Value();
+  }
+  unsigned int i = 0;
+  return fromDTMI((const unsigned char *)data, size, i);
+}
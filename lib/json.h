@@ -4,8 +4,11 @@
 #include <string>
 #include <deque>
 #include <map>
+#include <iterator>
 #include <istream>
 #include <vector>
+#include <new> //for placement new
+#include <cstddef> //for ptrdiff_t
 #include "socket.h"
 
 //empty definition of DTSC::Stream so it can be a friend.
@@ -24,24 +27,162 @@ namespace JSON {
   class Value;
   //forward declaration for below typedef
 
-  typedef std::map<std::string, Value>::iterator ObjIter;
-  typedef std::deque<Value>::iterator ArrIter;
-  typedef std::map<std::string, Value>::const_iterator ObjConstIter;
-  typedef std::deque<Value>::const_iterator ArrConstIter;
-  
+  void * allocNode(size_t size);
+  void freeNode(void * ptr);
+
+  /// While an Arena exists, the containers of all JSON::Value objects built or changed on the thread that created it
+  /// take their memory from large blocks owned by the arena, instead of from the heap one node at a time.
+  /// Create one around calls to fromDTMI, fromString or fromFile that build big trees, such as DTSC headers.
+  /// Freeing nodes from an arena only counts them: the blocks are released together, once the arena is gone
+  /// and every value that uses them was destroyed. Keep arenas short-lived, since any value changed while one
+  /// exists keeps its blocks alive. Arenas may be nested, the innermost one is used.
+  class Arena{
+    public:
+      Arena();
+      ~Arena();
+      static void setEnabled(bool enabled);
+    private:
+      Arena(const Arena & rhs);
+      Arena & operator=(const Arena & rhs);
+      void * blocks; ///< The blocks of this arena, or NULL if arenas are disabled.
+      void * previous; ///< The blocks of the arena that was in use when this one was created.
+  };
+
+  /// STL allocator for the containers of JSON::Value, using the arena of the current thread if there is one.
+  /// Every node records where it came from, so nodes from an arena and from the heap can be mixed freely.
+  template <typename T>
+  class Allocator{
+    public:
+      typedef T value_type;
+      typedef T * pointer;
+      typedef const T * const_pointer;
+      typedef T & reference;
+      typedef const T & const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+      template <typename U>
+      struct rebind{
+        typedef Allocator<U> other;
+      };
+      Allocator(){}
+      Allocator(const Allocator &){}
+      template <typename U>
+      Allocator(const Allocator<U> &){}
+      pointer address(reference x) const{
+        return &x;
+      }
+      const_pointer address(const_reference x) const{
+        return &x;
+      }
+      pointer allocate(size_type n, const void * = 0){
+        return (pointer)allocNode(n * sizeof(T));
+      }
+      void deallocate(pointer p, size_type){
+        freeNode(p);
+      }
+      size_type max_size() const{
+        return ((size_t)-1) / sizeof(T);
+      }
+      void construct(pointer p, const T & val){
+        new ((void *)p) T(val);
+      }
+      void destroy(pointer p){
+        p->~T();
+      }
+      bool operator==(const Allocator &) const{
+        return true;
+      }
+      bool operator!=(const Allocator &) const{
+        return false;
+      }
+  };
+
+  typedef std::pair<const std::string, Value> Member;
+  typedef std::vector<Member *, Allocator<Member *> > MemberList;
+  typedef std::deque<Value, Allocator<Value> > ArrList;
+
+  /// Iterates over the members of an object JSON::Value in order of their names, like a std::map iterator would.
+  /// Members are kept as a sorted list of pointers, so this dereferences twice.
+  template <typename M, typename I>
+  class MemberIterator{
+    public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef M value_type;
+      typedef ptrdiff_t difference_type;
+      typedef M * pointer;
+      typedef M & reference;
+      MemberIterator(){}
+      MemberIterator(const I & pos) : pos(pos){}
+      template <typename N, typename J>
+      MemberIterator(const MemberIterator<N, J> & rhs) : pos(rhs.base()){}
+      const I & base() const{
+        return pos;
+      }
+      reference operator*() const{
+        return **pos;
+      }
+      pointer operator->() const{
+        return *pos;
+      }
+      MemberIterator & operator++(){
+        ++pos;
+        return *this;
+      }
+      MemberIterator operator++(int){
+        MemberIterator tmp = *this;
+        ++pos;
+        return tmp;
+      }
+      MemberIterator & operator--(){
+        --pos;
+        return *this;
+      }
+      MemberIterator operator--(int){
+        MemberIterator tmp = *this;
+        --pos;
+        return tmp;
+      }
+      template <typename N, typename J>
+      bool operator==(const MemberIterator<N, J> & rhs) const{
+        return pos == rhs.base();
+      }
+      template <typename N, typename J>
+      bool operator!=(const MemberIterator<N, J> & rhs) const{
+        return pos != rhs.base();
+      }
+    private:
+      I pos; ///< Position in the member list.
+  };
+
+  typedef MemberIterator<Member, MemberList::iterator> ObjIter;
+  typedef ArrList::iterator ArrIter;
+  typedef MemberIterator<const Member, MemberList::const_iterator> ObjConstIter;
+  typedef ArrList::const_iterator ArrConstIter;
+
   /// A JSON::Value is either a string or an integer, but may also be an object, array or null.
   class Value{
     private:
+      struct ObjData;
+      class SendList;
       ValueType myType;
-      long long int intVal;
-      std::string strVal;
-      std::deque<Value> arrVal;
-      std::map<std::string, Value> objVal;
+      /// Only the member for myType is used: integers and booleans are held inline, everything else in a node of its own.
+      union{
+        long long int intVal;
+        std::string * strVal;
+        ArrList * arrVal;
+        ObjData * objVal;
+      };
+      void setType(ValueType type);
+      unsigned int packedSize(const char * const * skip) const;
+      char * packTo(char * p, const char * const * skip = 0) const;
+      void gather(SendList & list) const;
     public:
       //friends
       friend class DTSC::Stream; //for access to strVal
       //constructors
       Value();
+      Value(const Value & rhs);
+      ~Value();
       Value(std::istream & fromstream);
       Value(const std::string & val);
       Value(const char * val);
@@ -51,6 +192,7 @@ namespace JSON {
       bool operator==(const Value &rhs) const;
       bool operator!=(const Value &rhs) const;
       //assignment operators
+      Value & operator=(const Value &rhs);
       Value & operator=(const std::string &rhs);
       Value & operator=(const char * rhs);
       Value & operator=(const long long int &rhs);
@@ -84,6 +226,7 @@ namespace JSON {
       void append(const Value & rhs);
       void prepend(const Value & rhs);
       void shrink(unsigned int size);
+      void swap(Value & rhs);
       void removeMember(const std::string & name);
       bool isMember(const std::string & name) const;
       bool isInt() const;
@@ -104,6 +247,37 @@ namespace JSON {
       void null();
   };
 
+  /// A read-only view of a single DTMI value in memory it does not own, such as the object in a DTSC packet.
+  /// Nothing is copied or allocated: members are found by walking the data when they are asked for,
+  /// integers are decoded in place and strings are given as a pointer and length into the data.
+  /// Use toJSON() when a JSON::Value copy is really needed.
+  class View{
+    public:
+      View();
+      View(const char * data, unsigned int len);
+      operator bool() const;
+      ValueType getType() const;
+      bool isInt() const;
+      bool isString() const;
+      bool isObject() const;
+      bool isArray() const;
+      bool isNull() const;
+      const char * getData() const;
+      unsigned int getSize() const;
+      long long int asInt() const;
+      bool getString(const char * & str, unsigned int & len) const;
+      std::string asString() const;
+      bool isMember(const char * name) const;
+      View getMember(const char * name) const;
+      View operator[](const char * name) const;
+      View operator[](unsigned int i) const;
+      unsigned int size() const;
+      Value toJSON() const;
+    private:
+      const char * data; ///< Start of the value, or NULL for a null view.
+      unsigned int dataLen; ///< Amount of bytes readable from data on, the value itself may be shorter.
+  };
+
   Value fromDTMI2(std::string data);
   Value fromDTMI2(const unsigned char * data, unsigned int len, unsigned int &i);
   Value fromDTMI(std::string data);
@@ -0,0 +1,212 @@
+/// \file prefetch.cpp
+/// Holds all code for reading file data ahead of playback.
+
+#include "prefetch.h"
+#include <algorithm> //for std::sort
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+static const unsigned int prefetchChunk = 256 * 1024; ///< Largest amount of bytes read at once.
+static const long long int defaultLeadBytes = 1024 * 1024; ///< Lead in bytes used while the bitrate is not known yet.
+
+/// Orders byte ranges by their start.
+static bool rangeBefore(const Util::byteRange & a, const Util::byteRange & b){
+  return a.start < b.start;
+}
+
+/// Creates an idle prefetcher.
+Util::Prefetcher::Prefetcher(){
+  fd = -1;
+  leadMs = 0;
+  stopping = false;
+  ratePos = -1;
+  rateMs = 0;
+  lastPos = 0;
+  lastMs = 0;
+  updatedPos = -1;
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&workCond, 0);
+}
+
+/// Stops the prefetcher, if running.
+Util::Prefetcher::~Prefetcher(){
+  stop();
+  pthread_cond_destroy(&workCond);
+  pthread_mutex_destroy(&lock);
+}
+
+/// Starts reading ahead in the given file, on a duplicate of its descriptor.
+/// leadMs is how far ahead of playback, in milliseconds of media, the consumer wants data to be read.
+/// \returns True if the prefetcher is running, false otherwise.
+bool Util::Prefetcher::start(int fd, unsigned int leadMs){
+  stop();
+  this->leadMs = leadMs;
+  this->fd = dup(fd);
+  if (this->fd == -1){
+    return false;
+  }
+  stopping = false;
+  wanted.clear();
+  fetched.clear();
+  ratePos = -1;
+  updatedPos = -1;
+  if (pthread_create(&thread, 0, fetchThread, this) != 0){
+    fprintf(stderr, "Could not start prefetch thread\n");
+    close(this->fd);
+    this->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+/// Stops the thread and closes the duplicated descriptor.
+void Util::Prefetcher::stop(){
+  if (fd == -1){
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&workCond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, 0);
+  close(fd);
+  fd = -1;
+}
+
+/// Returns true if the prefetcher is running.
+Util::Prefetcher::operator bool() const{
+  return fd != -1;
+}
+
+/// Returns the lead in milliseconds of media this prefetcher was started with.
+unsigned int Util::Prefetcher::getLead() const{
+  return leadMs;
+}
+
+/// Replaces the ranges to read ahead with the given ones, which are read in the order given.
+/// Everything before the start of the earliest range is considered consumed and forgotten.
+void Util::Prefetcher::want(const std::vector<byteRange> & ranges){
+  pthread_mutex_lock(&lock);
+  wanted = ranges;
+  if (wanted.size()){
+    long long int consumed = wanted[0].start;
+    for (unsigned int i = 1; i < wanted.size(); i++){
+      if (wanted[i].start < consumed){
+        consumed = wanted[i].start;
+      }
+    }
+    while (fetched.size() && fetched[0].end <= consumed){
+      fetched.erase(fetched.begin());
+    }
+  }
+  pthread_cond_signal(&workCond);
+  pthread_mutex_unlock(&lock);
+}
+
+/// Reports that playback reached bytePos, holding media time ms, for consumers that read a file sequentially.
+/// The bitrate seen since the last seek is used to turn the lead time into bytes to read ahead of bytePos.
+/// The wanted range is only updated after a quarter of the lead has been consumed, so this is cheap to call for every packet.
+void Util::Prefetcher::progress(long long int bytePos, long long unsigned int ms){
+  if (fd == -1){
+    return;
+  }
+  if (ratePos < 0 || bytePos < lastPos || ms < lastMs){
+    //first call or a seek: start estimating again
+    ratePos = bytePos;
+    rateMs = ms;
+    updatedPos = -1;
+  }
+  lastPos = bytePos;
+  lastMs = ms;
+  long long int leadBytes = defaultLeadBytes;
+  if (ms > rateMs){
+    leadBytes = (bytePos - ratePos) * (long long int)leadMs / (long long int)(ms - rateMs);
+    if (leadBytes < prefetchChunk){
+      leadBytes = prefetchChunk;
+    }
+  }
+  if (updatedPos >= 0 && bytePos < updatedPos + leadBytes / 4){
+    return;
+  }
+  updatedPos = bytePos;
+  std::vector<byteRange> ranges(1);
+  ranges[0].start = bytePos;
+  ranges[0].end = bytePos + leadBytes;
+  want(ranges);
+}
+
+/// Thread entry point, runs fetchLoop() for the prefetcher given as arg.
+void * Util::Prefetcher::fetchThread(void * arg){
+  ((Prefetcher *)arg)->fetchLoop();
+  return 0;
+}
+
+/// Finds the first part of the wanted ranges that was not read yet, at most prefetchChunk bytes long.
+/// Must be called with the lock held.
+/// \returns True if there is such a part, false if everything wanted was read.
+bool Util::Prefetcher::nextGap(byteRange & gap){
+  for (std::vector<byteRange>::iterator it = wanted.begin(); it != wanted.end(); it++){
+    long long int pos = it->start;
+    long long int gapEnd = it->end;
+    for (std::vector<byteRange>::iterator done = fetched.begin(); done != fetched.end() && pos < it->end; done++){
+      if (done->end <= pos){
+        continue;
+      }
+      if (done->start > pos){
+        gapEnd = std::min(it->end, done->start);
+        break;
+      }
+      pos = done->end;
+    }
+    if (pos < it->end){
+      gap.start = pos;
+      gap.end = std::min(gapEnd, pos + prefetchChunk);
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Adds range to the ranges read, merging it with any it touches. Must be called with the lock held.
+void Util::Prefetcher::addFetched(const byteRange & range){
+  fetched.push_back(range);
+  std::sort(fetched.begin(), fetched.end(), rangeBefore);
+  std::vector<byteRange> merged;
+  for (std::vector<byteRange>::iterator it = fetched.begin(); it != fetched.end(); it++){
+    if (merged.size() && it->start <= merged.back().end){
+      merged.back().end = std::max(merged.back().end, it->end);
+    }else{
+      merged.push_back(*it);
+    }
+  }
+  fetched.swap(merged);
+}
+
+/// Reads the wanted ranges into a scratch buffer, which leaves them in the page cache, until stopped.
+void Util::Prefetcher::fetchLoop(){
+  char * scratch = (char *)malloc(prefetchChunk);
+  if ( !scratch){
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  while (true){
+    byteRange gap;
+    while ( !stopping && !nextGap(gap)){
+      pthread_cond_wait(&workCond, &lock);
+    }
+    if (stopping){
+      break;
+    }
+    pthread_mutex_unlock(&lock);
+    ssize_t ret = pread(fd, scratch, gap.end - gap.start, gap.start);
+    pthread_mutex_lock(&lock);
+    //errors and the end of the file also count as read, so they are not retried over and over
+    if (ret > 0){
+      gap.end = gap.start + ret;
+    }
+    addFetched(gap);
+  }
+  pthread_mutex_unlock(&lock);
+  free(scratch);
+}
@@ -0,0 +1,52 @@
+/// \file prefetch.h
+/// Holds headers for reading file data ahead of playback.
+
+#pragma once
+#include <vector>
+#include <pthread.h>
+
+namespace Util {
+
+  /// A range of bytes in a file, from start up to but not including end.
+  struct byteRange{
+    long long int start;
+    long long int end;
+  };
+
+  /// Reads parts of a file on a background thread shortly before they are needed, so they are in the page cache
+  /// by the time the thread serving the file reads them.
+  /// The consumer either tells which byte ranges it will need next using want(),
+  /// or only reports its progress and lets the prefetcher estimate how many bytes make up the lead time.
+  class Prefetcher{
+    public:
+      Prefetcher();
+      ~Prefetcher();
+      bool start(int fd, unsigned int leadMs);
+      void stop();
+      operator bool() const;
+      unsigned int getLead() const;
+      void want(const std::vector<byteRange> & ranges);
+      void progress(long long int bytePos, long long unsigned int ms);
+    private:
+      Prefetcher(const Prefetcher & rhs);
+      Prefetcher & operator=(const Prefetcher & rhs);
+      static void * fetchThread(void * arg);
+      void fetchLoop();
+      bool nextGap(byteRange & gap);
+      void addFetched(const byteRange & range);
+      int fd; ///< Duplicate of the file descriptor being read, or -1.
+      unsigned int leadMs;
+      std::vector<byteRange> wanted; ///< Ranges the consumer needs next, in order of need.
+      std::vector<byteRange> fetched; ///< Sorted, non-overlapping ranges that were read already.
+      bool stopping;
+      long long int ratePos; ///< Byte position at the start of the bitrate estimate.
+      long long unsigned int rateMs; ///< Media time at the start of the bitrate estimate.
+      long long int lastPos; ///< Byte position last passed to progress().
+      long long unsigned int lastMs; ///< Media time last passed to progress().
+      long long int updatedPos; ///< Byte position at the last update of the wanted range by progress().
+      pthread_mutex_t lock;
+      pthread_cond_t workCond; ///< Signalled when the wanted ranges change or the prefetcher stops.
+      pthread_t thread;
+  };
+
+}
@@ -0,0 +1,115 @@
+/// \file shared_memory.cpp
+/// Holds all code for memory shared between processes.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h> //for mkstemp
+#include "shared_memory.h"
+#include "stream.h"
+
+/// Creates an empty, unmapped page.
+IPC::sharedPage::sharedPage(){
+  handle = -1;
+  mapped = 0;
+  len = 0;
+  master = false;
+}
+
+/// Creates a page and immediately maps it. See init() for the arguments.
+IPC::sharedPage::sharedPage(const std::string & name, unsigned int len, bool master){
+  handle = -1;
+  mapped = 0;
+  this->len = 0;
+  this->master = false;
+  init(name, len, master);
+}
+
+/// Unmaps the page, removing the file if this page is the master.
+IPC::sharedPage::~sharedPage(){
+  close();
+}
+
+/// Maps the file with the given name from the temporary folder into memory.
+/// A master creates a new file of len bytes and maps it read/write. The file is created under a temporary name
+/// and renamed into place once it has its full size, so it replaces any old file with that name instead of truncating it:
+/// processes that still have the old file mapped keep reading the old file, and never see it shrink.
+/// Others open the existing file read-only; if len is 0 the current file size is used.
+/// \returns True if the page is mapped, false otherwise. Reasons for failure are printed to stderr.
+bool IPC::sharedPage::init(const std::string & name, unsigned int len, bool master){
+  close();
+  this->name = name;
+  std::string path = Util::getTmpFolder() + name;
+  std::string tmpPath = path + ".XXXXXX";
+  if (master){
+    handle = mkstemp(&(tmpPath[0]));
+  }else{
+    handle = open(path.c_str(), O_RDONLY);
+  }
+  if (handle == -1){
+#if DEBUG >= 2
+    fprintf(stderr, "Could not open shared page %s: %s\n", path.c_str(), strerror(errno));
+#endif
+    return false;
+  }
+  if (master){
+    if (fchmod(handle, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 || ftruncate(handle, len) != 0 || rename(tmpPath.c_str(), path.c_str()) != 0){
+      fprintf(stderr, "Could not create shared page %s: %s\n", path.c_str(), strerror(errno));
+      unlink(tmpPath.c_str());
+      close();
+      return false;
+    }
+    this->master = true;
+  }else{
+    struct stat st;
+    if (fstat(handle, &st) != 0 || (len && (unsigned int)st.st_size < len)){
+      close();
+      return false;
+    }
+    if ( !len){
+      len = st.st_size;
+    }
+  }
+  void * result = mmap(0, len, (master ? PROT_READ | PROT_WRITE : PROT_READ), MAP_SHARED, handle, 0);
+  if (result == MAP_FAILED){
+    fprintf(stderr, "Could not map shared page %s: %s\n", path.c_str(), strerror(errno));
+    close();
+    return false;
+  }
+  mapped = (char *)result;
+  this->len = len;
+  return true;
+}
+
+/// Unmaps the page and closes the file.
+/// The master also removes the file, unless a newer master already replaced it.
+void IPC::sharedPage::close(){
+  if (mapped){
+    munmap(mapped, len);
+    mapped = 0;
+  }
+  if (handle != -1){
+    if (master){
+      std::string path = Util::getTmpFolder() + name;
+      struct stat ownSt;
+      struct stat pathSt;
+      if (fstat(handle, &ownSt) == 0 && stat(path.c_str(), &pathSt) == 0 && ownSt.st_dev == pathSt.st_dev && ownSt.st_ino == pathSt.st_ino){
+        unlink(path.c_str());
+      }
+    }
+    ::close(handle);
+    handle = -1;
+  }
+  master = false;
+  len = 0;
+}
+
+/// Returns true if the page is currently mapped.
+IPC::sharedPage::operator bool() const{
+  return mapped != 0;
+}
@@ -0,0 +1,31 @@
+/// \file shared_memory.h
+/// Holds headers for memory shared between processes.
+
+#pragma once
+#include <string>
+
+/// Contains inter-process communication code.
+namespace IPC {
+
+  /// A memory mapping of a file in the Mist temporary folder, shared between processes.
+  /// The master creates a fresh file, replacing any old one, and removes it again when it is destroyed.
+  /// All others map the existing file read-only.
+  class sharedPage{
+    public:
+      sharedPage();
+      sharedPage(const std::string & name, unsigned int len = 0, bool master = false);
+      ~sharedPage();
+      bool init(const std::string & name, unsigned int len = 0, bool master = false);
+      void close();
+      operator bool() const;
+      std::string name; ///< Name of the file in the temporary folder.
+      char * mapped; ///< Start of the mapped memory, or NULL if not mapped.
+      unsigned int len; ///< Length of the mapped memory.
+      bool master; ///< True if this page created the file.
+    private:
+      sharedPage(const sharedPage & rhs);
+      sharedPage & operator=(const sharedPage & rhs);
+      int handle; ///< File descriptor of the opened file, or -1.
+  };
+
+}
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <poll.h>
 #include <netdb.h>
+#include <limits.h> //for IOV_MAX
 #include <sstream>
 
 #ifdef __FreeBSD__
@@ -14,6 +15,9 @@
 #endif
 
 #define BUFFER_BLOCKSIZE 4096 //set buffer blocksize to 4KiB
+#ifndef IOV_MAX
+#define IOV_MAX 1024 //the smallest limit any supported system has
+#endif
 #include <iostream>//temporary for debugging
 
 std::string uint2string(unsigned int i){
@@ -455,6 +459,33 @@ void Socket::Connection::SendNow(const char * data, size_t len){
   if (!bing){setBlocking(false);}
 }
 
+/// Will not buffer anything but always send right away. Blocks.
+/// This will send the upbuffer (if non-empty) first, then the data of all count entries of vec, in order.
+/// The data is sent from where it is with as few system calls as possible, without copying it together first.
+/// Any data that could not be send will block until it can be send or the connection is severed.
+void Socket::Connection::SendNow(const struct iovec * vec, int count){
+  bool bing = isBlocking();
+  if (!bing){setBlocking(true);}
+  while (upbuffer.size() > 0 && connected()){
+    iwrite(upbuffer.get());
+  }
+  while (count > 0 && connected()){
+    int i = iwrite(vec, std::min(count, IOV_MAX));
+    while (count > 0 && (size_t)i >= vec->iov_len){
+      i -= vec->iov_len;
+      vec++;
+      count--;
+    }
+    if (count > 0 && i > 0){
+      //send the rest of a partially sent entry on its own
+      SendNow((const char *)vec->iov_base + i, vec->iov_len - i);
+      vec++;
+      count--;
+    }
+  }
+  if (!bing){setBlocking(false);}
+}
+
 /// Appends data to the upbuffer.
 /// This will attempt to send the upbuffer (if non-empty) first.
 /// If the upbuffer is empty before or after this attempt, it will attempt to send
@@ -550,6 +581,54 @@ int Socket::Connection::iwrite(const void * buffer, int len){
   return r;
 } //Socket::Connection::iwrite
 
+/// Incremental scatter-gather write call. This function tries to write the data of all count entries of vec
+/// to the socket in a single system call, returning the amount of bytes it actually wrote.
+/// \param vec The locations and sizes of the data to write, in order.
+/// \param count Amount of entries in vec, at most IOV_MAX.
+/// \returns The amount of bytes actually written.
+int Socket::Connection::iwrite(const struct iovec * vec, int count){
+  size_t len = 0;
+  for (int i = 0; i < count; i++){
+    len += vec[i].iov_len;
+  }
+  if ( !connected() || len < 1){
+    return 0;
+  }
+  int r;
+  if (sock >= 0){
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)vec;
+    msg.msg_iovlen = count;
+    r = sendmsg(sock, &msg, 0);
+  }else{
+    r = writev(pipes[0], vec, count);
+  }
+  if (r < 0){
+    switch (errno){
+      case EWOULDBLOCK:
+        return 0;
+        break;
+      default:
+        if (errno != EPIPE){
+          Error = true;
+          remotehost = strerror(errno);
+#if DEBUG >= 2
+          fprintf(stderr, "Could not iwrite data! Error: %s\n", remotehost.c_str());
+#endif
+        }
+        close();
+        return 0;
+        break;
+    }
+  }
+  if (r == 0 && (sock >= 0)){
+    close();
+  }
+  up += r;
+  return r;
+} //Socket::Connection::iwrite
+
 /// Incremental read call. This function tries to read len bytes to the buffer from the socket,
 /// returning the amount of bytes it actually read.
 /// \param buffer Location of the buffer to read to.
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -57,6 +58,7 @@ namespace Socket {
       int iwrite(const void * buffer, int len); ///< Incremental write call.
       bool iread(Buffer & buffer); ///< Incremental write call that is compatible with Socket::Buffer.
       bool iwrite(std::string & buffer); ///< Write call that is compatible with std::string.
+      int iwrite(const struct iovec * vec, int count); ///< Incremental scatter-gather write call.
     public:
       //friends
       friend class ::Buffer::user;
@@ -85,6 +87,7 @@ namespace Socket {
       void SendNow(const std::string & data); ///< Will not buffer anything but always send right away. Blocks.
       void SendNow(const char * data); ///< Will not buffer anything but always send right away. Blocks.
       void SendNow(const char * data, size_t len); ///< Will not buffer anything but always send right away. Blocks.
+      void SendNow(const struct iovec * vec, int count); ///< Will not buffer anything but always send right away. Blocks.
       //stats related methods
       unsigned int dataUp(); ///< Returns total amount of bytes sent.
       unsigned int dataDown(); ///< Returns total amount of bytes received.
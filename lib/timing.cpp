@@ -10,6 +10,7 @@
 #include <mach/clock.h>
 #include <mach/mach.h>
 #define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 0
 void clock_gettime(int ign, struct timespec * ts){
   clock_serv_t cclock;
   mach_timespec_t mts;
@@ -42,6 +43,14 @@ long long int Util::getMS(){
   return ((long long int)t.tv_sec) * 1000 + t.tv_nsec / 1000000;
 }
 
+/// Gets a monotonic time in nanoseconds, for measuring durations.
+/// The starting point is unspecified, only differences between two calls are meaningful.
+long long unsigned int Util::getNS(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((long long unsigned int)t.tv_sec) * 1000000000ull + t.tv_nsec;
+}
+
 /// Gets the amount of seconds since 01/01/1970.
 long long int Util::epoch(){
   return time(0);
@@ -6,5 +6,6 @@
 namespace Util {
   void sleep(int ms); ///< Sleeps for the indicated amount of milliseconds or longer.
   long long int getMS(); ///< Gets the current time in milliseconds.
+  long long unsigned int getNS(); ///< Gets a monotonic time in nanoseconds, for measuring durations.
   long long int epoch(); ///< Gets the amount of seconds since 01/01/1970.
 }
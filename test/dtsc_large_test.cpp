@@ -0,0 +1,167 @@
+/// \file dtsc_large_test.cpp
+/// Benchmarks DTSC::File on a synthetic file larger than 4GB, and checks that seeking past 2GB and 4GB works.
+/// Usage: dtsc_large_test [path [size in MiB]]. The file is created at path (dtsc_large_test.dtsc by default),
+/// 4352MiB by default, and removed again afterwards.
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <mist/dtsc.h>
+#include <mist/timing.h>
+
+static const unsigned int packetData = 256 * 1024; ///< Size of the data of each packet.
+static const unsigned int packetTime = 40; ///< Duration of each packet in ms.
+static const unsigned int keyInterval = 25; ///< Amount of packets per key.
+static const unsigned int seekCount = 500; ///< Amount of random seeks.
+
+/// Returns the amount of MiB per second for the given amount of bytes in the given amount of nanoseconds.
+static double mibPerSec(long long int bytes, long long unsigned int ns){
+  return ns ? ((double)bytes / (1024.0 * 1024.0)) / ((double)ns / 1000000000.0) : 0;
+}
+
+/// Builds the header for the given amount of packets, with a key every keyInterval packets at the byte positions in bpos.
+static std::string makeHeader(unsigned int packets, std::deque<long long int> & bpos){
+  JSON::Value meta;
+  JSON::Value & track = meta["tracks"]["video0"];
+  track["trackid"] = 1ll;
+  track["type"] = "video";
+  track["codec"] = "H264";
+  track["firstms"] = 0ll;
+  track["lastms"] = (long long int)(packets - 1) * packetTime;
+  for (unsigned int i = 0; i < packets; i += keyInterval){
+    JSON::Value key;
+    key["time"] = (long long int)i * packetTime;
+    key["num"] = (long long int)(i / keyInterval + 1);
+    key["bpos"] = (i / keyInterval < bpos.size()) ? bpos[i / keyInterval] : 0ll;
+    key["len"] = (long long int)keyInterval * packetTime;
+    track["keys"].append(key);
+  }
+  return meta.toPacked();
+}
+
+int main(int argc, char ** argv){
+  std::string path = argc > 1 ? argv[1] : "dtsc_large_test.dtsc";
+  long long int targetSize = (argc > 2 ? atoll(argv[2]) : 4352) * 1024 * 1024;
+  unsigned int packets = targetSize / (packetData + 64) + 1;
+  int failures = 0;
+
+  //write the file, with a header of the final size first and the real key positions once they are known
+  std::deque<long long int> bpos;
+  long long unsigned int start = Util::getNS();
+  {
+    DTSC::File out(path, true);
+    if ( !out){
+      return 1;
+    }
+    std::string header = makeHeader(packets, bpos);
+    out.writeHeader(header, true);
+    out.setWriteBuffer(4 * 1024 * 1024);
+    JSON::Value pack;
+    pack["trackid"] = 1ll;
+    pack["data"] = std::string(packetData, 'x');
+    for (unsigned int i = 0; i < packets; i++){
+      pack["time"] = (long long int)i * packetTime;
+      if (i % keyInterval == 0){
+        pack["keyframe"] = 1ll;
+        bpos.push_back(out.getBytePosEOF());
+      }else{
+        pack.removeMember("keyframe");
+      }
+      //the packed form is cached inside the value, so it has to be rebuilt after changing it
+      pack.netPrepare();
+      if ( !out.writePacket(pack)){
+        std::cerr << "Could not write packet " << i << std::endl;
+        return 1;
+      }
+    }
+    if ( !out.flush()){
+      std::cerr << "Could not flush file" << std::endl;
+      return 1;
+    }
+    header = makeHeader(packets, bpos);
+    if ( !out.writeHeader(header)){
+      std::cerr << "Could not rewrite header" << std::endl;
+      return 1;
+    }
+  }
+  long long unsigned int written = Util::getNS() - start;
+
+  start = Util::getNS();
+  DTSC::File in(path);
+  long long unsigned int opened = Util::getNS() - start;
+  long long int fileSize = in.getBytePosEOF();
+  std::cout << "File: " << fileSize << " bytes, " << packets << " packets" << std::endl;
+  std::cout << "Write: " << mibPerSec(fileSize, written) << " MiB/s" << std::endl;
+  std::cout << "Open (the index is not built for files modified this recently): " << opened / 1000000 << " ms" << std::endl;
+  if (fileSize <= 4ll * 1024 * 1024 * 1024 && argc <= 2){
+    std::cerr << "File is not larger than 4GB" << std::endl;
+    failures++;
+  }
+
+  //sequential reads, both from the mapping and through stdio, touching every page of every packet as sending it would
+  volatile unsigned int touched = 0;
+  std::set<int> selected;
+  selected.insert(1);
+  in.selectTracks(selected);
+  for (int mapped = 1; mapped >= 0; mapped--){
+    in.setMapped(mapped);
+    in.seek_time(0);
+    start = Util::getNS();
+    long long int bytes = 0;
+    unsigned int count = 0;
+    while (true){
+      in.seekNext();
+      const DTSC::Packet & pack = in.getPacketView();
+      if ( !pack){
+        break;
+      }
+      if (pack.getTime() != (long long unsigned int)count * packetTime){
+        failures++;
+      }
+      for (unsigned int i = 0; i < pack.getDataLen(); i += 4096){
+        touched += pack.getData()[i];
+      }
+      bytes += pack.getDataLen();
+      count++;
+    }
+    long long unsigned int took = Util::getNS() - start;
+    std::cout << "Sequential read (" << (mapped ? "mapped" : "stdio") << "): " << mibPerSec(bytes, took) << " MiB/s" << std::endl;
+    if (count != packets){
+      std::cerr << "Read " << count << " of " << packets << " packets" << std::endl;
+      failures++;
+    }
+  }
+
+  //random seeks, always including packets around 2GB and 4GB and the very last packet
+  srand(42);
+  in.setMapped(true);
+  long long unsigned int seekTotal = 0;
+  for (unsigned int i = 0; i < seekCount; i++){
+    unsigned int target = rand() % packets;
+    if (i < 3){
+      long long int limits[3] = {2ll * 1024 * 1024 * 1024, 4ll * 1024 * 1024 * 1024, fileSize};
+      target = (limits[i] - 8 - makeHeader(packets, bpos).size()) / (packetData + 64);
+      if (target >= packets){
+        target = packets - 1;
+      }
+    }
+    start = Util::getNS();
+    in.seek_time(target * packetTime);
+    in.seekNext();
+    seekTotal += Util::getNS() - start;
+    const DTSC::Packet & pack = in.getPacketView();
+    if ( !pack || pack.getTime() != (long long unsigned int)target * packetTime){
+      std::cerr << "Seek to " << target * packetTime << " ms failed" << std::endl;
+      failures++;
+    }
+  }
+  std::cout << "Seek: " << seekTotal / seekCount / 1000 << " us on average" << std::endl;
+
+  unlink(path.c_str());
+  unlink((path + ".dtsh").c_str());
+  if (failures){
+    std::cerr << failures << " failures" << std::endl;
+  }
+  return failures ? 1 : 0;
+}
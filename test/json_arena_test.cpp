@@ -0,0 +1,107 @@
+/// \file json_arena_test.cpp
+/// Benchmarks parsing and destroying a DTSC header with 100k keys, with JSON::Value trees allocated from the heap
+/// and from a JSON::Arena, and checks that both give the same tree.
+/// Usage: json_arena_test [amount of keys [rounds]]
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <mist/json.h>
+#include <mist/timing.h>
+
+/// Builds a header with one video and one audio track, holding the given amount of keys between them.
+static JSON::Value makeHeader(unsigned int keyCount){
+  JSON::Value meta;
+  const char * names[2] = {"video0", "audio0"};
+  for (unsigned int t = 0; t < 2; t++){
+    JSON::Value & track = meta["tracks"][names[t]];
+    track["trackid"] = (long long int)(t + 1);
+    track["type"] = (t ? "audio" : "video");
+    track["codec"] = (t ? "AAC" : "H264");
+    track["init"] = std::string(40, 'i');
+    unsigned int keys = (t ? keyCount - keyCount / 2 : keyCount / 2);
+    for (unsigned int i = 0; i < keys; i++){
+      JSON::Value key;
+      key["time"] = (long long int)i * 2000;
+      key["num"] = (long long int)i + 1;
+      key["len"] = 2000ll;
+      key["bpos"] = (long long int)i * 512000;
+      key["parts"] = std::string(100, 'p');
+      track["keys"].append(key);
+      if (i % 5 == 0){
+        JSON::Value frag;
+        frag["num"] = (long long int)i + 1;
+        frag["len"] = 5ll;
+        frag["dur"] = 10000ll;
+        frag["size"] = 2560000ll;
+        track["frags"].append(frag);
+      }
+    }
+    track["firstms"] = 0ll;
+    track["lastms"] = (long long int)keys * 2000;
+  }
+  return meta;
+}
+
+/// Parses data as DTMI when dtmi is true and as JSON text otherwise, rounds times,
+/// adding the time taken by parsing and by destroying the tree to parseNs and freeNs.
+/// \returns The tree parsed in the last round.
+static JSON::Value parseRounds(const std::string & data, bool dtmi, unsigned int rounds, long long unsigned int & parseNs, long long unsigned int & freeNs){
+  JSON::Value result;
+  for (unsigned int r = 0; r < rounds; r++){
+    JSON::Value * tree = new JSON::Value();
+    long long unsigned int start = Util::getNS();
+    {
+      JSON::Arena arena;
+      JSON::Value parsed = dtmi ? JSON::fromDTMI(data) : JSON::fromString(data);
+      tree->swap(parsed);
+    }
+    parseNs += Util::getNS() - start;
+    if (r + 1 == rounds){
+      result.swap(*tree);
+    }
+    start = Util::getNS();
+    delete tree;
+    freeNs += Util::getNS() - start;
+  }
+  return result;
+}
+
+int main(int argc, char ** argv){
+  unsigned int keyCount = argc > 1 ? atoi(argv[1]) : 100000;
+  unsigned int rounds = argc > 2 ? atoi(argv[2]) : 3;
+  if ( !rounds){
+    rounds = 1;
+  }
+  int failures = 0;
+  JSON::Value header = makeHeader(keyCount);
+  std::string packed = header.toPacked();
+  std::string text = header.toString();
+  std::cout << keyCount << " keys: " << packed.size() << " bytes of DTMI, " << text.size() << " bytes of JSON" << std::endl;
+
+  for (int format = 0; format < 2; format++){
+    std::string checked;
+    for (int useArena = 0; useArena < 2; useArena++){
+      JSON::Arena::setEnabled(useArena);
+      long long unsigned int parseNs = 0;
+      long long unsigned int freeNs = 0;
+      JSON::Value tree = parseRounds(format ? text : packed, !format, rounds, parseNs, freeNs);
+      std::cout << (format ? "fromString" : "fromDTMI") << (useArena ? " (arena): " : " (heap): ");
+      std::cout << "parse " << parseNs / rounds / 1000000 << " ms, destroy " << freeNs / rounds / 1000000 << " ms" << std::endl;
+      if ( !format && tree.toPacked() != packed){
+        std::cerr << "DTMI tree differs from the original" << std::endl;
+        failures++;
+      }
+      if (useArena && tree.toPacked() != checked){
+        std::cerr << "Arena tree differs from the heap tree" << std::endl;
+        failures++;
+      }
+      checked = tree.toPacked();
+    }
+  }
+  JSON::Arena::setEnabled(true);
+  if (failures){
+    std::cerr << failures << " failures" << std::endl;
+  }
+  return failures ? 1 : 0;
+}